@@ -16,8 +16,18 @@ manual margins to correct optical alignment issues caused by icon shapes.
 */
 // ==/WindhawkModReadme==
 
+// ==WindhawkModSettings==
+/*
+- logMetrics: false
+  $name: Log metrics
+  $description: Every 10 seconds, log how long the Measure hook takes and how often its caches hit, and log the panels it adjusts (rate-limited)
+*/
+// ==/WindhawkModSettings==
+
 #include <windows.h>
-#include <string>
+#include <atomic>
+#include <cstdint>
+#include <cwchar>
 
 // =============================================================
 //  CONFIGURATION
@@ -129,49 +139,477 @@ WindowsDeleteString_t pWindowsDeleteString = nullptr;
 typedef HRESULT (WINAPI *Measure_t)(void* pThis, XamlSize availableSize);
 Measure_t pOriginalMeasure = nullptr;
 
-std::wstring GetRuntimeClassName(void* pInspectable) {
-    if (!pInspectable || !pWindowsGetStringRawBuffer) return L"";
-    IInspectable_Manual* pInsp = (IInspectable_Manual*)pInspectable;
-    void* hClassName = nullptr;
-    
-    if (SUCCEEDED(pInsp->GetRuntimeClassName(&hClassName))) {
-        UINT32 length = 0;
-        PCWSTR buffer = pWindowsGetStringRawBuffer(hClassName, &length);
-        std::wstring name(buffer, length);
-        pWindowsDeleteString(hClassName);
-        return name;
+// An element's runtime class name, read in place from the HSTRING that
+// GetRuntimeClassName returns instead of being copied into a std::wstring.
+// The HSTRING is deleted when the view goes out of scope, so classifying an
+// element never allocates.
+struct ClassNameView {
+    void* hString = nullptr;
+    PCWSTR text = L"";
+    UINT32 length = 0;
+
+    explicit ClassNameView(void* pInspectable) {
+        if (!pInspectable || !pWindowsGetStringRawBuffer || !pWindowsDeleteString) return;
+        if (FAILED(((IInspectable_Manual*)pInspectable)->GetRuntimeClassName(&hString))) {
+            hString = nullptr;
+            return;
+        }
+
+        PCWSTR buffer = pWindowsGetStringRawBuffer(hString, &length);
+        if (buffer) {
+            text = buffer;
+        } else {
+            length = 0;
+        }
+    }
+
+    ~ClassNameView() {
+        if (hString) pWindowsDeleteString(hString);
     }
-    return L"";
+
+    ClassNameView(const ClassNameView&) = delete;
+    ClassNameView& operator=(const ClassNameView&) = delete;
+};
+
+// A class name to check against. A name of another length is rejected
+// without reading it; only a name of the same length is compared.
+struct ClassNameKey {
+    PCWSTR text;
+    UINT32 length;
+
+    template <size_t N>
+    constexpr ClassNameKey(const wchar_t (&literal)[N]) : text(literal), length(N - 1) {}
+
+    bool Matches(const ClassNameView& name) const {
+        return name.length == length && wmemcmp(name.text, text, length) == 0;
+    }
+};
+
+constexpr ClassNameKey STACK_PANEL_CLASS(L"Windows.UI.Xaml.Controls.StackPanel");
+
+// Owning reference to one of the manual interfaces. It's released exactly
+// once, when it goes out of scope or is reset, so no early return can leak it.
+template <typename T>
+struct ComRef {
+    T* p = nullptr;
+
+    ComRef() = default;
+    ComRef(const ComRef&) = delete;
+    ComRef& operator=(const ComRef&) = delete;
+
+    ~ComRef() { Reset(); }
+
+    void Reset() {
+        if (p) ((IUnknown_Manual*)p)->Release();
+        p = nullptr;
+    }
+
+    // For out-parameters that return a reference: QueryInterface, get_Children, get_At
+    void** Put() {
+        Reset();
+        return (void**)&p;
+    }
+
+    T* operator->() const { return p; }
+    explicit operator bool() const { return p != nullptr; }
+};
+
+template <typename T>
+void QueryManual(void* pUnknown, REFIID iid, ComRef<T>& result) {
+    result.Reset();
+    if (pUnknown) ((IUnknown_Manual*)pUnknown)->QueryInterface(iid, result.Put());
 }
 
-bool IsTargetStackPanel(void* pElement) {
-    // Check if this is the StackPanel inside the tray
-    // We check class name + number of children (simple heuristic)
-    if (GetRuntimeClassName(pElement) != L"Windows.UI.Xaml.Controls.StackPanel") return false;
-
-    IPanel_Manual* pPanel = nullptr;
-    if (SUCCEEDED(((IUnknown_Manual*)pElement)->QueryInterface(IID_IPanel, (void**)&pPanel))) {
-        void* pChildrenRaw = nullptr;
-        if (SUCCEEDED(pPanel->get_Children(&pChildrenRaw))) {
-            IVector_Manual* pChildren = nullptr;
-            ((IUnknown_Manual*)pChildrenRaw)->QueryInterface(IID_IVector, (void**)&pChildren);
-            
-            unsigned int size = 0;
-            if (pChildren) {
-                pChildren->get_Size(&size);
-                pChildren->Release();
+// =============================================================
+//  Metrics
+// =============================================================
+
+// With logMetrics on, MeasureHook's own time goes into a log-linear histogram
+// (8 sub-buckets per power of two, so a reading is off by at most 12.5%) next
+// to a few counters, and a summary is logged every MEASURE_REPORT_INTERVAL_MS.
+// Each thread records into a shard of its own with plain relaxed stores, so
+// recording never contends; the report merges all shards. With the setting
+// off nothing is timed or counted.
+
+enum class HookMetric {
+    Measure,
+    Count
+};
+
+enum class CounterMetric {
+    Calls,
+    CacheHits,
+    CacheMisses,
+    Targets,
+    MarginsApplied,
+    Count
+};
+
+struct LatencySummary {
+    uint64_t count;
+    uint64_t meanNs;
+    uint64_t p50Ns;
+    uint64_t p90Ns;
+    uint64_t p99Ns;
+    uint64_t maxNs;
+};
+
+// One per mod: the thread's shard pointer is a function-level thread_local
+class MetricsRegistry {
+public:
+    static constexpr size_t kMaxShards = 16;
+    static constexpr size_t kSubBits = 3;
+    static constexpr size_t kMaxExponent = 40;  // ~18 minutes in ns
+    static constexpr size_t kBuckets = ((kMaxExponent - kSubBits + 1) << kSubBits) + (size_t{1} << kSubBits);
+
+    // Shards live until the module unloads, when no hook can still be running
+    ~MetricsRegistry() {
+        for (auto& shard : m_shards) delete shard.load(std::memory_order_relaxed);
+    }
+
+    void RecordLatency(HookMetric hook, uint64_t ns) {
+        Shard* shard = ThreadShard();
+        if (!shard) return;
+
+        Histogram& histogram = shard->histograms[static_cast<size_t>(hook)];
+        Bump(histogram.buckets[BucketOf(ns)], 1);
+        Bump(histogram.totalNs, ns);
+        if (ns > histogram.maxNs.load(std::memory_order_relaxed)) {
+            histogram.maxNs.store(ns, std::memory_order_relaxed);
+        }
+    }
+
+    void Count(CounterMetric counter, uint64_t amount = 1) {
+        if (Shard* shard = ThreadShard()) Bump(shard->counters[static_cast<size_t>(counter)], amount);
+    }
+
+    LatencySummary ReadLatency(HookMetric hook) const {
+        uint64_t buckets[kBuckets] = {};
+        uint64_t totalNs = 0;
+        LatencySummary summary = {};
+        ForEachShard([&](const Shard& shard) {
+            const Histogram& histogram = shard.histograms[static_cast<size_t>(hook)];
+            for (size_t i = 0; i < kBuckets; i++) {
+                uint64_t n = histogram.buckets[i].load(std::memory_order_relaxed);
+                buckets[i] += n;
+                summary.count += n;
             }
-            
-            if (pChildrenRaw) ((IUnknown_Manual*)pChildrenRaw)->Release();
-            pPanel->Release();
+            totalNs += histogram.totalNs.load(std::memory_order_relaxed);
+            uint64_t maxNs = histogram.maxNs.load(std::memory_order_relaxed);
+            if (maxNs > summary.maxNs) summary.maxNs = maxNs;
+        });
+
+        if (summary.count == 0) return summary;
+        summary.meanNs = totalNs / summary.count;
+        summary.p50Ns = Percentile(buckets, summary.count, 50);
+        summary.p90Ns = Percentile(buckets, summary.count, 90);
+        summary.p99Ns = Percentile(buckets, summary.count, 99);
+        return summary;
+    }
+
+    uint64_t ReadCounter(CounterMetric counter) const {
+        uint64_t total = 0;
+        ForEachShard([&](const Shard& shard) {
+            total += shard.counters[static_cast<size_t>(counter)].load(std::memory_order_relaxed);
+        });
+        return total;
+    }
+
+private:
+    struct Histogram {
+        std::atomic<uint64_t> buckets[kBuckets] = {};
+        std::atomic<uint64_t> totalNs{0};
+        std::atomic<uint64_t> maxNs{0};
+    };
+
+    struct Shard {
+        Histogram histograms[static_cast<size_t>(HookMetric::Count)];
+        std::atomic<uint64_t> counters[static_cast<size_t>(CounterMetric::Count)] = {};
+    };
+
+    static size_t BucketOf(uint64_t ns) {
+        if (ns < (uint64_t{1} << kSubBits)) return static_cast<size_t>(ns);
+
+        size_t exponent = 0;
+        for (uint64_t v = ns; v >>= 1;) exponent++;
+        if (exponent > kMaxExponent) return kBuckets - 1;
+
+        size_t sub = static_cast<size_t>(ns >> (exponent - kSubBits)) & ((size_t{1} << kSubBits) - 1);
+        return ((exponent - kSubBits + 1) << kSubBits) + sub;
+    }
+
+    // Smallest value that lands in the bucket
+    static uint64_t BucketFloor(size_t bucket) {
+        if (bucket < (size_t{1} << kSubBits)) return bucket;
+
+        size_t exponent = (bucket >> kSubBits) + kSubBits - 1;
+        uint64_t sub = bucket & ((size_t{1} << kSubBits) - 1);
+        return ((uint64_t{1} << kSubBits) + sub) << (exponent - kSubBits);
+    }
+
+    static uint64_t Percentile(const uint64_t* buckets, uint64_t count, uint64_t percent) {
+        uint64_t rank = (count * percent + 99) / 100;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBuckets; i++) {
+            seen += buckets[i];
+            if (seen >= rank) return BucketFloor(i);
+        }
+        return BucketFloor(kBuckets - 1);
+    }
+
+    // Only the owning thread writes a shard, so no read-modify-write is needed
+    static void Bump(std::atomic<uint64_t>& value, uint64_t amount) {
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    template <typename Visit>
+    void ForEachShard(Visit&& visit) const {
+        size_t count = m_shardCount.load(std::memory_order_acquire);
+        for (size_t i = 0; i < count && i < kMaxShards; i++) {
+            if (const Shard* shard = m_shards[i].load(std::memory_order_acquire)) visit(*shard);
+        }
+    }
+
+    // Created on a thread's first record; threads past kMaxShards go unrecorded
+    Shard* ThreadShard() {
+        thread_local Shard* shard = nullptr;
+        thread_local bool assigned = false;
+        if (!assigned) {
+            assigned = true;
+            size_t index = m_shardCount.fetch_add(1, std::memory_order_acq_rel);
+            if (index < kMaxShards) {
+                shard = new Shard();
+                m_shards[index].store(shard, std::memory_order_release);
+            }
+        }
+        return shard;
+    }
+
+    std::atomic<Shard*> m_shards[kMaxShards] = {};
+    std::atomic<size_t> m_shardCount{0};
+};
+
+const ULONGLONG MEASURE_REPORT_INTERVAL_MS = 10000;
+
+std::atomic<bool> logMetrics{false};
+MetricsRegistry metrics;
+std::atomic<ULONGLONG> lastMetricsReport{0};
+LARGE_INTEGER qpcFrequency;
+
+void CountMetric(CounterMetric counter, ULONGLONG amount = 1) {
+    if (logMetrics.load(std::memory_order_relaxed)) metrics.Count(counter, amount);
+}
+
+void ReportMetrics() {
+    LatencySummary latency = metrics.ReadLatency(HookMetric::Measure);
+    if (!latency.count) return;
+
+    Wh_Log(L"[Measure] calls=%llu hits=%llu misses=%llu targets=%llu margins=%llu",
+           metrics.ReadCounter(CounterMetric::Calls), metrics.ReadCounter(CounterMetric::CacheHits),
+           metrics.ReadCounter(CounterMetric::CacheMisses), metrics.ReadCounter(CounterMetric::Targets),
+           metrics.ReadCounter(CounterMetric::MarginsApplied));
+    Wh_Log(L"[Measure] latency mean=%lluns p50=%lluns p90=%lluns p99=%lluns max=%lluns",
+           latency.meanNs, latency.p50Ns, latency.p90Ns, latency.p99Ns, latency.maxNs);
+}
+
+// Time spent in MeasureHook itself, before the original Measure runs
+void RecordMeasureLatency(const LARGE_INTEGER& start, ULONGLONG now) {
+    LARGE_INTEGER end;
+    QueryPerformanceCounter(&end);
+
+    ULONGLONG ns = (ULONGLONG)((end.QuadPart - start.QuadPart) * 1e9 / (double)qpcFrequency.QuadPart);
+    metrics.RecordLatency(HookMetric::Measure, ns);
+    metrics.Count(CounterMetric::Calls);
 
-            // The tray usually has exactly 3 items in that stack: Net, Sound, Batt
-            // Or 4 if Mic is active. We only act if there are 3 or 4.
-            return (size >= 3 && size <= 5);
+    // Whichever thread notices the interval has passed reports for everyone
+    ULONGLONG last = lastMetricsReport.load(std::memory_order_relaxed);
+    if (now - last < MEASURE_REPORT_INTERVAL_MS) return;
+    if (!lastMetricsReport.compare_exchange_strong(last, now, std::memory_order_relaxed)) return;
+    ReportMetrics();
+}
+
+// =============================================================
+//  Rate-Limited Logging
+// =============================================================
+
+// Measure can fire thousands of times a second during taskbar animations, so
+// per-call log sites go through a limiter of their own. Only every Nth call is
+// considered at all, and those pass a token bucket (GCRA: one CAS on the
+// theoretical arrival time, no lock). The next line that gets through is
+// preceded by how many were dropped.
+
+struct LogRateLimiter {
+    ULONGLONG intervalUs;     // 1 / rate
+    ULONGLONG toleranceUs;    // burst allowance
+    ULONGLONG sampleEvery;
+    std::atomic<ULONGLONG> arrival{0};
+    std::atomic<ULONGLONG> calls{0};
+    std::atomic<ULONGLONG> suppressed{0};
+
+    constexpr LogRateLimiter(ULONGLONG perSecond, ULONGLONG burst, ULONGLONG sampleEvery)
+        : intervalUs(1000000 / perSecond), toleranceUs(1000000 / perSecond * (burst - 1)),
+          sampleEvery(sampleEvery) {}
+
+    // On true, *dropped is the number of calls suppressed since the last one allowed
+    bool Allow(ULONGLONG nowMs, ULONGLONG* dropped) {
+        if (sampleEvery > 1 && calls.fetch_add(1, std::memory_order_relaxed) % sampleEvery != 0) {
+            suppressed.fetch_add(1, std::memory_order_relaxed);
+            return false;
         }
-        pPanel->Release();
+
+        ULONGLONG now = nowMs * 1000;
+        ULONGLONG tat = arrival.load(std::memory_order_relaxed);
+        for (;;) {
+            ULONGLONG base = tat > now ? tat : now;
+            if (base - now > toleranceUs) {
+                suppressed.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            if (arrival.compare_exchange_weak(tat, base + intervalUs, std::memory_order_relaxed)) break;
+        }
+
+        *dropped = suppressed.exchange(0, std::memory_order_relaxed);
+        return true;
+    }
+};
+
+const ULONGLONG MEASURE_LOG_PER_SEC = 5;
+const ULONGLONG MEASURE_LOG_BURST = 10;
+const ULONGLONG MEASURE_LOG_SAMPLE_EVERY = 4;
+
+// =============================================================
+//  Verdict Cache
+// =============================================================
+
+// MeasureHook runs for every UIElement::Measure in explorer, so each element's
+// class is remembered by address. Elements known not to be StackPanels are
+// rejected with one lookup and no COM calls. Known StackPanels skip the class
+// name check but still have their children counted, since that changes.
+// An address can be reused once its element is freed, so the whole cache is
+// dropped every VERDICT_LIFETIME_MS by bumping its generation.
+
+const ULONGLONG VERDICT_LIFETIME_MS = 2000;
+
+enum class Verdict : unsigned char {
+    Unknown,
+    NotStackPanel,
+    StackPanel,
+};
+
+// Direct-mapped: a colliding element simply evicts the previous one. A layout
+// pass over the tray measures a few dozen elements, so 64 slots (1 KB) do.
+struct VerdictCache {
+    static const size_t SIZE_BITS = 6;
+    static const size_t SIZE = 1 << SIZE_BITS;
+
+    struct Entry {
+        void* element;
+        unsigned int generation;
+        Verdict verdict;
+    };
+
+    Entry entries[SIZE] = {};
+    unsigned int generation = 1;
+    ULONGLONG generationStart = 0;
+
+    void Tick(ULONGLONG now) {
+        if (now - generationStart >= VERDICT_LIFETIME_MS) {
+            generation++;
+            generationStart = now;
+        }
+    }
+
+    Verdict Lookup(void* element) const {
+        const Entry& entry = entries[Index(element)];
+        if (entry.element != element || entry.generation != generation) return Verdict::Unknown;
+        return entry.verdict;
+    }
+
+    void Store(void* element, Verdict verdict) {
+        entries[Index(element)] = { element, generation, verdict };
+    }
+
+    static size_t Index(void* element) {
+        return (size_t)((((UINT_PTR)element >> 4) * 0x9E3779B97F4A7C15ull) >> (64 - SIZE_BITS));
     }
-    return false;
+};
+
+// Per-thread, like the layout passes that call Measure. Only the pointer is
+// thread_local; the caches themselves sit in a fixed pool that lives as long
+// as the mod, so nothing has to be freed from another thread at unload. The
+// few XAML threads claim one each on their first Measure; any thread past
+// MAX_VERDICT_CACHES classifies every element instead.
+const size_t MAX_VERDICT_CACHES = 16;
+
+VerdictCache verdictCaches[MAX_VERDICT_CACHES];
+std::atomic<size_t> verdictCachesClaimed{0};
+
+VerdictCache* ThreadVerdictCache() {
+    thread_local VerdictCache* cache = nullptr;
+    thread_local bool claimed = false;
+    if (!claimed) {
+        claimed = true;
+        size_t index = verdictCachesClaimed.fetch_add(1, std::memory_order_relaxed);
+        if (index < MAX_VERDICT_CACHES) cache = &verdictCaches[index];
+    }
+    return cache;
+}
+
+// =============================================================
+//  Panel Interfaces
+// =============================================================
+
+// A target StackPanel's children take three QueryInterface/Release pairs to
+// reach, plus one per child for its IFrameworkElement. They are reached once
+// per Measure and released when it returns, on the thread that owns the
+// elements. Nothing is kept between calls: an owning cache would release
+// XAML objects at arbitrary points, and a non-owning one could outlive them.
+// The verdict cache already keeps every other element away from these calls.
+
+struct PanelInterfaces {
+    ComRef<IPanel_Manual> panel;
+    ComRef<IVector_Manual> children;
+
+    bool Query(void* element) {
+        QueryManual(element, IID_IPanel, panel);
+        if (!panel) return false;
+
+        ComRef<IUnknown_Manual> childrenRaw;
+        if (FAILED(panel->get_Children(childrenRaw.Put())) || !childrenRaw) return false;
+
+        QueryManual(childrenRaw.p, IID_IVector, children);
+        return (bool)children;
+    }
+};
+
+// On a match, panel holds the element's interfaces and *count its number of
+// children
+bool IsTargetStackPanel(void* pElement, VerdictCache* verdicts, PanelInterfaces& panel, unsigned int* count) {
+    // Check if this is the StackPanel inside the tray
+    // We check class name + number of children (simple heuristic)
+    Verdict verdict = verdicts ? verdicts->Lookup(pElement) : Verdict::Unknown;
+    if (verdict == Verdict::Unknown) {
+        CountMetric(CounterMetric::CacheMisses);
+        verdict = STACK_PANEL_CLASS.Matches(ClassNameView(pElement))
+            ? Verdict::StackPanel
+            : Verdict::NotStackPanel;
+        if (verdicts) verdicts->Store(pElement, verdict);
+    } else {
+        CountMetric(CounterMetric::CacheHits);
+    }
+
+    if (verdict != Verdict::StackPanel) return false;
+
+    if (!panel.Query(pElement)) return false;
+
+    unsigned int size = 0;
+    if (FAILED(panel.children->get_Size(&size))) return false;
+
+    *count = size;
+
+    // The tray usually has exactly 3 items in that stack: Net, Sound, Batt
+    // Or 4 if Mic is active. We only act if there are 3 or 4.
+    return (size >= 3 && size <= 5);
 }
 
 // =============================================================
@@ -179,60 +617,61 @@ bool IsTargetStackPanel(void* pElement) {
 // =============================================================
 
 HRESULT WINAPI MeasureHook(void* pThis, XamlSize availableSize) {
+    bool timed = logMetrics.load(std::memory_order_relaxed);
+    LARGE_INTEGER start;
+    if (timed) QueryPerformanceCounter(&start);
+
+    ULONGLONG now = GetTickCount64();
+    VerdictCache* verdicts = ThreadVerdictCache();
+    if (verdicts) verdicts->Tick(now);
+
     // Run logic before measurement to set properties
-    if (IsTargetStackPanel(pThis)) {
-        IPanel_Manual* pPanel = nullptr;
-        ((IUnknown_Manual*)pThis)->QueryInterface(IID_IPanel, (void**)&pPanel);
-        
-        void* pChildrenRaw = nullptr;
-        pPanel->get_Children(&pChildrenRaw);
-        
-        IVector_Manual* pChildren = nullptr;
-        ((IUnknown_Manual*)pChildrenRaw)->QueryInterface(IID_IVector, (void**)&pChildren);
-        
-        unsigned int count = 0;
-        pChildren->get_Size(&count);
-        
+    PanelInterfaces panel;
+    unsigned int count = 0;
+    if (IsTargetStackPanel(pThis, verdicts, panel, &count)) {
+        CountMetric(CounterMetric::Targets);
+
+        // Only with logMetrics on, so the limiter's atomics stay off the default path
+        static LogRateLimiter targetLog(MEASURE_LOG_PER_SEC, MEASURE_LOG_BURST, MEASURE_LOG_SAMPLE_EVERY);
+        ULONGLONG dropped;
+        if (timed && targetLog.Allow(now, &dropped)) {
+            if (dropped) Wh_Log(L"[Measure] ... suppressed %llu target messages", dropped);
+            Wh_Log(L"[Measure] target panel=%p children=%u", pThis, count);
+        }
+
         for (unsigned int i = 0; i < count; i++) {
-            void* pItemRaw = nullptr;
-            pChildren->get_At(i, &pItemRaw);
+            ComRef<IUnknown_Manual> item;
+            panel.children->get_At(i, item.Put());
             
-            if (pItemRaw) {
-                IFrameworkElement_Manual* pFe = nullptr;
-                ((IUnknown_Manual*)pItemRaw)->QueryInterface(IID_IFrameworkElement, (void**)&pFe);
-                
-                if (pFe) {
-                    // Reset Margin
-                    XamlThickness m = {0,0,0,0};
-
-                    // INDEX 0 = TOP (Wi-Fi)
-                    if (i == 0) {
-                        m = { WIFI_MARGIN_LEFT, WIFI_MARGIN_TOP, WIFI_MARGIN_RIGHT, WIFI_MARGIN_BOTTOM };
-                    }
-                    // INDEX 2 = BOTTOM (Battery)
-                    // Note: If you have a Microphone icon, Battery might be Index 3. 
-                    // It is safer to check the last index.
-                    else if (i == count - 1) { 
-                        m = { BATT_MARGIN_LEFT, BATT_MARGIN_TOP, BATT_MARGIN_RIGHT, BATT_MARGIN_BOTTOM };
-                    }
-
-                    pFe->put_Margin(m);
-                    
-                    // Force Center Alignment on the container
-                    // 2 = Center
-                    pFe->put_HorizontalAlignment(2); 
-
-                    pFe->Release();
+            ComRef<IFrameworkElement_Manual> pFe;
+            QueryManual(item.p, IID_IFrameworkElement, pFe);
+            if (pFe) {
+                // Reset Margin
+                XamlThickness m = {0,0,0,0};
+
+                // INDEX 0 = TOP (Wi-Fi)
+                if (i == 0) {
+                    m = { WIFI_MARGIN_LEFT, WIFI_MARGIN_TOP, WIFI_MARGIN_RIGHT, WIFI_MARGIN_BOTTOM };
+                }
+                // INDEX 2 = BOTTOM (Battery)
+                // Note: If you have a Microphone icon, Battery might be Index 3. 
+                // It is safer to check the last index.
+                else if (i == count - 1) { 
+                    m = { BATT_MARGIN_LEFT, BATT_MARGIN_TOP, BATT_MARGIN_RIGHT, BATT_MARGIN_BOTTOM };
                 }
-                ((IUnknown_Manual*)pItemRaw)->Release();
+
+                pFe->put_Margin(m);
+                CountMetric(CounterMetric::MarginsApplied);
+                
+                // Force Center Alignment on the container
+                // 2 = Center
+                pFe->put_HorizontalAlignment(2); 
             }
         }
-
-        if (pChildren) pChildren->Release();
-        if (pChildrenRaw) ((IUnknown_Manual*)pChildrenRaw)->Release();
-        pPanel->Release();
     }
 
+    if (timed) RecordMeasureLatency(start, now);
+
     return pOriginalMeasure(pThis, availableSize);
 }
 
@@ -243,6 +682,9 @@ HRESULT WINAPI MeasureHook(void* pThis, XamlSize availableSize) {
 BOOL Wh_ModInit() {
     Wh_Log(L"Init Pixel Aligner");
 
+    QueryPerformanceFrequency(&qpcFrequency);
+    logMetrics = Wh_GetIntSetting(L"logMetrics") != 0;
+
     HMODULE hComBase = LoadLibrary(L"combase.dll");
     if (hComBase) {
         pWindowsGetStringRawBuffer = (WindowsGetStringRawBuffer_t)GetProcAddress(hComBase, "WindowsGetStringRawBuffer");
@@ -264,4 +706,8 @@ BOOL Wh_ModInit() {
 
 void Wh_ModUninit() {
     Wh_Log(L"Uninit");
+}
+
+void Wh_ModSettingsChanged() {
+    logMetrics = Wh_GetIntSetting(L"logMetrics") != 0;
 }
\ No newline at end of file
@@ -19,8 +19,7 @@ property of the target StackPanel to Vertical (0).
 // ==/WindhawkModReadme==
 
 #include <windows.h>
-#include <string>
-#include <vector>
+#include <cwchar>
 #include <unknwn.h>
 
 // -------------------------------------------------------------------------
@@ -28,8 +27,7 @@ property of the target StackPanel to Vertical (0).
 // -------------------------------------------------------------------------
 
 // Helper to handle HSTRING (basic string manipulation for WinRT)
-typedef HRESULT (WINAPI *WindowsCreateStringReference_t)(PCWSTR sourceString, UINT32 length, void* hstringHeader, void** string);
-typedef HRESULT (WINAPI *WindowsGetStringRawBuffer_t)(void* string, UINT32* length);
+typedef PCWSTR (WINAPI *WindowsGetStringRawBuffer_t)(void* string, UINT32* length);
 typedef HRESULT (WINAPI *WindowsDeleteString_t)(void* string);
 
 WindowsGetStringRawBuffer_t pWindowsGetStringRawBuffer = nullptr;
@@ -73,28 +71,57 @@ const wchar_t* SYMBOL_PutOrientation = L"?put_Orientation@StackPanel@Controls@Xa
 // Helpers
 // -------------------------------------------------------------------------
 
-// Helper to check Runtime Class Name
-std::wstring GetRuntimeClassName(void* pInspectable) {
-    if (!pInspectable || !pWindowsGetStringRawBuffer) return L"";
+// Runtime Class Name, read in place from the HSTRING instead of copied out.
+// The HSTRING is deleted when the view goes out of scope, so checking a
+// class name never allocates.
+struct ClassNameView {
+    void* hString = nullptr;
+    PCWSTR text = L"";
+    UINT32 length = 0;
+
+    explicit ClassNameView(void* pInspectable) {
+        if (!pInspectable || !pWindowsGetStringRawBuffer || !pWindowsDeleteString) return;
+        if (FAILED(((IInspectable_Local*)pInspectable)->GetRuntimeClassName(&hString))) {
+            hString = nullptr;
+            return;
+        }
 
-    IInspectable_Local* pInsp = (IInspectable_Local*)pInspectable;
-    void* hClassName = nullptr;
-    
-    if (SUCCEEDED(pInsp->GetRuntimeClassName(&hClassName))) {
-        UINT32 length = 0;
-        PCWSTR buffer = pWindowsGetStringRawBuffer(hClassName, &length);
-        std::wstring name(buffer, length);
-        pWindowsDeleteString(hClassName);
-        return name;
+        PCWSTR buffer = pWindowsGetStringRawBuffer(hString, &length);
+        if (buffer) {
+            text = buffer;
+        } else {
+            length = 0;
+        }
     }
-    return L"";
-}
+
+    ~ClassNameView() {
+        if (hString) pWindowsDeleteString(hString);
+    }
+
+    ClassNameView(const ClassNameView&) = delete;
+    ClassNameView& operator=(const ClassNameView&) = delete;
+};
+
+// A class name to check against. A name of another length is rejected
+// without reading it; only a name of the same length is compared.
+struct ClassNameKey {
+    PCWSTR text;
+    UINT32 length;
+
+    template <size_t N>
+    constexpr ClassNameKey(const wchar_t (&literal)[N]) : text(literal), length(N - 1) {}
+
+    bool Matches(const ClassNameView& name) const {
+        return name.length == length && wmemcmp(name.text, text, length) == 0;
+    }
+};
+
+constexpr ClassNameKey STACK_PANEL_CLASS(L"Windows.UI.Xaml.Controls.StackPanel");
 
 // Logic to identify the specific StackPanel inside ControlCenterButton
 bool IsTargetStackPanel(void* pElement) {
     // 1. Check Class Name
-    std::wstring className = GetRuntimeClassName(pElement);
-    if (className != L"Windows.UI.Xaml.Controls.StackPanel") {
+    if (!STACK_PANEL_CLASS.Matches(ClassNameView(pElement))) {
         return false;
     }
 
@@ -132,8 +159,7 @@ bool IsTargetStackPanel(void* pElement) {
 void __fastcall MeasureHook(void* pThis, XamlSize availableSize) {
     // Only attempt logic if we found the setter
     if (pPutOrientation && pThis) {
-        std::wstring name = GetRuntimeClassName(pThis);
-        if (name == L"Windows.UI.Xaml.Controls.StackPanel") {
+        if (STACK_PANEL_CLASS.Matches(ClassNameView(pThis))) {
              // We want to verify this is the TRAY stack panel.
              // We can check if the current Orientation is Horizontal (1).
              // Since we don't have get_Orientation easily, we just set it to Vertical (0)
@@ -161,7 +187,6 @@ BOOL Wh_ModInit() {
 
     HMODULE hComBase = LoadLibrary(L"combase.dll");
     if (hComBase) {
-        pWindowsCreateStringReference = (WindowsCreateStringReference_t)GetProcAddress(hComBase, "WindowsCreateStringReference");
         pWindowsGetStringRawBuffer = (WindowsGetStringRawBuffer_t)GetProcAddress(hComBase, "WindowsGetStringRawBuffer");
         pWindowsDeleteString = (WindowsDeleteString_t)GetProcAddress(hComBase, "WindowsDeleteString");
     }
@@ -36,7 +36,8 @@ reliable hook that modifies icon positions at the correct callsite.
 #include <shellapi.h>
 #include <vector>
 #include <string>
-#include <mutex>
+#include <atomic>
+#include <cstdint>
 
 #include <windhawk_api.h>
 
@@ -56,8 +57,603 @@ struct IconCall {
     bool rectSet;       // whether original returned a rect
     bool markedSystem;  // heuristic that this is a system icon
 };
-static std::vector<IconCall> g_frameCalls;
-static std::mutex g_frameMutex;
+
+// Bounded lock-free multi-producer ring of fixed-size records (sequence-numbered
+// cells, as in Vyukov's bounded queue). Any thread can push without blocking;
+// only the thread holding g_consumerBusy pops.
+template <typename T, size_t Capacity>
+class CallRing {
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+    CallRing() {
+        for (size_t i = 0; i < Capacity; ++i) m_cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    // Returns false (and drops the record) when the ring is full
+    bool TryPush(const T& value) {
+        size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+        Cell* cell;
+        for (;;) {
+            cell = &m_cells[pos & (Capacity - 1)];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = m_enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->value = value;
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Single consumer only
+    bool TryPop(T& value) {
+        size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+        Cell& cell = m_cells[pos & (Capacity - 1)];
+        size_t seq = cell.sequence.load(std::memory_order_acquire);
+        if ((intptr_t)seq - (intptr_t)(pos + 1) < 0) return false;
+
+        value = cell.value;
+        cell.sequence.store(pos + Capacity, std::memory_order_release);
+        m_dequeuePos.store(pos + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    Cell m_cells[Capacity];
+    alignas(64) std::atomic<size_t> m_enqueuePos{0};
+    alignas(64) std::atomic<size_t> m_dequeuePos{0};
+};
+
+static const size_t kCallRingCapacity = 256;
+static CallRing<IconCall, kCallRingCapacity> g_frameCalls;
+static std::atomic<unsigned long long> g_droppedCalls{0};
+
+// Whoever sets this becomes the single consumer; other callers skip grouping
+// instead of waiting. The window below is only touched while it's held.
+static std::atomic_flag g_consumerBusy = ATOMIC_FLAG_INIT;
+
+// Set by a caller that found the consumer busy, so the consumer goes around
+// once more before it lets go
+static std::atomic<bool> g_consumePending{false};
+
+// Unique system identifiers seen in the current window, latest rect wins
+static IconCall g_window[kCallRingCapacity];
+static size_t g_windowCount = 0;
+static std::vector<IconCall*> g_toArrange;
+
+// Coalesces Shell_NotifyIconGetRect storms into one arrangement per window.
+// A window opens with its first identifier and closes once pollIntervalMs has
+// passed, or earlier when no new identifier has turned up for a quarter of
+// that. A threadpool timer closes a window whose calls have stopped, so a
+// burst is arranged without waiting for some later call. A window whose
+// identifiers and rects match the last published one is not recomputed. The
+// clock is injectable so timing can be driven by hand.
+class ArrangeScheduler {
+public:
+    using Clock = unsigned long long (*)();
+
+    struct Stats {
+        unsigned long long windows;
+        unsigned long long calls;
+        unsigned long long lastWindowCalls;
+        unsigned long long recomputes;
+        unsigned long long recomputesAvoided;
+    };
+
+    explicit ArrangeScheduler(Clock clock) : m_clock(clock) {}
+
+    void SetInterval(unsigned int ms) { m_intervalMs.store(ms, std::memory_order_relaxed); }
+
+    // Forces the next closed window to be recomputed (e.g. after a settings change)
+    void Invalidate() { m_invalidated.store(true, std::memory_order_relaxed); }
+
+    // Any thread
+    void RecordCall() { m_windowCalls.fetch_add(1, std::memory_order_relaxed); }
+
+    // Consumer only: a previously unseen identifier joined the current window
+    void NoteNewIdentifier() {
+        unsigned long long now = m_clock();
+        if (!m_windowOpen) {
+            m_windowOpen = true;
+            m_windowStart = now;
+        }
+        m_lastChange = now;
+    }
+
+    // Consumer only. Closes the window and returns true when it's due
+    bool CloseWindowIfDue() {
+        if (!m_windowOpen) return false;
+
+        unsigned long long now = m_clock();
+        unsigned long long interval = m_intervalMs.load(std::memory_order_relaxed);
+        bool elapsed = now - m_windowStart >= interval;
+        bool settled = now - m_lastChange >= interval / 4;
+        if (!elapsed && !settled) return false;
+
+        m_windowOpen = false;
+        unsigned long long calls = m_windowCalls.exchange(0, std::memory_order_relaxed);
+        m_stats.windows++;
+        m_stats.calls += calls;
+        m_stats.lastWindowCalls = calls;
+        return true;
+    }
+
+    // Consumer only
+    bool WindowOpen() const { return m_windowOpen; }
+
+    // Consumer only. Milliseconds until the open window is due, 0 if it already is
+    unsigned long long MsUntilDue() const {
+        unsigned long long now = m_clock();
+        unsigned long long interval = m_intervalMs.load(std::memory_order_relaxed);
+        unsigned long long elapsedAt = m_windowStart + interval;
+        unsigned long long settledAt = m_lastChange + interval / 4;
+        unsigned long long due = elapsedAt < settledAt ? elapsedAt : settledAt;
+        return due > now ? due - now : 0;
+    }
+
+    // Consumer only. Signature is an order-independent digest of the window
+    bool ShouldRecompute(unsigned long long signature) {
+        bool invalidated = m_invalidated.exchange(false, std::memory_order_relaxed);
+        if (m_havePublished && !invalidated && signature == m_lastSignature) {
+            m_stats.recomputesAvoided++;
+            return false;
+        }
+        m_havePublished = true;
+        m_lastSignature = signature;
+        m_stats.recomputes++;
+        return true;
+    }
+
+    void Reset() {
+        m_windowOpen = false;
+        m_havePublished = false;
+        m_windowCalls.store(0, std::memory_order_relaxed);
+    }
+
+    // Consumer only
+    const Stats& GetStats() const { return m_stats; }
+
+private:
+    Clock m_clock;
+    std::atomic<unsigned int> m_intervalMs{1000};
+    std::atomic<unsigned long long> m_windowCalls{0};
+    std::atomic<bool> m_invalidated{false};
+    bool m_windowOpen = false;
+    unsigned long long m_windowStart = 0;
+    unsigned long long m_lastChange = 0;
+    bool m_havePublished = false;
+    unsigned long long m_lastSignature = 0;
+    Stats m_stats = {};
+};
+
+static unsigned long long TickClock() { return GetTickCount64(); }
+
+static ArrangeScheduler g_scheduler(TickClock);
+
+// Per-call-site log limiter. The hook can fire thousands of times a second
+// during taskbar animations, so only every Nth call is considered, and those
+// must pass a token bucket (GCRA: one CAS on the theoretical arrival time, no
+// lock). The next line that gets through reports how many were dropped.
+class LogRateLimiter {
+public:
+    constexpr LogRateLimiter(unsigned long long perSecond, unsigned long long burst,
+                             unsigned long long sampleEvery)
+        : m_intervalUs(1000000 / perSecond),
+          m_toleranceUs(1000000 / perSecond * (burst - 1)),
+          m_sampleEvery(sampleEvery) {}
+
+    // On true, *dropped is the number of calls suppressed since the last one allowed
+    bool Allow(unsigned long long nowMs, unsigned long long* dropped) {
+        if (m_sampleEvery > 1 && m_calls.fetch_add(1, std::memory_order_relaxed) % m_sampleEvery != 0) {
+            m_suppressed.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        unsigned long long now = nowMs * 1000;
+        unsigned long long tat = m_arrival.load(std::memory_order_relaxed);
+        for (;;) {
+            unsigned long long base = tat > now ? tat : now;
+            if (base - now > m_toleranceUs) {
+                m_suppressed.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            if (m_arrival.compare_exchange_weak(tat, base + m_intervalUs, std::memory_order_relaxed)) break;
+        }
+
+        *dropped = m_suppressed.exchange(0, std::memory_order_relaxed);
+        return true;
+    }
+
+private:
+    unsigned long long m_intervalUs;
+    unsigned long long m_toleranceUs;
+    unsigned long long m_sampleEvery;
+    std::atomic<unsigned long long> m_arrival{0};
+    std::atomic<unsigned long long> m_calls{0};
+    std::atomic<unsigned long long> m_suppressed{0};
+};
+
+// Checks g_debugLogging first, so a disabled site costs one branch
+static bool ShouldLog(LogRateLimiter& limiter, const wchar_t* site) {
+    unsigned long long dropped;
+    if (!g_debugLogging || !limiter.Allow(GetTickCount64(), &dropped)) return false;
+    if (dropped) Wh_Log(L"[%s] ... suppressed %llu messages", site, dropped);
+    return true;
+}
+
+static LogRateLimiter g_callLog(10, 20, 1);
+static LogRateLimiter g_overrideLog(5, 10, 4);
+static LogRateLimiter g_ringFullLog(1, 1, 1);
+
+// Hook latency histogram and counters. Latencies go into log-linear buckets
+// (8 sub-buckets per power of two, so a reading is off by at most 12.5%). Each
+// thread records into a shard of its own with plain relaxed stores, so
+// recording never contends; the periodic report merges all shards. The hook is
+// only timed with debugLogging on.
+enum class HookMetric {
+    GetRectHook,
+    Count
+};
+
+enum class CounterMetric {
+    Arrangements,
+    RectsOverridden,
+    RectMapMisses,
+    Count
+};
+
+struct LatencySummary {
+    uint64_t count;
+    uint64_t meanNs;
+    uint64_t p50Ns;
+    uint64_t p90Ns;
+    uint64_t p99Ns;
+    uint64_t maxNs;
+};
+
+// One per mod: the thread's shard pointer is a function-level thread_local
+class MetricsRegistry {
+public:
+    static constexpr size_t kMaxShards = 16;
+    static constexpr size_t kSubBits = 3;
+    static constexpr size_t kMaxExponent = 40;  // ~18 minutes in ns
+    static constexpr size_t kBuckets = ((kMaxExponent - kSubBits + 1) << kSubBits) + (size_t{1} << kSubBits);
+
+    // Shards live until the module unloads, when no hook can still be running
+    ~MetricsRegistry() {
+        for (auto& shard : m_shards) delete shard.load(std::memory_order_relaxed);
+    }
+
+    void RecordLatency(HookMetric hook, uint64_t ns) {
+        Shard* shard = ThreadShard();
+        if (!shard) return;
+
+        Histogram& histogram = shard->histograms[static_cast<size_t>(hook)];
+        Bump(histogram.buckets[BucketOf(ns)], 1);
+        Bump(histogram.totalNs, ns);
+        if (ns > histogram.maxNs.load(std::memory_order_relaxed)) {
+            histogram.maxNs.store(ns, std::memory_order_relaxed);
+        }
+    }
+
+    void Count(CounterMetric counter, uint64_t amount = 1) {
+        if (Shard* shard = ThreadShard()) Bump(shard->counters[static_cast<size_t>(counter)], amount);
+    }
+
+    LatencySummary ReadLatency(HookMetric hook) const {
+        uint64_t buckets[kBuckets] = {};
+        uint64_t totalNs = 0;
+        LatencySummary summary = {};
+        ForEachShard([&](const Shard& shard) {
+            const Histogram& histogram = shard.histograms[static_cast<size_t>(hook)];
+            for (size_t i = 0; i < kBuckets; i++) {
+                uint64_t n = histogram.buckets[i].load(std::memory_order_relaxed);
+                buckets[i] += n;
+                summary.count += n;
+            }
+            totalNs += histogram.totalNs.load(std::memory_order_relaxed);
+            uint64_t maxNs = histogram.maxNs.load(std::memory_order_relaxed);
+            if (maxNs > summary.maxNs) summary.maxNs = maxNs;
+        });
+
+        if (summary.count == 0) return summary;
+        summary.meanNs = totalNs / summary.count;
+        summary.p50Ns = Percentile(buckets, summary.count, 50);
+        summary.p90Ns = Percentile(buckets, summary.count, 90);
+        summary.p99Ns = Percentile(buckets, summary.count, 99);
+        return summary;
+    }
+
+    uint64_t ReadCounter(CounterMetric counter) const {
+        uint64_t total = 0;
+        ForEachShard([&](const Shard& shard) {
+            total += shard.counters[static_cast<size_t>(counter)].load(std::memory_order_relaxed);
+        });
+        return total;
+    }
+
+private:
+    struct Histogram {
+        std::atomic<uint64_t> buckets[kBuckets] = {};
+        std::atomic<uint64_t> totalNs{0};
+        std::atomic<uint64_t> maxNs{0};
+    };
+
+    struct Shard {
+        Histogram histograms[static_cast<size_t>(HookMetric::Count)];
+        std::atomic<uint64_t> counters[static_cast<size_t>(CounterMetric::Count)] = {};
+    };
+
+    static size_t BucketOf(uint64_t ns) {
+        if (ns < (uint64_t{1} << kSubBits)) return static_cast<size_t>(ns);
+
+        size_t exponent = 0;
+        for (uint64_t v = ns; v >>= 1;) exponent++;
+        if (exponent > kMaxExponent) return kBuckets - 1;
+
+        size_t sub = static_cast<size_t>(ns >> (exponent - kSubBits)) & ((size_t{1} << kSubBits) - 1);
+        return ((exponent - kSubBits + 1) << kSubBits) + sub;
+    }
+
+    // Smallest value that lands in the bucket
+    static uint64_t BucketFloor(size_t bucket) {
+        if (bucket < (size_t{1} << kSubBits)) return bucket;
+
+        size_t exponent = (bucket >> kSubBits) + kSubBits - 1;
+        uint64_t sub = bucket & ((size_t{1} << kSubBits) - 1);
+        return ((uint64_t{1} << kSubBits) + sub) << (exponent - kSubBits);
+    }
+
+    static uint64_t Percentile(const uint64_t* buckets, uint64_t count, uint64_t percent) {
+        uint64_t rank = (count * percent + 99) / 100;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBuckets; i++) {
+            seen += buckets[i];
+            if (seen >= rank) return BucketFloor(i);
+        }
+        return BucketFloor(kBuckets - 1);
+    }
+
+    // Only the owning thread writes a shard, so no read-modify-write is needed
+    static void Bump(std::atomic<uint64_t>& value, uint64_t amount) {
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    template <typename Visit>
+    void ForEachShard(Visit&& visit) const {
+        size_t count = m_shardCount.load(std::memory_order_acquire);
+        for (size_t i = 0; i < count && i < kMaxShards; i++) {
+            if (const Shard* shard = m_shards[i].load(std::memory_order_acquire)) visit(*shard);
+        }
+    }
+
+    // Created on a thread's first record; threads past kMaxShards go unrecorded
+    Shard* ThreadShard() {
+        thread_local Shard* shard = nullptr;
+        thread_local bool assigned = false;
+        if (!assigned) {
+            assigned = true;
+            size_t index = m_shardCount.fetch_add(1, std::memory_order_acq_rel);
+            if (index < kMaxShards) {
+                shard = new Shard();
+                m_shards[index].store(shard, std::memory_order_release);
+            }
+        }
+        return shard;
+    }
+
+    std::atomic<Shard*> m_shards[kMaxShards] = {};
+    std::atomic<size_t> m_shardCount{0};
+};
+
+static MetricsRegistry g_metrics;
+static double g_nsPerQpcTick = 0;  // set in Wh_ModInit
+static const unsigned long long kMetricsReportIntervalMs = 10000;
+static std::atomic<unsigned long long> g_lastMetricsReport{0};
+
+static void ReportMetrics() {
+    LatencySummary summary = g_metrics.ReadLatency(HookMetric::GetRectHook);
+    if (!summary.count) return;
+
+    Wh_Log(L"[Metrics] hook: n=%llu mean=%lluns p50=%lluns p90=%lluns p99=%lluns max=%lluns",
+           summary.count, summary.meanNs, summary.p50Ns, summary.p90Ns, summary.p99Ns, summary.maxNs);
+    Wh_Log(L"[Metrics] arrangements=%llu rectsOverridden=%llu rectMapMisses=%llu",
+           g_metrics.ReadCounter(CounterMetric::Arrangements), g_metrics.ReadCounter(CounterMetric::RectsOverridden),
+           g_metrics.ReadCounter(CounterMetric::RectMapMisses));
+}
+
+// Times the hook's own work (not the original call). Whichever thread notices
+// the report interval has passed logs the merged summary. With debugLogging
+// off nothing is reported, so the clock isn't read at all.
+class ScopedHookTimer {
+public:
+    ScopedHookTimer() : m_timed(g_debugLogging) {
+        if (m_timed) QueryPerformanceCounter(&m_start);
+    }
+
+    ~ScopedHookTimer() {
+        if (!m_timed) return;
+        LARGE_INTEGER end;
+        QueryPerformanceCounter(&end);
+        g_metrics.RecordLatency(HookMetric::GetRectHook,
+                                (uint64_t)((end.QuadPart - m_start.QuadPart) * g_nsPerQpcTick));
+
+        unsigned long long now = GetTickCount64();
+        unsigned long long last = g_lastMetricsReport.load(std::memory_order_relaxed);
+        if (now - last < kMetricsReportIntervalMs) return;
+        if (g_lastMetricsReport.compare_exchange_strong(last, now, std::memory_order_relaxed)) ReportMetrics();
+    }
+
+private:
+    bool m_timed;
+    LARGE_INTEGER m_start;
+};
+
+// Persistent identifier -> stacked RECT map (open addressing, linear probing).
+// An identifier is its guidItem when non-zero, otherwise its (hWnd, uID) pair.
+// Each arrangement publishes a new generation; entries from older generations
+// are invisible to lookups and their slots are reused by later inserts.
+class StackedRectMap {
+public:
+    static const size_t kCapacity = 2048;
+
+    StackedRectMap() { InitializeSRWLock(&m_lock); }
+
+    bool Lookup(const NOTIFYICONIDENTIFIER& id, RECT* rect) {
+        Key key = MakeKey(id);
+        AcquireSRWLockShared(&m_lock);
+        bool found = false;
+        const Entry* e = FindLocked(key);
+        if (e && e->generation == m_generation) {
+            *rect = e->rect;
+            found = true;
+        }
+        ReleaseSRWLockShared(&m_lock);
+        return found;
+    }
+
+    // Replaces the current layout with the arranged calls
+    void Publish(IconCall* const* calls, size_t count) {
+        AcquireSRWLockExclusive(&m_lock);
+        m_generation++;
+        if (m_used + count > kCapacity / 2) {
+            // Mostly stale; start over rather than let probe chains grow
+            for (auto& e : m_entries) e.used = false;
+            m_used = 0;
+        }
+        for (size_t i = 0; i < count && m_used < kCapacity / 2; ++i) {
+            InsertLocked(MakeKey(calls[i]->id), calls[i]->rect);
+        }
+        ReleaseSRWLockExclusive(&m_lock);
+    }
+
+    void Clear() {
+        AcquireSRWLockExclusive(&m_lock);
+        for (auto& e : m_entries) e.used = false;
+        m_used = 0;
+        m_generation++;
+        ReleaseSRWLockExclusive(&m_lock);
+    }
+
+private:
+    struct Key {
+        GUID guid;
+        HWND hWnd;
+        UINT uID;
+        bool byGuid;
+    };
+
+    struct Entry {
+        Key key;
+        RECT rect;
+        unsigned int generation;
+        bool used;
+    };
+
+    static Key MakeKey(const NOTIFYICONIDENTIFIER& id) {
+        static const GUID emptyGuid = {};
+        Key key = {};
+        if (memcmp(&id.guidItem, &emptyGuid, sizeof(GUID)) != 0) {
+            key.guid = id.guidItem;
+            key.byGuid = true;
+        } else {
+            key.hWnd = id.hWnd;
+            key.uID = id.uID;
+        }
+        return key;
+    }
+
+    static bool SameKey(const Key& a, const Key& b) {
+        if (a.byGuid != b.byGuid) return false;
+        if (a.byGuid) return memcmp(&a.guid, &b.guid, sizeof(GUID)) == 0;
+        return a.hWnd == b.hWnd && a.uID == b.uID;
+    }
+
+    static size_t HomeSlot(const Key& key) {
+        unsigned long long h;
+        if (key.byGuid) {
+            unsigned long long words[2];
+            memcpy(words, &key.guid, sizeof(words));
+            h = words[0] ^ (words[1] * 0x9E3779B97F4A7C15ULL);
+        } else {
+            h = ((unsigned long long)(ULONG_PTR)key.hWnd >> 2) ^ ((unsigned long long)key.uID << 32);
+        }
+        h *= 0x9E3779B97F4A7C15ULL;
+        return (size_t)(h >> 32) & (kCapacity - 1);
+    }
+
+    const Entry* FindLocked(const Key& key) const {
+        size_t slot = HomeSlot(key);
+        for (size_t probe = 0; probe < kCapacity; ++probe) {
+            const Entry& e = m_entries[(slot + probe) & (kCapacity - 1)];
+            if (!e.used) return nullptr;
+            if (SameKey(e.key, key)) return &e;
+        }
+        return nullptr;
+    }
+
+    void InsertLocked(const Key& key, const RECT& rect) {
+        size_t slot = HomeSlot(key);
+        Entry* reusable = nullptr;
+        for (size_t probe = 0; probe < kCapacity; ++probe) {
+            Entry& e = m_entries[(slot + probe) & (kCapacity - 1)];
+            if (!e.used) {
+                if (!reusable) {
+                    reusable = &e;
+                    m_used++;
+                }
+                break;
+            }
+            if (SameKey(e.key, key)) {
+                reusable = &e;
+                break;
+            }
+            if (!reusable && e.generation != m_generation) reusable = &e;
+        }
+        if (!reusable) return;
+
+        reusable->key = key;
+        reusable->rect = rect;
+        reusable->generation = m_generation;
+        reusable->used = true;
+    }
+
+    SRWLOCK m_lock;
+    Entry m_entries[kCapacity] = {};
+    size_t m_used = 0;
+    unsigned int m_generation = 0;
+};
+
+static StackedRectMap g_stackedRects;
+
+// Override the caller's rect with the current stacked layout, if it has one
+static void ApplyStackedRect(const NOTIFYICONIDENTIFIER* lpniid, RECT* lprcIcon) {
+    RECT r;
+    if (!lprcIcon) return;
+    if (!g_stackedRects.Lookup(*lpniid, &r)) {
+        g_metrics.Count(CounterMetric::RectMapMisses);
+        return;
+    }
+
+    *lprcIcon = r;
+    g_metrics.Count(CounterMetric::RectsOverridden);
+    if (ShouldLog(g_overrideLog, L"Shell_NotifyIconGetRect_Hook")) {
+        Wh_Log(L"[Shell_NotifyIconGetRect_Hook] Overriding rect for caller hWnd=%p uID=%u -> (%d,%d)-(%d,%d)",
+               lpniid->hWnd, lpniid->uID, r.left, r.top, r.right, r.bottom);
+    }
+}
 
 // Helpers
 static std::wstring GuidToString(const GUID& g) {
@@ -72,17 +668,132 @@ static std::wstring HwndToClassName(HWND hwnd) {
     return L"";
 }
 
-static bool IsTaskbarWindow(HWND hwnd) {
-    if (!hwnd) return false;
-    // Check ancestor chain for Shell_TrayWnd
-    HWND cur = hwnd;
-    while (cur) {
+// The few window-system calls the taskbar check needs, so the verdict cache
+// can run against a fake hierarchy (FakeWindowSystem in tests/)
+class WindowSystem {
+public:
+    virtual ~WindowSystem() = default;
+    virtual bool ClassNameEquals(HWND hwnd, const wchar_t* className) = 0;
+    virtual HWND Parent(HWND hwnd) = 0;
+    virtual unsigned long long NowMs() = 0;
+};
+
+class Win32WindowSystem : public WindowSystem {
+public:
+    bool ClassNameEquals(HWND hwnd, const wchar_t* className) override {
         wchar_t cls[64] = {0};
-        GetClassNameW(cur, cls, _countof(cls));
-        if (_wcsicmp(cls, L"Shell_TrayWnd") == 0) return true;
-        cur = GetParent(cur);
+        GetClassNameW(hwnd, cls, _countof(cls));
+        return _wcsicmp(cls, className) == 0;
     }
-    return false;
+    HWND Parent(HWND hwnd) override { return GetParent(hwnd); }
+    unsigned long long NowMs() override { return GetTickCount64(); }
+};
+
+// HWND -> "has a Shell_TrayWnd ancestor" verdicts. Direct-mapped; each slot is
+// one 64-bit word (handle, verdict, generation, cost) so lookups and stores are
+// lock-free. HWNDs are 32-bit values even on x64. The generation advances every
+// kVerdictLifetimeMs and on Invalidate(), so a destroyed-and-reused handle is
+// trusted for at most one lifetime.
+class TaskbarVerdictCache {
+public:
+    static const size_t kSlots = 1024;
+    static const unsigned long long kVerdictLifetimeMs = 2000;
+
+    struct Stats {
+        unsigned long long lookups;
+        unsigned long long hits;
+        unsigned long long savedCalls;  // GetClassNameW/GetParent calls skipped by hits
+    };
+
+    explicit TaskbarVerdictCache(WindowSystem& windows) : m_windows(windows) {}
+
+    bool IsTaskbarWindow(HWND hwnd) {
+        if (!hwnd) return false;
+        m_lookups.fetch_add(1, std::memory_order_relaxed);
+
+        unsigned int generation = CurrentGeneration();
+        bool verdict;
+        unsigned int cost;
+        if (Lookup(hwnd, generation, &verdict, &cost)) {
+            m_hits.fetch_add(1, std::memory_order_relaxed);
+            m_savedCalls.fetch_add(cost, std::memory_order_relaxed);
+            return verdict;
+        }
+
+        // Walk the ancestor chain, stopping early at a cached ancestor. Each
+        // visited window gets the same verdict with its own remaining cost.
+        HWND visited[kMaxChain];
+        unsigned int visitedCost[kMaxChain];
+        size_t count = 0;
+        unsigned int tailCost = 0;
+        verdict = false;
+        for (HWND cur = hwnd; cur; cur = m_windows.Parent(cur)) {
+            if (cur != hwnd && Lookup(cur, generation, &verdict, &tailCost)) break;
+            if (count < kMaxChain) {
+                visited[count] = cur;
+                visitedCost[count] = 0;
+                count++;
+            }
+            for (size_t i = 0; i < count; ++i) visitedCost[i]++;
+            if (m_windows.ClassNameEquals(cur, L"Shell_TrayWnd")) {
+                verdict = true;
+                break;
+            }
+            for (size_t i = 0; i < count; ++i) visitedCost[i]++;
+        }
+
+        for (size_t i = 0; i < count; ++i) Store(visited[i], generation, verdict, visitedCost[i] + tailCost);
+        return verdict;
+    }
+
+    void Invalidate() { m_epoch.fetch_add(1, std::memory_order_relaxed); }
+
+    Stats GetStats() const {
+        return {m_lookups.load(std::memory_order_relaxed), m_hits.load(std::memory_order_relaxed),
+                m_savedCalls.load(std::memory_order_relaxed)};
+    }
+
+private:
+    static const size_t kMaxChain = 32;
+
+    unsigned int CurrentGeneration() {
+        unsigned long long bucket = m_windows.NowMs() / kVerdictLifetimeMs;
+        // Generation 0 marks an empty slot
+        return (unsigned int)((bucket + m_epoch.load(std::memory_order_relaxed)) % 0x7FFF) + 1;
+    }
+
+    static size_t SlotOf(unsigned int handle) { return (size_t)((handle * 0x9E3779B1u) >> 22) & (kSlots - 1); }
+
+    // Layout: handle (32) | generation (15) | verdict (1) | cost (16)
+    bool Lookup(HWND hwnd, unsigned int generation, bool* verdict, unsigned int* cost) const {
+        unsigned int handle = (unsigned int)(ULONG_PTR)hwnd;
+        unsigned long long word = m_slots[SlotOf(handle)].load(std::memory_order_relaxed);
+        if ((unsigned int)(word >> 32) != handle || ((word >> 17) & 0x7FFF) != generation) return false;
+        *verdict = ((word >> 16) & 1) != 0;
+        *cost = (unsigned int)(word & 0xFFFF);
+        return true;
+    }
+
+    void Store(HWND hwnd, unsigned int generation, bool verdict, unsigned int cost) {
+        unsigned int handle = (unsigned int)(ULONG_PTR)hwnd;
+        unsigned long long word = ((unsigned long long)handle << 32) | ((unsigned long long)generation << 17) |
+                                  ((unsigned long long)(verdict ? 1 : 0) << 16) | min(cost, 0xFFFFu);
+        m_slots[SlotOf(handle)].store(word, std::memory_order_relaxed);
+    }
+
+    WindowSystem& m_windows;
+    std::atomic<unsigned long long> m_slots[kSlots] = {};
+    std::atomic<unsigned int> m_epoch{0};
+    std::atomic<unsigned long long> m_lookups{0};
+    std::atomic<unsigned long long> m_hits{0};
+    std::atomic<unsigned long long> m_savedCalls{0};
+};
+
+static Win32WindowSystem g_win32Windows;
+static TaskbarVerdictCache g_taskbarVerdicts(g_win32Windows);
+
+static bool IsTaskbarWindow(HWND hwnd) {
+    return g_taskbarVerdicts.IsTaskbarWindow(hwnd);
 }
 
 // Compute stacked rects (1 column grid) centered where original group was
@@ -125,6 +836,123 @@ static void ComputeAndAssignStackedRects(std::vector<IconCall*>& calls) {
     }
 }
 
+// Same identity rule as StackedRectMap: guidItem when set, else (hWnd, uID)
+static bool SameIconIdentifier(const NOTIFYICONIDENTIFIER& a, const NOTIFYICONIDENTIFIER& b) {
+    static const GUID emptyGuid = {};
+    bool aByGuid = memcmp(&a.guidItem, &emptyGuid, sizeof(GUID)) != 0;
+    bool bByGuid = memcmp(&b.guidItem, &emptyGuid, sizeof(GUID)) != 0;
+    if (aByGuid != bByGuid) return false;
+    if (aByGuid) return memcmp(&a.guidItem, &b.guidItem, sizeof(GUID)) == 0;
+    return a.hWnd == b.hWnd && a.uID == b.uID;
+}
+
+static void AddToWindow(const IconCall& call) {
+    for (size_t i = 0; i < g_windowCount; ++i) {
+        if (SameIconIdentifier(g_window[i].id, call.id)) {
+            g_window[i] = call;
+            return;
+        }
+    }
+    if (g_windowCount == kCallRingCapacity) return;
+    g_window[g_windowCount++] = call;
+    g_scheduler.NoteNewIdentifier();
+}
+
+static unsigned long long WindowSignature() {
+    unsigned long long sum = 0, mix = 0;
+    for (size_t i = 0; i < g_windowCount; ++i) {
+        const IconCall& c = g_window[i];
+        unsigned long long h = 14695981039346656037ULL;
+        auto feed = [&h](const void* data, size_t size) {
+            const unsigned char* bytes = static_cast<const unsigned char*>(data);
+            for (size_t b = 0; b < size; ++b) h = (h ^ bytes[b]) * 1099511628211ULL;
+        };
+        feed(&c.id.hWnd, sizeof(c.id.hWnd));
+        feed(&c.id.uID, sizeof(c.id.uID));
+        feed(&c.id.guidItem, sizeof(c.id.guidItem));
+        feed(&c.rectSet, sizeof(c.rectSet));
+        if (c.rectSet) feed(&c.rect, sizeof(c.rect));
+        sum += h;
+        mix ^= h * 0x9E3779B97F4A7C15ULL;
+    }
+    return sum ^ (mix + g_windowCount);
+}
+
+// Consumer only: arrange the closed window (unless nothing changed) and
+// publish it to g_stackedRects in one exclusive update
+static void ArrangeWindow() {
+    if (g_windowCount && g_scheduler.ShouldRecompute(WindowSignature())) {
+        g_toArrange.clear();
+        for (size_t i = 0; i < g_windowCount; ++i) g_toArrange.push_back(&g_window[i]);
+        ComputeAndAssignStackedRects(g_toArrange);
+        g_stackedRects.Publish(g_toArrange.data(), g_toArrange.size());
+        g_metrics.Count(CounterMetric::Arrangements);
+    }
+
+    if (g_debugLogging) {
+        const ArrangeScheduler::Stats& stats = g_scheduler.GetStats();
+        Wh_Log(L"[Scheduler] window=%llu icons=%zu calls=%llu recomputes=%llu avoided=%llu",
+               stats.windows, g_windowCount, stats.lastWindowCalls, stats.recomputes, stats.recomputesAvoided);
+        TaskbarVerdictCache::Stats verdicts = g_taskbarVerdicts.GetStats();
+        Wh_Log(L"[TaskbarCache] lookups=%llu hits=%llu (%.1f%%) savedCalls=%llu",
+               verdicts.lookups, verdicts.hits,
+               verdicts.lookups ? 100.0 * verdicts.hits / verdicts.lookups : 0.0, verdicts.savedCalls);
+    }
+    g_windowCount = 0;
+}
+
+// Closes a window once it's due even if no further call arrives. Only armed,
+// and only closed, by whoever holds g_consumerBusy.
+static std::atomic<PTP_TIMER> g_windowTimer{nullptr};
+
+// Consumer only
+static void ArmWindowTimer() {
+    PTP_TIMER timer = g_windowTimer.load(std::memory_order_acquire);
+    if (!timer || !g_scheduler.WindowOpen()) return;
+
+    // Negative means relative, in 100 ns units; the extra 1 ms makes sure the
+    // window is due when the timer fires
+    LONGLONG due = -(LONGLONG)((g_scheduler.MsUntilDue() + 1) * 10000);
+    FILETIME dueTime = {(DWORD)due, (DWORD)((ULONGLONG)due >> 32)};
+    SetThreadpoolTimer(timer, &dueTime, 0, 0);
+}
+
+// Consumer only: fold queued system calls into the current window, arrange it
+// if it's due, and otherwise make sure the timer will come back for it
+static void DrainAndArrange() {
+    IconCall drained;
+    while (g_frameCalls.TryPop(drained)) {
+        if (drained.markedSystem) AddToWindow(drained);
+    }
+    if (g_scheduler.CloseWindowIfDue()) ArrangeWindow();
+    ArmWindowTimer();
+}
+
+// Drains and arranges as the consumer, or leaves the work to whoever holds it.
+// A record pushed, or a timer shot, that lands after the holder's drain but
+// before it lets go would otherwise wait for some later call, so the skipping
+// caller sets g_consumePending and the holder checks it after clearing the
+// flag. Both sides are sequentially consistent: either the skipper sees the
+// flag clear and consumes itself, or the holder sees the pending bit. Returns
+// true when this call did the consuming.
+static bool ConsumeOrHandOff() {
+    g_consumePending.store(true);
+    bool consumed = false;
+    while (g_consumePending.load()) {
+        if (g_consumerBusy.test_and_set()) return consumed;
+        // An exchange, so a record pushed before a pending bit it takes is visible to the drain
+        g_consumePending.exchange(false);
+        DrainAndArrange();
+        g_consumerBusy.clear();
+        consumed = true;
+    }
+    return consumed;
+}
+
+static VOID CALLBACK WindowTimerCallback(PTP_CALLBACK_INSTANCE, PVOID, PTP_TIMER) {
+    ConsumeOrHandOff();
+}
+
 // Our hook for Shell_NotifyIconGetRect
 HRESULT WINAPI Shell_NotifyIconGetRect_Hook(const NOTIFYICONIDENTIFIER* lpniid, RECT* lprcIcon) {
     // Call original first (to populate a default rect)
@@ -136,6 +964,8 @@ HRESULT WINAPI Shell_NotifyIconGetRect_Hook(const NOTIFYICONIDENTIFIER* lpniid,
     // Defensive checks
     if (!lpniid) return hr;
 
+    ScopedHookTimer timer;
+
     // Build a logged copy
     IconCall call = {};
     call.id = *lpniid;
@@ -148,76 +978,42 @@ HRESULT WINAPI Shell_NotifyIconGetRect_Hook(const NOTIFYICONIDENTIFIER* lpniid,
 
     // Heuristic: if identifier's hWnd is taskbar or a child of taskbar, mark as system
     HWND idHwnd = lpniid->hWnd;
-    if (IsTaskbarWindow(idHwnd)) call.markedSystem = true;
+    bool taskbarOwned = IsTaskbarWindow(idHwnd);
+    if (taskbarOwned) call.markedSystem = true;
 
     // Another heuristic: if GUID is zero (no guidItem) and hwnd==NULL or belongs to shell, treat as system
-    GUID emptyGuid = {};
-    if (lpniid->guidItem.Data1 == 0 && (idHwnd == NULL || IsTaskbarWindow(idHwnd))) {
+    if (lpniid->guidItem.Data1 == 0 && (idHwnd == NULL || taskbarOwned)) {
         call.markedSystem = true;
     }
 
     // Store call
-    {
-        std::lock_guard<std::mutex> lock(g_frameMutex);
-        g_frameCalls.push_back(call);
+    if (!g_frameCalls.TryPush(call)) {
+        g_droppedCalls.fetch_add(1, std::memory_order_relaxed);
     }
 
     // Logging
-    if (g_debugLogging) {
+    if (ShouldLog(g_callLog, L"Shell_NotifyIconGetRect_Hook")) {
         std::wstring guidStr = GuidToString(lpniid->guidItem);
         std::wstring cls = HwndToClassName(idHwnd);
         Wh_Log(L"[Shell_NotifyIconGetRect_Hook] called: hWnd=%p class=%s uID=%u guid=%s rectSet=%d",
                idHwnd, cls.c_str(), lpniid->uID, guidStr.c_str(), call.rectSet ? 1 : 0);
     }
 
-    // After collecting a small batch (synchronous heuristic), attempt to arrange system-marked calls
-    bool doArrange = false;
-    std::vector<IconCall*> toArrange;
-    {
-        std::lock_guard<std::mutex> lock(g_frameMutex);
-        // If we've seen >= 3 calls OR the last N ms elapsed, attempt grouping
-        if (g_frameCalls.size() >= 3) doArrange = true;
-
-        if (doArrange) {
-            // Build pointers for system-marked calls only
-            for (auto &c : g_frameCalls) {
-                if (c.markedSystem) toArrange.push_back(&c);
-            }
-            // Clear frame storage (we will reapply changes by directly writing to callers below)
-            g_frameCalls.clear();
-        }
+    // Fold queued system calls into the current window and arrange once it closes.
+    // If another caller is already grouping, leave the records to it.
+    g_scheduler.RecordCall();
+    if (!ConsumeOrHandOff()) {
+        ApplyStackedRect(lpniid, lprcIcon);
+        return hr;
     }
 
-    if (doArrange && !toArrange.empty()) {
-        // Compute stacked rects and then write them back to the system via a best-effort approach.
-        ComputeAndAssignStackedRects(toArrange);
-
-        // For each arranged call, attempt to apply the stacked RECT to the callers.
-        // We cannot directly set the rect in other call contexts; but we can handle the case
-        // where the current caller corresponds to one of these items and override its rect.
-        // To cover other simultaneous callers, we rely on subsequent calls to this hook to return updated rects.
-        // Here, if the current identifier matches an arranged entry, override the supplied output rect.
-        if (lprcIcon && lpniid) {
-            // Search in toArrange for a matching identifier
-            for (auto c : toArrange) {
-                bool match = false;
-                // match by hWnd & uID if available
-                if (lpniid->hWnd && (c->id.hWnd == lpniid->hWnd) && (c->id.uID == lpniid->uID)) match = true;
-                // match by GUID if present
-                if (!match && (memcmp(&c->id.guidItem, &lpniid->guidItem, sizeof(GUID)) == 0)) match = true;
-                if (match) {
-                    *lprcIcon = c->rect;
-                    if (g_debugLogging) {
-                        Wh_Log(L"[Shell_NotifyIconGetRect_Hook] Overriding rect for caller hWnd=%p uID=%u -> (%d,%d)-(%d,%d)",
-                               lpniid->hWnd, lpniid->uID, c->rect.left, c->rect.top, c->rect.right, c->rect.bottom);
-                    }
-                    // done
-                    break;
-                }
-            }
-        }
+    // Reported once per batch of drops, not again until more are dropped
+    if (g_droppedCalls.load(std::memory_order_relaxed) && ShouldLog(g_ringFullLog, L"Shell_NotifyIconGetRect_Hook")) {
+        unsigned long long dropped = g_droppedCalls.exchange(0, std::memory_order_relaxed);
+        if (dropped) Wh_Log(L"[Shell_NotifyIconGetRect_Hook] %llu calls dropped (ring full)", dropped);
     }
 
+    ApplyStackedRect(lpniid, lprcIcon);
     return hr;
 }
 
@@ -253,6 +1049,18 @@ BOOL Wh_ModInit() {
     if (g_iconSize <= 0) g_iconSize = 32;
     g_iconSpacing = Wh_GetIntSetting(L"iconSpacing");
     g_debugLogging = Wh_GetIntSetting(L"debugLogging");
+    g_scheduler.SetInterval(max(0, Wh_GetIntSetting(L"pollIntervalMs")));
+    g_toArrange.reserve(kCallRingCapacity);
+
+    LARGE_INTEGER qpcFrequency;
+    QueryPerformanceFrequency(&qpcFrequency);
+    g_nsPerQpcTick = 1e9 / (double)qpcFrequency.QuadPart;
+
+    PTP_TIMER timer = CreateThreadpoolTimer(WindowTimerCallback, nullptr, nullptr);
+    g_windowTimer.store(timer, std::memory_order_release);
+    if (!timer) {
+        Wh_Log(L"[tray-system-stack] Failed to create the window timer; windows close on the next call");
+    }
 
     if (!InstallShellNotifyIconGetRectHook()) {
         Wh_Log(L"[tray-system-stack] Failed to install Shell_NotifyIconGetRect hook");
@@ -262,7 +1070,23 @@ BOOL Wh_ModInit() {
 
 void Wh_ModUninit() {
     Wh_Log(L"[tray-system-stack] Uninit");
-    g_frameCalls.clear();
+    // Become the consumer, so nothing arms the timer while it's torn down. A
+    // timer callback that runs meanwhile finds the consumer busy, leaves its
+    // pending bit and returns.
+    while (g_consumerBusy.test_and_set()) Sleep(0);
+    if (PTP_TIMER timer = g_windowTimer.exchange(nullptr)) {
+        SetThreadpoolTimer(timer, nullptr, 0, 0);
+        WaitForThreadpoolTimerCallbacks(timer, TRUE);
+        CloseThreadpoolTimer(timer);
+    }
+
+    IconCall discarded;
+    while (g_frameCalls.TryPop(discarded)) {}
+    g_windowCount = 0;
+    g_scheduler.Reset();
+    g_consumePending.store(false);
+    g_consumerBusy.clear();
+    g_stackedRects.Clear();
     RemoveShellNotifyIconGetRectHook();
 }
 
@@ -271,4 +1095,6 @@ void Wh_ModSettingsChanged() {
     g_iconSize = Wh_GetIntSetting(L"iconSize");
     g_iconSpacing = Wh_GetIntSetting(L"iconSpacing");
     g_debugLogging = Wh_GetIntSetting(L"debugLogging");
+    g_scheduler.SetInterval(max(0, Wh_GetIntSetting(L"pollIntervalMs")));
+    g_scheduler.Invalidate();
 }
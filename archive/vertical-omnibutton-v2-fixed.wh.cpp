@@ -33,240 +33,3782 @@ from horizontal to vertical arrangement using TranslateTransform positioning.
 - **Icon size**: Size of each icon (default: 32px)
 - **Icon spacing**: Vertical spacing between icons (default: 4px)
 - **Debug logging**: Enable detailed logs (use DebugView)
+- **Capture tree snapshot**: Write the OmniButton's visual tree to
+  `%TEMP%\omnibutton-tree.snapshot` for offline diagnosis (read it with
+  `snapshot_tool` from the repository's tests)
+
+Changes apply to icons that are already styled, without restarting explorer.
 
 ## Usage
 
-1. Enable the mod in Windhawk
-2. Watch DebugView for log output
-3. Restart explorer.exe if needed
-4. Report findings!
+1. Enable the mod in Windhawk
+2. Watch DebugView for log output
+3. Adjust the settings; they apply to the running taskbar
+4. Report findings!
+
+## Known Issues
+
+- Experimental - may not work on all Windows 11 versions
+- May conflict with other system tray mods
+- Requires testing and iteration
+
+## Credits
+
+Based on taskbar-notification-icon-spacing.wh.cpp by m417z.
+*/
+// ==/WindhawkModReadme==
+
+// ==WindhawkModSettings==
+/*
+- enableVertical: true
+  $name: Enable vertical arrangement
+  $description: Enable/disable vertical stacking of system tray icons
+- iconSize: 32
+  $name: Icon size (pixels)
+  $description: Size of each icon in pixels (16-48)
+- iconSpacing: 4
+  $name: Icon spacing (pixels)
+  $description: Vertical spacing between icons when arranged vertically (0-32)
+- debugLogging: true
+  $name: Enable debug logging
+  $description: Log detailed information for troubleshooting (use DebugView - enabled by default for testing)
+- captureTreeSnapshot: false
+  $name: Capture tree snapshot
+  $description: Write the OmniButton's visual tree to %TEMP%\omnibutton-tree.snapshot when an OmniButton icon loads, once per settings change
+*/
+// ==/WindhawkModSettings==
+
+#include <unknwn.h>               // IUnknown
+#include <winrt/base.h>          // winrt::com_ptr
+#include <windhawk_api.h>
+#include <windhawk_utils.h>
+
+#undef GetCurrentTime  // Fix for WinRT conflict
+
+#include <windows.h>
+#include <winrt/Windows.UI.Xaml.h>
+#include <winrt/Windows.UI.Xaml.Controls.h>
+#include <winrt/Windows.UI.Xaml.Media.h>
+#include <winrt/Windows.UI.Core.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cwchar>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+using namespace winrt::Windows::UI::Xaml;
+using namespace winrt::Windows::UI::Xaml::Controls;
+using namespace winrt::Windows::UI::Xaml::Media;
+
+// Settings
+struct Settings {
+    bool enableVertical;
+    int iconSize;
+    int iconSpacing;
+    bool debugLogging;
+    bool captureTreeSnapshot;
+    uint64_t generation;  // set when published; counts up from 1
+};
+
+// Immutable snapshots, read with one atomic load. A settings change publishes
+// a new snapshot instead of rewriting fields under a reader. Only registered
+// readers may hold one: each acks the generation it has moved on to whenever
+// it holds none, and a replaced snapshot is freed once every reader has acked
+// a newer one. Other threads read the mirrored debugLogging flag.
+const Settings kDefaultSettings = {true, 32, 4, true, false, 0};
+std::atomic<const Settings*> g_settings{&kDefaultSettings};
+std::atomic<bool> g_debugLogging{kDefaultSettings.debugLogging};
+
+struct SettingsReader {
+    std::atomic<uint64_t> ackedGeneration{0};
+};
+
+// Under g_settingsLock
+std::vector<std::unique_ptr<const Settings>> g_settingsSnapshots;
+std::vector<SettingsReader*> g_settingsReaders;
+SRWLOCK g_settingsLock = SRWLOCK_INIT;
+
+const Settings& CurrentSettings() {
+    return *g_settings.load(std::memory_order_acquire);
+}
+
+void PublishSettings(const Settings& settings) {
+    AcquireSRWLockExclusive(&g_settingsLock);
+
+    auto snapshot = std::make_unique<Settings>(settings);
+    snapshot->generation = CurrentSettings().generation + 1;
+    uint64_t oldestInUse = snapshot->generation;
+    g_settings.store(snapshot.get(), std::memory_order_release);
+    g_settingsSnapshots.push_back(std::move(snapshot));
+    g_debugLogging.store(settings.debugLogging, std::memory_order_relaxed);
+
+    for (const SettingsReader* reader : g_settingsReaders) {
+        oldestInUse = std::min(oldestInUse, reader->ackedGeneration.load(std::memory_order_acquire));
+    }
+    g_settingsSnapshots.erase(std::remove_if(g_settingsSnapshots.begin(), g_settingsSnapshots.end(),
+                                             [oldestInUse](const std::unique_ptr<const Settings>& retired) {
+                                                 return retired->generation < oldestInUse;
+                                             }),
+                              g_settingsSnapshots.end());
+
+    ReleaseSRWLockExclusive(&g_settingsLock);
+}
+
+// Called by a reader that holds no snapshot
+void AckSettings(SettingsReader& reader) {
+    reader.ackedGeneration.store(CurrentSettings().generation, std::memory_order_release);
+}
+
+// The reader may hold the current snapshot from here on
+void AddSettingsReader(SettingsReader& reader) {
+    AcquireSRWLockExclusive(&g_settingsLock);
+    AckSettings(reader);
+    g_settingsReaders.push_back(&reader);
+    ReleaseSRWLockExclusive(&g_settingsLock);
+}
+
+void RemoveSettingsReader(SettingsReader& reader) {
+    AcquireSRWLockExclusive(&g_settingsLock);
+    g_settingsReaders.erase(std::remove(g_settingsReaders.begin(), g_settingsReaders.end(), &reader),
+                            g_settingsReaders.end());
+    ReleaseSRWLockExclusive(&g_settingsLock);
+}
+
+bool g_initialized = false;
+std::atomic<bool> g_unloading{false};
+
+// Log levels. Debug sites go through the deferred log and only run with
+// debugLogging on; info and error sites call Wh_Log directly. Sites below
+// OMNIBUTTON_MIN_LOG_LEVEL are compiled out (e.g. add
+// -DOMNIBUTTON_MIN_LOG_LEVEL=2 to @compilerOptions to keep errors only).
+#ifndef OMNIBUTTON_MIN_LOG_LEVEL
+#define OMNIBUTTON_MIN_LOG_LEVEL 0
+#endif
+
+enum class LogLevel : int { Debug = 0, Info = 1, Error = 2 };
+
+constexpr LogLevel kMinLogLevel = static_cast<LogLevel>(OMNIBUTTON_MIN_LOG_LEVEL);
+
+inline bool LogLevelEnabled(LogLevel level) {
+    return level != LogLevel::Debug || g_debugLogging.load(std::memory_order_relaxed);
+}
+
+// The arguments are only evaluated once the level check passes, so a disabled
+// site costs one branch and builds no strings
+#define LOG_AT(level, sink, ...)                           \
+    do {                                                   \
+        if constexpr ((level) >= kMinLogLevel) {           \
+            if (LogLevelEnabled(level)) sink(__VA_ARGS__); \
+        }                                                  \
+    } while (0)
+
+#define LOG_DEBUG(...) LOG_AT(LogLevel::Debug, LogDeferred, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LogLevel::Info, Wh_Log, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LogLevel::Error, Wh_Log, __VA_ARGS__)
+
+// Per-call-site log limiter, the same as tray-system-stack's: only every Nth
+// call is considered, and those must pass a token bucket (GCRA: one CAS on
+// the theoretical arrival time, no lock).
+class LogRateLimiter {
+public:
+    constexpr LogRateLimiter(unsigned long long perSecond, unsigned long long burst,
+                             unsigned long long sampleEvery)
+        : m_intervalUs(1000000 / perSecond),
+          m_toleranceUs(1000000 / perSecond * (burst - 1)),
+          m_sampleEvery(sampleEvery) {}
+
+    // On true, *dropped is the number of calls suppressed since the last one allowed
+    bool Allow(unsigned long long nowMs, unsigned long long* dropped) {
+        if (m_sampleEvery > 1 && m_calls.fetch_add(1, std::memory_order_relaxed) % m_sampleEvery != 0) {
+            m_suppressed.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        unsigned long long now = nowMs * 1000;
+        unsigned long long tat = m_arrival.load(std::memory_order_relaxed);
+        for (;;) {
+            unsigned long long base = tat > now ? tat : now;
+            if (base - now > m_toleranceUs) {
+                m_suppressed.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            if (m_arrival.compare_exchange_weak(tat, base + m_intervalUs, std::memory_order_relaxed)) break;
+        }
+
+        *dropped = m_suppressed.exchange(0, std::memory_order_relaxed);
+        return true;
+    }
+
+private:
+    unsigned long long m_intervalUs;
+    unsigned long long m_toleranceUs;
+    unsigned long long m_sampleEvery;
+    std::atomic<unsigned long long> m_arrival{0};
+    std::atomic<unsigned long long> m_calls{0};
+    std::atomic<unsigned long long> m_suppressed{0};
+};
+
+// The next line that gets through reports how many were dropped
+inline bool LogRateAllows(LogRateLimiter& limiter) {
+    unsigned long long dropped;
+    if (!limiter.Allow(GetTickCount64(), &dropped)) return false;
+    if (dropped) Wh_Log(L"[Log] %llu more like the next line were dropped", dropped);
+    return true;
+}
+
+// Error sites on the Loaded, layout and hook paths run per icon, and a
+// failure there tends to repeat for every icon at once, so each such site is
+// limited to a few lines a second
+constexpr unsigned long long kHotErrorsPerSec = 1;
+constexpr unsigned long long kHotErrorBurst = 5;
+
+#define LOG_ERROR_LIMITED(...)                                                      \
+    do {                                                                            \
+        if constexpr (LogLevel::Error >= kMinLogLevel) {                            \
+            static LogRateLimiter siteLimiter(kHotErrorsPerSec, kHotErrorBurst, 1); \
+            if (LogRateAllows(siteLimiter)) Wh_Log(__VA_ARGS__);                    \
+        }                                                                           \
+    } while (0)
+
+// =============================================================
+//  Class name atoms
+// =============================================================
+
+// Runtime class names and element Names are interned once; from then on tree
+// walks compare them as integers instead of copying each one into a
+// std::wstring and searching it. Interning a string that's already in the
+// table doesn't allocate. Class names and Names go in separate tables whose
+// atoms don't overlap. Only selectors intern Names; an element's Name is just
+// looked up, since a Name no selector mentions can't match anything and the
+// many a tree walk meets would otherwise fill the table.
+
+using Atom = uint32_t;
+constexpr Atom kNoAtom = 0;  // empty string, or the table is full
+
+enum class ClassCategory : uint8_t {
+    Other,
+    OmniButton,
+    IconView,
+    StackPanel,
+    Grid,
+    SystemTrayRoot,
+};
+
+constexpr uint64_t HashText(std::wstring_view text) {
+    uint64_t hash = 14695981039346656037ull;  // FNV-1a
+    for (wchar_t c : text) {
+        hash ^= static_cast<uint64_t>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Same substring rules the tree walks applied to every node before atoms
+ClassCategory CategorizeClassName(std::wstring_view className) {
+    auto contains = [className](std::wstring_view part) {
+        return className.find(part) != std::wstring_view::npos;
+    };
+
+    if (contains(L"OmniButton") || contains(L"ControlCenterButton")) return ClassCategory::OmniButton;
+    if (contains(L"IconView")) return ClassCategory::IconView;
+    if (contains(L"SystemTray") && contains(L"implementation")) return ClassCategory::SystemTrayRoot;
+    if (contains(L"StackPanel")) return ClassCategory::StackPanel;
+    if (contains(L"Grid")) return ClassCategory::Grid;
+    return ClassCategory::Other;
+}
+
+// Insert-only, open-addressed intern table. Entries are never moved or freed,
+// so an atom's text stays valid for the lifetime of the mod. Each taskbar UI
+// thread interns, so lookups and inserts take the lock (shared unless the text
+// is new); Text and Category read entries that were already published.
+// A table's atoms run from firstAtom + 1 to firstAtom + kMaxAtoms - 1.
+class AtomTable {
+public:
+    static constexpr size_t kMaxAtoms = 2048;
+
+    AtomTable(Atom firstAtom, const wchar_t* kind) : m_firstAtom(firstAtom), m_kind(kind) {}
+
+    bool Owns(Atom atom) const { return atom > m_firstAtom && atom - m_firstAtom < kMaxAtoms; }
+
+    Atom Intern(std::wstring_view text) {
+        if (text.empty()) return kNoAtom;
+
+        uint64_t hash = HashText(text);
+        size_t slot;
+        AcquireSRWLockShared(&m_lock);
+        Atom atom = Find(text, hash, slot);
+        ReleaseSRWLockShared(&m_lock);
+        if (atom != kNoAtom) return atom;
+
+        // Another thread may have added it since
+        AcquireSRWLockExclusive(&m_lock);
+        atom = Find(text, hash, slot);
+        if (atom == kNoAtom) atom = Insert(text, hash, slot);
+        ReleaseSRWLockExclusive(&m_lock);
+        return atom;
+    }
+
+    // The text's atom if it has been interned, kNoAtom otherwise; never inserts
+    Atom Lookup(std::wstring_view text) {
+        if (text.empty()) return kNoAtom;
+
+        size_t slot;
+        AcquireSRWLockShared(&m_lock);
+        Atom atom = Find(text, HashText(text), slot);
+        ReleaseSRWLockShared(&m_lock);
+        return atom;
+    }
+
+    // Null-terminated, L"" for kNoAtom and for atoms of other tables
+    const wchar_t* Text(Atom atom) const {
+        return Owns(atom) && atom - m_firstAtom < m_count.load(std::memory_order_acquire)
+                   ? m_entries[atom - m_firstAtom].text
+                   : L"";
+    }
+
+    // Only meaningful for atoms interned from runtime class names
+    ClassCategory Category(Atom atom) const {
+        return Owns(atom) && atom - m_firstAtom < m_count.load(std::memory_order_acquire)
+                   ? m_entries[atom - m_firstAtom].category
+                   : ClassCategory::Other;
+    }
+
+    size_t Count() const { return m_count.load(std::memory_order_acquire) - 1; }
+
+private:
+    static constexpr size_t kSlotCount = kMaxAtoms * 2;  // power of two, load <= 0.5
+    static constexpr size_t kChunkChars = 16384;
+
+    struct Entry {
+        uint64_t hash;
+        const wchar_t* text;
+        uint32_t length;
+        ClassCategory category;
+    };
+
+    // Under the lock. On a miss, slot is where the text would go.
+    Atom Find(std::wstring_view text, uint64_t hash, size_t& slot) const {
+        slot = hash & (kSlotCount - 1);
+        while (uint32_t index = m_slots[slot]) {
+            const Entry& entry = m_entries[index];
+            if (entry.hash == hash && entry.length == text.size() &&
+                std::wmemcmp(entry.text, text.data(), text.size()) == 0) {
+                return m_firstAtom + index;
+            }
+            slot = (slot + 1) & (kSlotCount - 1);
+        }
+        return kNoAtom;
+    }
+
+    // Under the exclusive lock
+    Atom Insert(std::wstring_view text, uint64_t hash, size_t slot) {
+        uint32_t index = m_count.load(std::memory_order_relaxed);
+        if (index >= kMaxAtoms) {
+            if (!m_fullLogged.exchange(true, std::memory_order_relaxed)) {
+                LOG_ERROR(L"[Atoms] %s table is full; new %ss can no longer be matched", m_kind, m_kind);
+            }
+            return kNoAtom;
+        }
+
+        m_entries[index] = {hash, CopyText(text), static_cast<uint32_t>(text.size()),
+                            CategorizeClassName(text)};
+        m_slots[slot] = index;
+        m_count.store(index + 1, std::memory_order_release);
+        return m_firstAtom + index;
+    }
+
+    const wchar_t* CopyText(std::wstring_view text) {
+        size_t needed = text.size() + 1;
+        if (m_chunks.empty() || m_chunkUsed + needed > m_chunkCapacity) {
+            m_chunkCapacity = needed > kChunkChars ? needed : kChunkChars;
+            m_chunks.push_back(std::make_unique<wchar_t[]>(m_chunkCapacity));
+            m_chunkUsed = 0;
+        }
+
+        wchar_t* dest = m_chunks.back().get() + m_chunkUsed;
+        std::wmemcpy(dest, text.data(), text.size());
+        dest[text.size()] = L'\0';
+        m_chunkUsed += needed;
+        return dest;
+    }
+
+    Atom m_firstAtom;
+    const wchar_t* m_kind;
+    SRWLOCK m_lock = SRWLOCK_INIT;
+    Entry m_entries[kMaxAtoms] = {};
+    uint32_t m_slots[kSlotCount] = {};  // entry index, 0 for an empty slot
+    std::atomic<uint32_t> m_count{1};  // entry 0 is never used
+    std::atomic<bool> m_fullLogged{false};
+    std::vector<std::unique_ptr<wchar_t[]>> m_chunks;
+    size_t m_chunkCapacity = 0;
+    size_t m_chunkUsed = 0;
+};
+
+AtomTable g_classAtoms(0, L"class name");
+AtomTable g_nameAtoms(AtomTable::kMaxAtoms, L"Name");
+
+// Null-terminated text of either kind of atom, L"" for kNoAtom
+const wchar_t* AtomText(Atom atom) {
+    return g_nameAtoms.Owns(atom) ? g_nameAtoms.Text(atom) : g_classAtoms.Text(atom);
+}
+
+// =============================================================
+//  Deferred logging
+// =============================================================
+
+// Hot-path log sites don't format anything. They copy the format string's
+// address and up to six raw arguments into a fixed-size record on a ring
+// owned by the calling thread; a background thread formats and emits the
+// records. Format strings must be literals. Strings are passed as atoms (or
+// LogLiteral for other literals) and resolved by the drain, so a log site
+// never copies text.
+
+struct LogAtom {
+    Atom atom;
+};
+
+struct LogLiteral {
+    const wchar_t* text;  // must have static lifetime
+};
+
+enum class LogArgKind : uint8_t { Int, UInt, Double, Atom, Literal, Pointer };
+
+struct LogRecord {
+    static constexpr size_t kMaxArgs = 6;
+
+    union Arg {
+        int64_t i;
+        uint64_t u;
+        double d;
+        const void* p;
+    };
+
+    const wchar_t* format;
+    uint8_t argCount;
+    LogArgKind kinds[kMaxArgs];
+    Arg args[kMaxArgs];
+};
+
+template <typename T>
+void EncodeLogArg(LogRecord& record, T value) {
+    LogRecord::Arg& arg = record.args[record.argCount];
+    LogArgKind& kind = record.kinds[record.argCount];
+    if constexpr (std::is_same_v<T, LogAtom>) {
+        kind = LogArgKind::Atom;
+        arg.u = value.atom;
+    } else if constexpr (std::is_same_v<T, LogLiteral>) {
+        kind = LogArgKind::Literal;
+        arg.p = value.text;
+    } else if constexpr (std::is_floating_point_v<T>) {
+        kind = LogArgKind::Double;
+        arg.d = value;
+    } else if constexpr (std::is_pointer_v<T>) {
+        static_assert(!std::is_same_v<std::remove_cv_t<std::remove_pointer_t<T>>, wchar_t>,
+                      "pass strings as LogAtom");
+        kind = LogArgKind::Pointer;
+        arg.p = value;
+    } else if constexpr (std::is_signed_v<T>) {
+        kind = LogArgKind::Int;
+        arg.i = value;
+    } else {
+        static_assert(std::is_integral_v<T>, "unsupported log argument");
+        kind = LogArgKind::UInt;
+        arg.u = value;
+    }
+    record.argCount++;
+}
+
+// Expands a record's printf-style format. Each conversion is re-issued with a
+// length modifier matching the stored kind, so "%d" of an int and "%llu" of a
+// uint64_t both work. Returns the number of characters written.
+size_t FormatLogRecord(const LogRecord& record, wchar_t* out, size_t outSize) {
+    if (outSize == 0) return 0;
+
+    size_t pos = 0;
+    size_t argIndex = 0;
+    for (const wchar_t* p = record.format; *p && pos + 1 < outSize;) {
+        if (*p != L'%') {
+            out[pos++] = *p++;
+            continue;
+        }
+        if (p[1] == L'%') {
+            out[pos++] = L'%';
+            p += 2;
+            continue;
+        }
+
+        // Flags, width and precision are kept; length modifiers are replaced
+        const wchar_t* specStart = p++;
+        while (*p && std::wcschr(L"-+ #0123456789.", *p)) p++;
+        const wchar_t* specEnd = p;
+        while (*p && std::wcschr(L"hlLzjt", *p)) p++;
+        wchar_t conversion = *p;
+        if (!conversion) break;
+        p++;
+
+        wchar_t spec[32];
+        size_t prefix = specEnd - specStart;
+        if (prefix > 24 || argIndex >= record.argCount) {
+            continue;
+        }
+        std::wmemcpy(spec, specStart, prefix);
+
+        const LogRecord::Arg& arg = record.args[argIndex];
+        int written = -1;
+        switch (record.kinds[argIndex++]) {
+            case LogArgKind::Int:
+            case LogArgKind::UInt:
+                if (conversion == L'c') {
+                    // No length modifier applies to %c; it takes an int
+                    spec[prefix] = L'c';
+                    spec[prefix + 1] = L'\0';
+                    written = std::swprintf(out + pos, outSize - pos, spec, static_cast<int>(arg.i));
+                    break;
+                }
+                spec[prefix] = L'l';
+                spec[prefix + 1] = L'l';
+                spec[prefix + 2] = std::wcschr(L"diuxXo", conversion) ? conversion : L'd';
+                spec[prefix + 3] = L'\0';
+                written = std::swprintf(out + pos, outSize - pos, spec, arg.i);
+                break;
+            case LogArgKind::Double:
+                spec[prefix] = std::wcschr(L"fFeEgGaA", conversion) ? conversion : L'f';
+                spec[prefix + 1] = L'\0';
+                written = std::swprintf(out + pos, outSize - pos, spec, arg.d);
+                break;
+            case LogArgKind::Atom:
+            case LogArgKind::Literal:
+                spec[prefix] = L'l';
+                spec[prefix + 1] = L's';
+                spec[prefix + 2] = L'\0';
+                written = std::swprintf(out + pos, outSize - pos, spec,
+                                        record.kinds[argIndex - 1] == LogArgKind::Atom
+                                            ? AtomText(static_cast<Atom>(arg.u))
+                                            : static_cast<const wchar_t*>(arg.p));
+                break;
+            case LogArgKind::Pointer:
+                spec[prefix] = L'p';
+                spec[prefix + 1] = L'\0';
+                written = std::swprintf(out + pos, outSize - pos, spec, arg.p);
+                break;
+        }
+        if (written < 0) break;  // truncated
+        pos += static_cast<size_t>(written);
+    }
+
+    out[pos < outSize ? pos : outSize - 1] = L'\0';
+    return pos;
+}
+
+// Single-producer, single-consumer ring of records: the owning thread pushes,
+// the drain thread pops. A full ring drops the record and counts it.
+class LogRing {
+public:
+    static constexpr uint32_t kCapacity = 1024;  // power of two
+
+    void Push(const LogRecord& record) {
+        uint32_t head = m_head.load(std::memory_order_relaxed);
+        if (head - m_tail.load(std::memory_order_acquire) == kCapacity) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        m_records[head & (kCapacity - 1)] = record;
+        m_head.store(head + 1, std::memory_order_release);
+    }
+
+    template <typename Visit>
+    void Drain(Visit&& visit) {
+        uint32_t tail = m_tail.load(std::memory_order_relaxed);
+        uint32_t head = m_head.load(std::memory_order_acquire);
+        for (; tail != head; tail++) {
+            visit(m_records[tail & (kCapacity - 1)]);
+        }
+        m_tail.store(tail, std::memory_order_release);
+    }
+
+    uint64_t TakeDropped() { return m_dropped.exchange(0, std::memory_order_relaxed); }
+
+private:
+    LogRecord m_records[kCapacity];
+    alignas(64) std::atomic<uint32_t> m_head{0};
+    alignas(64) std::atomic<uint32_t> m_tail{0};
+    std::atomic<uint64_t> m_dropped{0};
+};
+
+// One ring per logging thread, created on the thread's first record and kept
+// until the mod unloads. Threads beyond kMaxThreads have their records dropped.
+class DeferredLog {
+public:
+    static constexpr size_t kMaxThreads = 16;
+
+    ~DeferredLog() {
+        for (auto& ring : m_rings) delete ring.load(std::memory_order_relaxed);
+    }
+
+    template <typename... Args>
+    void Write(const wchar_t* format, Args... args) {
+        static_assert(sizeof...(Args) <= LogRecord::kMaxArgs, "too many log arguments");
+
+        LogRecord record;
+        record.format = format;
+        record.argCount = 0;
+        (EncodeLogArg(record, args), ...);
+
+        if (LogRing* ring = ThreadRing()) {
+            ring->Push(record);
+        } else {
+            m_unringed.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Drain thread only. Emit receives each formatted, null-terminated line.
+    template <typename Emit>
+    void Drain(Emit&& emit) {
+        wchar_t line[512];
+        uint64_t dropped = m_unringed.exchange(0, std::memory_order_relaxed);
+
+        size_t count = m_ringCount.load(std::memory_order_acquire);
+        for (size_t i = 0; i < count && i < kMaxThreads; i++) {
+            LogRing* ring = m_rings[i].load(std::memory_order_acquire);
+            if (!ring) continue;
+
+            ring->Drain([&](const LogRecord& record) {
+                FormatLogRecord(record, line, std::size(line));
+                emit(line);
+            });
+            dropped += ring->TakeDropped();
+        }
+
+        if (dropped) {
+            std::swprintf(line, std::size(line), L"[Log] %llu records dropped",
+                          static_cast<unsigned long long>(dropped));
+            emit(line);
+        }
+    }
+
+private:
+    LogRing* ThreadRing() {
+        thread_local LogRing* ring = nullptr;
+        thread_local bool assigned = false;
+        if (!assigned) {
+            assigned = true;
+            size_t index = m_ringCount.fetch_add(1, std::memory_order_acq_rel);
+            if (index < kMaxThreads) {
+                ring = new LogRing();
+                m_rings[index].store(ring, std::memory_order_release);
+            }
+        }
+        return ring;
+    }
+
+    std::atomic<LogRing*> m_rings[kMaxThreads] = {};
+    std::atomic<size_t> m_ringCount{0};
+    std::atomic<uint64_t> m_unringed{0};
+};
+
+DeferredLog g_deferredLog;
+
+template <typename... Args>
+void LogDeferred(const wchar_t* format, Args... args) {
+    g_deferredLog.Write(format, args...);
+}
+
+// =============================================================
+//  Metrics
+// =============================================================
+
+// Hook latencies go into log-linear histograms (8 sub-buckets per power of
+// two, so a reading is off by at most 12.5%) and events into counters. Each
+// thread records into a shard of its own with plain relaxed stores, so
+// recording never contends; the log drain thread merges all shards when it
+// reads them. Hooks are only timed with debugLogging on.
+
+enum class HookMetric : uint8_t {
+    IconViewHook,
+    IconViewLoaded,
+    LoadedBatch,
+    Count,
+};
+
+enum class CounterMetric : uint8_t {
+    Traversals,
+    TransformsApplied,
+    CacheHits,
+    LoadedBatches,
+    LoadedPassesSaved,
+    Count,
+};
+
+constexpr const wchar_t* kHookMetricNames[] = {L"IconView hook", L"IconView Loaded", L"Loaded batch"};
+constexpr const wchar_t* kCounterMetricNames[] = {L"traversals", L"transforms", L"cacheHits", L"loadedBatches",
+                                                  L"loadedPassesSaved"};
+
+struct LatencySummary {
+    uint64_t count;
+    uint64_t meanNs;
+    uint64_t p50Ns;
+    uint64_t p90Ns;
+    uint64_t p99Ns;
+    uint64_t maxNs;
+};
+
+// One per mod: the thread's shard pointer is a function-level thread_local
+class MetricsRegistry {
+public:
+    static constexpr size_t kMaxShards = 16;
+    static constexpr size_t kSubBits = 3;
+    static constexpr size_t kMaxExponent = 40;  // ~18 minutes in ns
+    static constexpr size_t kBuckets = ((kMaxExponent - kSubBits + 1) << kSubBits) + (size_t{1} << kSubBits);
+
+    // Shards live until the module unloads, when no hook can still be running
+    ~MetricsRegistry() {
+        for (auto& shard : m_shards) delete shard.load(std::memory_order_relaxed);
+    }
+
+    void RecordLatency(HookMetric hook, uint64_t ns) {
+        Shard* shard = ThreadShard();
+        if (!shard) return;
+
+        Histogram& histogram = shard->histograms[static_cast<size_t>(hook)];
+        Bump(histogram.buckets[BucketOf(ns)], 1);
+        Bump(histogram.totalNs, ns);
+        if (ns > histogram.maxNs.load(std::memory_order_relaxed)) {
+            histogram.maxNs.store(ns, std::memory_order_relaxed);
+        }
+    }
+
+    void Count(CounterMetric counter, uint64_t amount = 1) {
+        if (Shard* shard = ThreadShard()) Bump(shard->counters[static_cast<size_t>(counter)], amount);
+    }
+
+    LatencySummary ReadLatency(HookMetric hook) const {
+        uint64_t buckets[kBuckets] = {};
+        uint64_t totalNs = 0;
+        LatencySummary summary = {};
+        ForEachShard([&](const Shard& shard) {
+            const Histogram& histogram = shard.histograms[static_cast<size_t>(hook)];
+            for (size_t i = 0; i < kBuckets; i++) {
+                uint64_t n = histogram.buckets[i].load(std::memory_order_relaxed);
+                buckets[i] += n;
+                summary.count += n;
+            }
+            totalNs += histogram.totalNs.load(std::memory_order_relaxed);
+            uint64_t maxNs = histogram.maxNs.load(std::memory_order_relaxed);
+            if (maxNs > summary.maxNs) summary.maxNs = maxNs;
+        });
+
+        if (summary.count == 0) return summary;
+        summary.meanNs = totalNs / summary.count;
+        summary.p50Ns = Percentile(buckets, summary.count, 50);
+        summary.p90Ns = Percentile(buckets, summary.count, 90);
+        summary.p99Ns = Percentile(buckets, summary.count, 99);
+        return summary;
+    }
+
+    uint64_t ReadCounter(CounterMetric counter) const {
+        uint64_t total = 0;
+        ForEachShard([&](const Shard& shard) {
+            total += shard.counters[static_cast<size_t>(counter)].load(std::memory_order_relaxed);
+        });
+        return total;
+    }
+
+private:
+    struct Histogram {
+        std::atomic<uint64_t> buckets[kBuckets] = {};
+        std::atomic<uint64_t> totalNs{0};
+        std::atomic<uint64_t> maxNs{0};
+    };
+
+    struct Shard {
+        Histogram histograms[static_cast<size_t>(HookMetric::Count)];
+        std::atomic<uint64_t> counters[static_cast<size_t>(CounterMetric::Count)] = {};
+    };
+
+    static size_t BucketOf(uint64_t ns) {
+        if (ns < (uint64_t{1} << kSubBits)) return static_cast<size_t>(ns);
+
+        size_t exponent = 0;
+        for (uint64_t v = ns; v >>= 1;) exponent++;
+        if (exponent > kMaxExponent) return kBuckets - 1;
+
+        size_t sub = static_cast<size_t>(ns >> (exponent - kSubBits)) & ((size_t{1} << kSubBits) - 1);
+        return ((exponent - kSubBits + 1) << kSubBits) + sub;
+    }
+
+    // Smallest value that lands in the bucket
+    static uint64_t BucketFloor(size_t bucket) {
+        if (bucket < (size_t{1} << kSubBits)) return bucket;
+
+        size_t exponent = (bucket >> kSubBits) + kSubBits - 1;
+        uint64_t sub = bucket & ((size_t{1} << kSubBits) - 1);
+        return ((uint64_t{1} << kSubBits) + sub) << (exponent - kSubBits);
+    }
+
+    static uint64_t Percentile(const uint64_t* buckets, uint64_t count, uint64_t percent) {
+        uint64_t rank = (count * percent + 99) / 100;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBuckets; i++) {
+            seen += buckets[i];
+            if (seen >= rank) return BucketFloor(i);
+        }
+        return BucketFloor(kBuckets - 1);
+    }
+
+    // Only the owning thread writes a shard, so no read-modify-write is needed
+    static void Bump(std::atomic<uint64_t>& value, uint64_t amount) {
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    template <typename Visit>
+    void ForEachShard(Visit&& visit) const {
+        size_t count = m_shardCount.load(std::memory_order_acquire);
+        for (size_t i = 0; i < count && i < kMaxShards; i++) {
+            if (const Shard* shard = m_shards[i].load(std::memory_order_acquire)) visit(*shard);
+        }
+    }
+
+    // Created on a thread's first record; threads past kMaxShards go unrecorded
+    Shard* ThreadShard() {
+        thread_local Shard* shard = nullptr;
+        thread_local bool assigned = false;
+        if (!assigned) {
+            assigned = true;
+            size_t index = m_shardCount.fetch_add(1, std::memory_order_acq_rel);
+            if (index < kMaxShards) {
+                shard = new Shard();
+                m_shards[index].store(shard, std::memory_order_release);
+            }
+        }
+        return shard;
+    }
+
+    std::atomic<Shard*> m_shards[kMaxShards] = {};
+    std::atomic<size_t> m_shardCount{0};
+};
+
+MetricsRegistry g_metrics;
+
+// =============================================================
+//  Portable tree access
+// =============================================================
+
+// Tree searches are written against a small traits type instead of calling
+// VisualTreeHelper directly, so the same code runs on the live XAML tree and
+// on the synthetic trees in tests/ (MemoryTree). A traits type provides:
+//
+//   using Node = ...;                          // cheap, copyable handle
+//   static Node Null();
+//   static bool IsNull(const Node& node);
+//   static int ChildCount(const Node& node);
+//   static Node Child(const Node& node, int index);
+//   static Node Parent(const Node& node);
+//   static Atom ClassAtom(const Node& node);   // interned in g_classAtoms
+//   static Atom NameAtom(const Node& node);    // looked up in g_nameAtoms
+//   static const void* Identity(const Node& node);
+
+// One compound of a selector, e.g. "Grid" or "SystemTray.OmniButton#ControlCenterButton"
+struct SelectorStep {
+    Atom classAtom;  // kNoAtom matches any class
+    Atom nameAtom;   // kNoAtom matches any Name
+
+    bool operator==(const SelectorStep& other) const {
+        return classAtom == other.classAtom && nameAtom == other.nameAtom;
+    }
+};
+
+// Short names ("Grid") refer to Windows.UI.Xaml.Controls types, as in style.yaml
+std::wstring ExpandTypeName(std::wstring_view type) {
+    if (type.find(L'.') != std::wstring_view::npos) {
+        return std::wstring(type);
+    }
+
+    std::wstring className = L"Windows.UI.Xaml.Controls.";
+    className += type;
+    return className;
+}
+
+Atom InternTypeName(std::wstring_view type) {
+    return g_classAtoms.Intern(ExpandTypeName(type));
+}
+
+std::wstring_view TrimSpaces(std::wstring_view text) {
+    size_t first = text.find_first_not_of(L" \t");
+    if (first == std::wstring_view::npos) return {};
+    size_t last = text.find_last_not_of(L" \t");
+    return text.substr(first, last - first + 1);
+}
+
+// Splits a Taskbar Styler target such as
+// "SystemTray.OmniButton#ControlCenterButton > Grid > StackPanel" into its
+// compounds and calls onCompound(type, name) for each; either may be empty.
+// Only type, #name and the ">" child combinator are supported, which is
+// everything style.yaml uses.
+template <typename OnCompound>
+bool SplitSelector(std::wstring_view text, OnCompound&& onCompound) {
+    size_t pos = 0;
+    while (true) {
+        size_t end = text.find(L'>', pos);
+        std::wstring_view compound = TrimSpaces(
+            text.substr(pos, end == std::wstring_view::npos ? std::wstring_view::npos : end - pos));
+        if (compound.empty() || compound.find_first_of(L" \t") != std::wstring_view::npos) {
+            return false;  // empty compound or descendant combinator
+        }
+
+        size_t hashPos = compound.find(L'#');
+        std::wstring_view type = compound.substr(0, hashPos);
+        std::wstring_view name;
+        if (hashPos != std::wstring_view::npos) {
+            name = compound.substr(hashPos + 1);
+            if (name.empty()) return false;
+        }
+
+        if (!onCompound(type, name)) return false;
+
+        if (end == std::wstring_view::npos) break;
+        pos = end + 1;
+    }
+
+    return true;
+}
+
+bool ParseSelector(std::wstring_view text, std::vector<SelectorStep>& steps) {
+    steps.clear();
+
+    return SplitSelector(text, [&](std::wstring_view type, std::wstring_view name) {
+        SelectorStep step = {kNoAtom, kNoAtom};
+        if (!type.empty() && (step.classAtom = InternTypeName(type)) == kNoAtom) return false;
+        if (!name.empty() && (step.nameAtom = g_nameAtoms.Intern(name)) == kNoAtom) return false;
+        steps.push_back(step);
+        return true;
+    });
+}
+
+template <typename Tree>
+bool NodeMatchesStep(const typename Tree::Node& node, const SelectorStep& step) {
+    if (step.classAtom != kNoAtom && Tree::ClassAtom(node) != step.classAtom) return false;
+    return step.nameAtom == kNoAtom || Tree::NameAtom(node) == step.nameAtom;
+}
+
+// First node below root, depth first, that matches
+template <typename Tree, typename Predicate>
+typename Tree::Node FindDescendant(const typename Tree::Node& root, Predicate&& matches) {
+    int childCount = Tree::ChildCount(root);
+    for (int i = 0; i < childCount; i++) {
+        auto child = Tree::Child(root, i);
+        if (Tree::IsNull(child)) continue;
+
+        if (matches(child)) return child;
+
+        auto found = FindDescendant<Tree>(child, matches);
+        if (!Tree::IsNull(found)) return found;
+    }
+
+    return Tree::Null();
+}
+
+struct TreePathCacheStats {
+    uint64_t hits = 0;      // cached path still led to a matching node
+    uint64_t misses = 0;    // no path yet, or it went stale; fell back to a full search
+    uint64_t notFound = 0;  // the full search found nothing either
+};
+
+// Remembers the child-index path from a root to the node a selector ends at,
+// so later lookups cost O(depth) instead of a walk over the whole tree. The
+// path is rechecked on every lookup and only rebuilt by a full search when it
+// no longer leads to a node matching the selector.
+template <typename Tree>
+class TreePathCache {
+public:
+    using Node = typename Tree::Node;
+
+    explicit TreePathCache(std::wstring_view selector, int maxDepth = 20)
+        : m_maxDepth(maxDepth) {
+        if (!ParseSelector(selector, m_chain)) {
+            m_chain.clear();
+        }
+    }
+
+    Node Find(const Node& root) {
+        if (Tree::IsNull(root) || m_chain.empty()) return Tree::Null();
+
+        if (m_havePath) {
+            Node cached = FollowPath(root);
+            if (!Tree::IsNull(cached)) {
+                m_stats.hits++;
+                return cached;
+            }
+        }
+
+        m_stats.misses++;
+        m_path.clear();
+        m_nodes.clear();
+        m_nodes.push_back(root);
+        m_havePath = Search(root, 0);
+        if (m_havePath) {
+            return m_nodes.back();
+        }
+
+        m_path.clear();
+        m_stats.notFound++;
+        return Tree::Null();
+    }
+
+    void Invalidate() {
+        m_havePath = false;
+        m_path.clear();
+    }
+
+    const TreePathCacheStats& Stats() const { return m_stats; }
+    const std::vector<int>& Path() const { return m_path; }
+
+private:
+    // Walk the cached indices, keeping the visited nodes for the selector check
+    Node FollowPath(const Node& root) {
+        m_nodes.clear();
+        m_nodes.push_back(root);
+
+        Node current = root;
+        for (int index : m_path) {
+            if (index >= Tree::ChildCount(current)) return Tree::Null();
+            current = Tree::Child(current, index);
+            if (Tree::IsNull(current)) return Tree::Null();
+            m_nodes.push_back(current);
+        }
+
+        return ChainEndsAtBack() ? current : Tree::Null();
+    }
+
+    // True if the last nodes in m_nodes match the chain, checked from the end
+    // since the last step rejects almost every node
+    bool ChainEndsAtBack() const {
+        if (m_nodes.size() < m_chain.size()) return false;
+
+        size_t first = m_nodes.size() - m_chain.size();
+        for (size_t i = m_chain.size(); i-- > 0;) {
+            if (!NodeMatchesStep<Tree>(m_nodes[first + i], m_chain[i])) return false;
+        }
+        return true;
+    }
+
+    bool Search(const Node& node, int depth) {
+        if (ChainEndsAtBack()) return true;
+        if (depth >= m_maxDepth) return false;
+
+        int childCount = Tree::ChildCount(node);
+        for (int i = 0; i < childCount; i++) {
+            Node child = Tree::Child(node, i);
+            if (Tree::IsNull(child)) continue;
+
+            m_path.push_back(i);
+            m_nodes.push_back(child);
+            if (Search(child, depth + 1)) return true;
+            m_path.pop_back();
+            m_nodes.pop_back();
+        }
+        return false;
+    }
+
+    std::vector<SelectorStep> m_chain;
+    int m_maxDepth;
+    bool m_havePath = false;
+    std::vector<int> m_path;
+    std::vector<Node> m_nodes;
+    TreePathCacheStats m_stats;
+};
+
+// Every rule's selector compiled into one trie of compounds, so N rules are
+// matched in a single walk instead of N. The walk carries the set of trie
+// states each node's parent reached; a node advances those states (and the
+// start state, since a selector's first compound may match at any depth) by
+// the child combinator. Rules sharing a prefix, like all of style.yaml's
+// OmniButton targets, share states.
+template <typename Tree>
+class SelectorAutomaton {
+public:
+    using Node = typename Tree::Node;
+
+    SelectorAutomaton() { m_states.emplace_back(); }
+
+    // Returns false if the selector doesn't parse; the rule is then ignored
+    bool AddRule(std::wstring_view selector, uint32_t ruleId) {
+        std::vector<SelectorStep> steps;
+        if (!ParseSelector(selector, steps)) return false;
+
+        AddRule(steps, ruleId);
+        return true;
+    }
+
+    // For selectors that were parsed already
+    void AddRule(const std::vector<SelectorStep>& steps, uint32_t ruleId) {
+        uint32_t state = 0;
+        for (const SelectorStep& step : steps) {
+            state = ChildState(state, step);
+        }
+        m_states[state].rules.push_back(ruleId);
+    }
+
+    // Calls onMatch(node, ruleId) for every node matched by every rule, in
+    // document order. Const, so several threads can share one automaton.
+    template <typename OnMatch>
+    void Match(const Node& root, OnMatch&& onMatch, int maxDepth = 64) const {
+        std::vector<uint32_t> active;
+        if (!Tree::IsNull(root)) {
+            MatchNode(root, 0, 0, 0, maxDepth, onMatch, active);
+        }
+    }
+
+    size_t StateCount() const { return m_states.size(); }
+
+private:
+    struct State {
+        SelectorStep step = {kNoAtom, kNoAtom};
+        std::vector<uint32_t> children;
+        std::vector<uint32_t> rules;
+    };
+
+    uint32_t ChildState(uint32_t state, const SelectorStep& step) {
+        for (uint32_t child : m_states[state].children) {
+            if (m_states[child].step == step) return child;
+        }
+
+        uint32_t child = static_cast<uint32_t>(m_states.size());
+        m_states.emplace_back();
+        m_states[child].step = step;
+        m_states[state].children.push_back(child);
+        return child;
+    }
+
+    // The node's atoms are fetched at most once, however many states test it
+    struct NodeAtoms {
+        const Node& node;
+        Atom classAtom = kNoAtom;
+        Atom nameAtom = kNoAtom;
+        bool haveClass = false;
+        bool haveName = false;
+
+        bool Matches(const SelectorStep& step) {
+            if (step.classAtom != kNoAtom) {
+                if (!haveClass) {
+                    classAtom = Tree::ClassAtom(node);
+                    haveClass = true;
+                }
+                if (classAtom != step.classAtom) return false;
+            }
+            if (step.nameAtom != kNoAtom) {
+                if (!haveName) {
+                    nameAtom = Tree::NameAtom(node);
+                    haveName = true;
+                }
+                if (nameAtom != step.nameAtom) return false;
+            }
+            return true;
+        }
+    };
+
+    void Advance(uint32_t state, NodeAtoms& atoms, std::vector<uint32_t>& active) const {
+        for (uint32_t child : m_states[state].children) {
+            if (atoms.Matches(m_states[child].step)) {
+                active.push_back(child);
+            }
+        }
+    }
+
+    // active[parentBegin, parentEnd) holds the states the parent reached
+    template <typename OnMatch>
+    void MatchNode(const Node& node, size_t parentBegin, size_t parentEnd, int depth,
+                   int maxDepth, OnMatch& onMatch, std::vector<uint32_t>& active) const {
+        size_t begin = active.size();
+
+        NodeAtoms atoms{node};
+        Advance(0, atoms, active);
+        for (size_t i = parentBegin; i < parentEnd; i++) {
+            Advance(active[i], atoms, active);
+        }
+        size_t end = active.size();
+
+        for (size_t i = begin; i < end; i++) {
+            for (uint32_t ruleId : m_states[active[i]].rules) {
+                onMatch(node, ruleId);
+            }
+        }
+
+        if (depth < maxDepth) {
+            int childCount = Tree::ChildCount(node);
+            for (int i = 0; i < childCount; i++) {
+                Node child = Tree::Child(node, i);
+                if (!Tree::IsNull(child)) {
+                    MatchNode(child, begin, end, depth + 1, maxDepth, onMatch, active);
+                }
+            }
+        }
+
+        active.resize(begin);
+    }
+
+    std::vector<State> m_states;  // 0 is the start state
+};
+
+// Open-addressed map from an element's identity (its address) to a value,
+// emptied when it fills up. An address can be reused once its element is
+// freed, so values either keep the element alive or are checked against it.
+template <typename Value>
+class IdentityMap {
+public:
+    explicit IdentityMap(size_t capacity) : m_slots(capacity * 2) {}
+
+    Value* Find(const void* identity) {
+        for (size_t i = Home(identity);; i = Next(i)) {
+            Slot& slot = m_slots[i];
+            if (!slot.identity) return nullptr;
+            if (slot.identity == identity) return &slot.value;
+        }
+    }
+
+    // The reference stays valid until the next insertion
+    Value& FindOrInsert(const void* identity) {
+        if (Value* value = Find(identity)) return *value;
+
+        if ((m_size + 1) * 2 > m_slots.size()) {
+            Clear();
+        }
+
+        size_t i = Home(identity);
+        while (m_slots[i].identity) i = Next(i);
+        m_slots[i].identity = identity;
+        m_size++;
+        return m_slots[i].value;
+    }
+
+    void Erase(const void* identity) {
+        size_t i = Home(identity);
+        while (m_slots[i].identity != identity) {
+            if (!m_slots[i].identity) return;
+            i = Next(i);
+        }
+
+        // Backward-shift deletion keeps every probe chain unbroken
+        for (size_t j = Next(i); m_slots[j].identity; j = Next(j)) {
+            size_t home = Home(m_slots[j].identity);
+            bool movable = i <= j ? (home <= i || home > j) : (home <= i && home > j);
+            if (movable) {
+                m_slots[i] = std::move(m_slots[j]);
+                i = j;
+            }
+        }
+        m_slots[i] = Slot{};
+        m_size--;
+    }
+
+    void Clear() {
+        for (Slot& slot : m_slots) slot = Slot{};
+        m_size = 0;
+    }
+
+    size_t Size() const { return m_size; }
+
+    template <typename Callback>
+    void ForEach(Callback&& callback) {
+        for (Slot& slot : m_slots) {
+            if (slot.identity) callback(slot.identity, slot.value);
+        }
+    }
+
+private:
+    struct Slot {
+        const void* identity = nullptr;
+        Value value{};
+    };
+
+    size_t Home(const void* identity) const {
+        auto bits = reinterpret_cast<uintptr_t>(identity);
+        return static_cast<size_t>((bits >> 4) * 0x9E3779B97F4A7C15ull) % m_slots.size();
+    }
+
+    size_t Next(size_t i) const { return i + 1 == m_slots.size() ? 0 : i + 1; }
+
+    std::vector<Slot> m_slots;
+    size_t m_size = 0;
+};
+
+// 512-bit Bloom filter over atoms, two probes per key
+struct AtomBloom {
+    uint64_t bits[8] = {};
+
+    void Add(Atom atom) {
+        if (atom == kNoAtom) return;
+        uint32_t hash = atom * 0x9E3779B1u;
+        Set(hash & 511);
+        Set((hash >> 16) & 511);
+    }
+
+    bool MayContain(Atom atom) const {
+        uint32_t hash = atom * 0x9E3779B1u;
+        return Test(hash & 511) && Test((hash >> 16) & 511);
+    }
+
+    void Merge(const AtomBloom& other) {
+        for (size_t i = 0; i < 8; i++) bits[i] |= other.bits[i];
+    }
+
+    // May contain anything, so it rejects nothing
+    static AtomBloom All() {
+        AtomBloom filter;
+        for (uint64_t& word : filter.bits) word = ~0ull;
+        return filter;
+    }
+
+private:
+    void Set(uint32_t bit) { bits[bit >> 6] |= 1ull << (bit & 63); }
+    bool Test(uint32_t bit) const { return (bits[bit >> 6] >> (bit & 63)) & 1; }
+};
+
+struct RightToLeftStats {
+    uint64_t typeRejects = 0;   // the node itself didn't match the last compound
+    uint64_t bloomRejects = 0;  // rejected by the ancestor filter, no parent walk
+    uint64_t walks = 0;         // the filter allowed it; confirmed by walking parents
+    uint64_t matches = 0;
+    uint64_t filterHits = 0;    // ancestor filters reused from the cache
+};
+
+// Matches one selector from its last compound towards the root, the way
+// browsers match CSS. The class and Name atoms of every element's ancestors
+// are summarized in a Bloom filter, memoized per element as elements are
+// first seen, so most nodes outside the selector's subtree are rejected
+// without walking their parents. Only possible matches are confirmed with a
+// parent walk.
+//
+// A cached filter is only right while the element's ancestors and their Names
+// stay as they were, so the filters are kept for one pass over the tree: call
+// Clear() once the pass is over. Cached elements are held by reference so
+// their identity can't be reused while cached; the cache is also emptied when
+// it fills up.
+template <typename Tree>
+class RightToLeftMatcher {
+public:
+    using Node = typename Tree::Node;
+
+    explicit RightToLeftMatcher(std::wstring_view selector, size_t maxCachedElements = 256)
+        : m_filters(maxCachedElements) {
+        if (!ParseSelector(selector, m_steps)) {
+            m_steps.clear();
+        }
+    }
+
+    bool Matches(const Node& node) {
+        if (m_steps.empty() || !NodeMatchesStep<Tree>(node, m_steps.back())) {
+            m_stats.typeRejects++;
+            return false;
+        }
+
+        if (m_steps.size() > 1) {
+            Node parent = Tree::Parent(node);
+            if (Tree::IsNull(parent)) return false;
+
+            AtomBloom ancestors = InclusiveFilter(parent);
+            for (size_t i = 0; i + 1 < m_steps.size(); i++) {
+                if ((m_steps[i].classAtom != kNoAtom && !ancestors.MayContain(m_steps[i].classAtom)) ||
+                    (m_steps[i].nameAtom != kNoAtom && !ancestors.MayContain(m_steps[i].nameAtom))) {
+                    m_stats.bloomRejects++;
+                    return false;
+                }
+            }
+        }
+
+        m_stats.walks++;
+        Node current = node;
+        for (size_t i = m_steps.size() - 1; i-- > 0;) {
+            current = Tree::Parent(current);
+            if (Tree::IsNull(current) || !NodeMatchesStep<Tree>(current, m_steps[i])) return false;
+        }
+
+        m_stats.matches++;
+        return true;
+    }
+
+    void Clear() { m_filters.Clear(); }
+
+    const RightToLeftStats& Stats() const { return m_stats; }
+
+private:
+    struct CachedFilter {
+        Node node = Tree::Null();  // keeps the identity from being reused
+        AtomBloom filter;
+    };
+
+    // Filter over the atoms of node and all of its ancestors
+    AtomBloom InclusiveFilter(const Node& node) {
+        // Climb until the root or an element with a cached filter, then fill in downwards
+        m_climb.clear();
+        AtomBloom filter;
+        for (Node current = node;; current = Tree::Parent(current)) {
+            if (Tree::IsNull(current)) break;
+            if (const CachedFilter* cached = m_filters.Find(Tree::Identity(current))) {
+                m_stats.filterHits++;
+                filter = cached->filter;
+                break;
+            }
+
+            // Cut short, the filter would miss the higher ancestors and could
+            // reject a real match, so nothing is cached and the parent walk decides
+            if (m_climb.size() == kMaxClimb) {
+                m_climb.clear();
+                return AtomBloom::All();
+            }
+            m_climb.push_back(current);
+        }
+
+        for (size_t i = m_climb.size(); i-- > 0;) {
+            filter.Add(Tree::ClassAtom(m_climb[i]));
+            filter.Add(Tree::NameAtom(m_climb[i]));
+            CachedFilter& cached = m_filters.FindOrInsert(Tree::Identity(m_climb[i]));
+            cached.node = m_climb[i];
+            cached.filter = filter;
+        }
+
+        m_climb.clear();
+        return filter;
+    }
+
+    static constexpr size_t kMaxClimb = 64;
+
+    std::vector<SelectorStep> m_steps;
+    IdentityMap<CachedFilter> m_filters;
+    std::vector<Node> m_climb;
+    RightToLeftStats m_stats;
+};
+
+// =============================================================
+//  Compiled styles
+// =============================================================
+
+// Style rules are compiled into a flat, versioned blob: selectors are split
+// into class and Name strings, property names are interned in the blob's
+// string table and values like "Margin=6,0,10,0" are stored as numbers.
+// Everything inside is addressed by offset from the start of the blob, and
+// Attach checks it all once, so it is read in place. The mod builds its
+// layout rules in code (CompileLayoutStyles); the diff and patch code below
+// work on their blobs.
+
+struct StyleRuleSource {
+    std::wstring target;
+    std::vector<std::wstring> styles;  // "Property=Value"
+};
+
+struct StyleSource {
+    std::vector<StyleRuleSource> rules;
+};
+
+// A blob, compiled styles or a tree snapshot, is a header followed by 8-byte
+// aligned sections, each an array of one struct type addressed by its offset
+// from the start of the blob. Strings are stored once in a string table and
+// referred to by index.
+struct BlobSection {
+    uint32_t offset;  // bytes from the start of the blob
+    uint32_t count;
+};
+
+struct BlobString {
+    uint32_t offset;  // into the chars section
+    uint32_t length;
+};
+
+// FNV-1a over the whole blob, with the header's checksum field read as zero
+uint32_t BlobChecksum(const uint8_t* data, size_t size, size_t checksumOffset) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= i >= checksumOffset && i < checksumOffset + sizeof(uint32_t) ? 0 : data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+template <typename T>
+bool BlobSectionFits(const BlobSection& section, size_t size, size_t headerSize) {
+    return section.offset % alignof(T) == 0 && section.offset >= headerSize &&
+           uint64_t{section.offset} + uint64_t{section.count} * sizeof(T) <= size;
+}
+
+// Every string lies inside chars and is null-terminated; both sections must fit
+bool ValidBlobStrings(const uint8_t* data, const BlobSection& strings, const BlobSection& chars) {
+    const auto* entries = reinterpret_cast<const BlobString*>(data + strings.offset);
+    const auto* text = reinterpret_cast<const wchar_t*>(data + chars.offset);
+    for (uint32_t i = 0; i < strings.count; i++) {
+        uint64_t end = uint64_t{entries[i].offset} + entries[i].length;
+        if (end >= chars.count || text[end] != L'\0') return false;
+    }
+    return true;
+}
+
+template <typename T>
+BlobSection AppendBlobSection(std::vector<uint8_t>& blob, const std::vector<T>& items) {
+    blob.resize((blob.size() + 7) & ~size_t{7});
+    BlobSection section = {static_cast<uint32_t>(blob.size()), static_cast<uint32_t>(items.size())};
+    if (!items.empty()) {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(items.data());
+        blob.insert(blob.end(), bytes, bytes + items.size() * sizeof(T));
+    }
+    return section;
+}
+
+class BlobStringTable {
+public:
+    // Linear lookup; a style file has a few dozen distinct strings
+    uint32_t Intern(std::wstring_view text) {
+        for (uint32_t i = 0; i < m_strings.size(); i++) {
+            if (text == std::wstring_view(m_chars.data() + m_strings[i].offset, m_strings[i].length)) return i;
+        }
+        return Add(text);
+    }
+
+    // For callers that already know the string is new
+    uint32_t Add(std::wstring_view text) {
+        m_strings.push_back({static_cast<uint32_t>(m_chars.size()), static_cast<uint32_t>(text.size())});
+        m_chars.insert(m_chars.end(), text.begin(), text.end());
+        m_chars.push_back(L'\0');
+        return static_cast<uint32_t>(m_strings.size() - 1);
+    }
+
+    const std::vector<BlobString>& Strings() const { return m_strings; }
+    const std::vector<wchar_t>& Chars() const { return m_chars; }
+
+private:
+    std::vector<BlobString> m_strings;
+    std::vector<wchar_t> m_chars;
+};
+
+// Compiled styles, version 2
+constexpr uint32_t kStyleBlobMagic = 0x4253424F;  // "OBSB"
+constexpr uint16_t kStyleBlobVersion = 2;
+constexpr uint32_t kNoStyleString = 0xFFFFFFFF;
+
+enum class StyleValueKind : uint8_t {
+    Text,       // anything else, e.g. "Center"; only the text is set
+    Number,     // values[0]
+    Thickness,  // values[0..3]: left, top, right, bottom
+};
+
+struct StyleBlobHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t charSize;    // sizeof(wchar_t) of the writer
+    uint32_t totalSize;
+    uint32_t checksum;    // BlobChecksum
+    BlobSection strings;     // BlobString
+    BlobSection chars;       // wchar_t, each string null-terminated
+    BlobSection rules;       // StyleBlobRule
+    BlobSection steps;       // StyleBlobStep
+    BlobSection properties;  // StyleBlobProperty
+};
+
+struct StyleBlobRule {
+    uint32_t target;  // the selector as written
+    uint32_t firstStep;
+    uint32_t stepCount;
+    uint32_t firstProperty;
+    uint32_t propertyCount;
+    uint32_t reserved;
+};
+
+// One selector compound; kNoStyleString matches anything
+struct StyleBlobStep {
+    uint32_t className;  // full runtime class name
+    uint32_t name;
+};
+
+struct StyleBlobProperty {
+    uint32_t name;
+    uint32_t text;  // the value as written
+    StyleValueKind kind;
+    uint8_t reserved[7];
+    double values[4];
+};
+
+// XAML Thickness properties: "6" is uniform, "6,0" is horizontal,vertical
+bool IsThicknessProperty(std::wstring_view name) {
+    return name == L"Margin" || name == L"Padding" || name == L"BorderThickness";
+}
+
+// Up to maxValues comma-separated numbers; 0 if any part isn't a number
+size_t ParseNumberList(std::wstring_view text, double* values, size_t maxValues) {
+    size_t count = 0;
+    size_t pos = 0;
+    while (true) {
+        if (count == maxValues) return 0;
+
+        size_t end = text.find(L',', pos);
+        std::wstring part(TrimSpaces(
+            text.substr(pos, end == std::wstring_view::npos ? std::wstring_view::npos : end - pos)));
+        if (part.empty()) return 0;
+
+        wchar_t* partEnd = nullptr;
+        values[count++] = std::wcstod(part.c_str(), &partEnd);
+        if (*partEnd != L'\0') return 0;
+
+        if (end == std::wstring_view::npos) return count;
+        pos = end + 1;
+    }
+}
+
+class StyleBlobWriter {
+public:
+    // Returns an empty blob and the offending rule's 1-based index in
+    // errorRule if a target or style doesn't parse
+    std::vector<uint8_t> Compile(const StyleSource& source, size_t* errorRule) {
+        *this = StyleBlobWriter{};
+
+        for (size_t i = 0; i < source.rules.size(); i++) {
+            if (!AddRule(source.rules[i])) {
+                if (errorRule) *errorRule = i + 1;
+                return {};
+            }
+        }
+
+        StyleBlobHeader header = {};
+        header.magic = kStyleBlobMagic;
+        header.version = kStyleBlobVersion;
+        header.charSize = sizeof(wchar_t);
+
+        std::vector<uint8_t> blob(sizeof(header));
+        header.strings = AppendBlobSection(blob, m_strings.Strings());
+        header.chars = AppendBlobSection(blob, m_strings.Chars());
+        header.rules = AppendBlobSection(blob, m_rules);
+        header.steps = AppendBlobSection(blob, m_steps);
+        header.properties = AppendBlobSection(blob, m_properties);
+        header.totalSize = static_cast<uint32_t>(blob.size());
+        std::memcpy(blob.data(), &header, sizeof(header));
+
+        header.checksum = BlobChecksum(blob.data(), blob.size(), offsetof(StyleBlobHeader, checksum));
+        std::memcpy(blob.data() + offsetof(StyleBlobHeader, checksum), &header.checksum, sizeof(header.checksum));
+        return blob;
+    }
+
+private:
+    uint32_t String(std::wstring_view text) { return m_strings.Intern(text); }
+
+    bool AddRule(const StyleRuleSource& rule) {
+        StyleBlobRule compiled = {};
+        compiled.target = String(rule.target);
+        compiled.firstStep = static_cast<uint32_t>(m_steps.size());
+        bool parsed = SplitSelector(rule.target, [&](std::wstring_view type, std::wstring_view name) {
+            m_steps.push_back({type.empty() ? kNoStyleString : String(ExpandTypeName(type)),
+                               name.empty() ? kNoStyleString : String(name)});
+            return true;
+        });
+        if (!parsed) return false;
+        compiled.stepCount = static_cast<uint32_t>(m_steps.size()) - compiled.firstStep;
+
+        compiled.firstProperty = static_cast<uint32_t>(m_properties.size());
+        for (const auto& style : rule.styles) {
+            size_t equals = style.find(L'=');
+            if (equals == std::wstring::npos) return false;
+
+            std::wstring_view name = TrimSpaces(std::wstring_view(style).substr(0, equals));
+            std::wstring_view text = TrimSpaces(std::wstring_view(style).substr(equals + 1));
+            if (name.empty()) return false;
+
+            StyleBlobProperty property = {};
+            property.name = String(name);
+            property.text = String(text);
+            property.kind = StyleValueKind::Text;
+
+            double* v = property.values;
+            size_t count = ParseNumberList(text, v, 4);
+            if (IsThicknessProperty(name) && (count == 1 || count == 2 || count == 4)) {
+                if (count == 1) v[1] = v[2] = v[3] = v[0];
+                if (count == 2) {
+                    v[2] = v[0];
+                    v[3] = v[1];
+                }
+                property.kind = StyleValueKind::Thickness;
+            } else if (count == 1) {
+                property.kind = StyleValueKind::Number;
+            } else {
+                std::fill(v, v + 4, 0.0);
+            }
+            m_properties.push_back(property);
+        }
+        compiled.propertyCount = static_cast<uint32_t>(m_properties.size()) - compiled.firstProperty;
+
+        m_rules.push_back(compiled);
+        return true;
+    }
+
+    BlobStringTable m_strings;
+    std::vector<StyleBlobRule> m_rules;
+    std::vector<StyleBlobStep> m_steps;
+    std::vector<StyleBlobProperty> m_properties;
+};
+
+// Read-only access to a blob in place. Attach checks every offset, count and
+// string index once, so the accessors don't need to.
+class StyleBlobView {
+public:
+    bool Attach(const void* data, size_t size) {
+        m_base = nullptr;
+        m_header = nullptr;
+        if (!Validate(static_cast<const uint8_t*>(data), size)) return false;
+
+        m_base = static_cast<const uint8_t*>(data);
+        m_header = reinterpret_cast<const StyleBlobHeader*>(data);
+        return true;
+    }
+
+    bool Attached() const { return m_header != nullptr; }
+    size_t Size() const { return m_header->totalSize; }
+
+    // Empty for kNoStyleString
+    std::wstring_view String(uint32_t index) const {
+        if (index == kNoStyleString) return {};
+        const BlobString& string = Section<BlobString>(m_header->strings)[index];
+        return {Section<wchar_t>(m_header->chars) + string.offset, string.length};
+    }
+
+    // An unattached view reads as an empty rule set
+    size_t RuleCount() const { return m_header ? m_header->rules.count : 0; }
+    const StyleBlobRule& Rule(size_t index) const { return Section<StyleBlobRule>(m_header->rules)[index]; }
+
+    const StyleBlobStep* Steps(const StyleBlobRule& rule) const {
+        return Section<StyleBlobStep>(m_header->steps) + rule.firstStep;
+    }
+
+    const StyleBlobProperty* Properties(const StyleBlobRule& rule) const {
+        return Section<StyleBlobProperty>(m_header->properties) + rule.firstProperty;
+    }
+
+    // The rule's selector as atoms, for the tree matchers
+    bool RuleSelector(const StyleBlobRule& rule, std::vector<SelectorStep>& steps) const {
+        steps.clear();
+        const StyleBlobStep* blobSteps = Steps(rule);
+        for (uint32_t i = 0; i < rule.stepCount; i++) {
+            SelectorStep step = {kNoAtom, kNoAtom};
+            if (blobSteps[i].className != kNoStyleString &&
+                (step.classAtom = g_classAtoms.Intern(String(blobSteps[i].className))) == kNoAtom) {
+                return false;
+            }
+            if (blobSteps[i].name != kNoStyleString &&
+                (step.nameAtom = g_nameAtoms.Intern(String(blobSteps[i].name))) == kNoAtom) {
+                return false;
+            }
+            steps.push_back(step);
+        }
+        return true;
+    }
+
+private:
+    template <typename T>
+    const T* Section(const BlobSection& section) const {
+        return reinterpret_cast<const T*>(m_base + section.offset);
+    }
+
+    template <typename T>
+    static bool SectionFits(const BlobSection& section, size_t size) {
+        return BlobSectionFits<T>(section, size, sizeof(StyleBlobHeader));
+    }
+
+    static bool Validate(const uint8_t* data, size_t size) {
+        if (!data || size < sizeof(StyleBlobHeader) ||
+            reinterpret_cast<uintptr_t>(data) % alignof(StyleBlobHeader) != 0) {
+            return false;
+        }
+
+        const auto& header = *reinterpret_cast<const StyleBlobHeader*>(data);
+        if (header.magic != kStyleBlobMagic || header.version != kStyleBlobVersion ||
+            header.charSize != sizeof(wchar_t) || header.totalSize != size ||
+            header.checksum != BlobChecksum(data, size, offsetof(StyleBlobHeader, checksum))) {
+            return false;
+        }
+
+        if (!SectionFits<BlobString>(header.strings, size) || !SectionFits<wchar_t>(header.chars, size) ||
+            !SectionFits<StyleBlobRule>(header.rules, size) || !SectionFits<StyleBlobStep>(header.steps, size) ||
+            !SectionFits<StyleBlobProperty>(header.properties, size)) {
+            return false;
+        }
+
+        if (!ValidBlobStrings(data, header.strings, header.chars)) return false;
+
+        auto section = [data](const BlobSection& s) { return data + s.offset; };
+
+        auto validString = [&](uint32_t index, bool optional) {
+            return index < header.strings.count || (optional && index == kNoStyleString);
+        };
+
+        const auto* rules = reinterpret_cast<const StyleBlobRule*>(section(header.rules));
+        for (uint32_t i = 0; i < header.rules.count; i++) {
+            const StyleBlobRule& rule = rules[i];
+            if (!validString(rule.target, false) || rule.stepCount == 0 ||
+                uint64_t{rule.firstStep} + rule.stepCount > header.steps.count ||
+                uint64_t{rule.firstProperty} + rule.propertyCount > header.properties.count) {
+                return false;
+            }
+        }
+
+        const auto* steps = reinterpret_cast<const StyleBlobStep*>(section(header.steps));
+        for (uint32_t i = 0; i < header.steps.count; i++) {
+            if (!validString(steps[i].className, true) || !validString(steps[i].name, true)) return false;
+        }
+
+        const auto* properties = reinterpret_cast<const StyleBlobProperty*>(section(header.properties));
+        for (uint32_t i = 0; i < header.properties.count; i++) {
+            if (!validString(properties[i].name, false) || !validString(properties[i].text, false) ||
+                properties[i].kind > StyleValueKind::Thickness) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    const uint8_t* m_base = nullptr;
+    const StyleBlobHeader* m_header = nullptr;
+};
+
+// =============================================================
+//  Style diffing
+// =============================================================
+
+// A changed rule set is applied as a patch against the one already applied,
+// not by restyling everything. Rules are paired up by target; only rules
+// that were added, removed or changed go in the patch, and only elements
+// matched by their selectors are touched. Within a changed rule, properties
+// whose value is the same are not written again. Rules are assumed not to
+// set the same property on the same element.
+
+enum class StyleChange : uint8_t { Added, Removed, Changed };
+
+constexpr uint32_t kNoStyleRule = 0xFFFFFFFF;
+
+struct StyleRulePatch {
+    StyleChange change;
+    uint32_t before;                // rule in the old set, kNoStyleRule if Added
+    uint32_t after;                 // rule in the new set, kNoStyleRule if Removed
+    std::vector<uint32_t> set;      // properties of the new rule to write
+    std::vector<uint32_t> cleared;  // properties of the old rule to clear
+};
+
+struct StylePatch {
+    std::vector<StyleRulePatch> rules;
+
+    bool Empty() const { return rules.empty(); }
+};
+
+// Rules with the same target are paired in order, so a target that appears
+// twice keeps two separate rules
+StylePatch DiffStyleRules(const StyleBlobView& before, const StyleBlobView& after) {
+    StylePatch patch;
+    std::vector<bool> paired(before.RuleCount(), false);
+
+    for (uint32_t i = 0; i < after.RuleCount(); i++) {
+        const StyleBlobRule& newRule = after.Rule(i);
+        std::wstring_view target = after.String(newRule.target);
+        const StyleBlobProperty* newProperties = after.Properties(newRule);
+
+        uint32_t match = kNoStyleRule;
+        for (uint32_t j = 0; j < before.RuleCount(); j++) {
+            if (!paired[j] && before.String(before.Rule(j).target) == target) {
+                match = j;
+                break;
+            }
+        }
+
+        if (match == kNoStyleRule) {
+            StyleRulePatch added = {StyleChange::Added, kNoStyleRule, i, {}, {}};
+            for (uint32_t p = 0; p < newRule.propertyCount; p++) added.set.push_back(p);
+            patch.rules.push_back(std::move(added));
+            continue;
+        }
+        paired[match] = true;
+
+        const StyleBlobRule& oldRule = before.Rule(match);
+        const StyleBlobProperty* oldProperties = before.Properties(oldRule);
+        StyleRulePatch changed = {StyleChange::Changed, match, i, {}, {}};
+
+        for (uint32_t p = 0; p < newRule.propertyCount; p++) {
+            std::wstring_view name = after.String(newProperties[p].name);
+            std::wstring_view text = after.String(newProperties[p].text);
+            bool same = false;
+            for (uint32_t q = 0; q < oldRule.propertyCount && !same; q++) {
+                same = before.String(oldProperties[q].name) == name && before.String(oldProperties[q].text) == text;
+            }
+            if (!same) changed.set.push_back(p);
+        }
+
+        for (uint32_t q = 0; q < oldRule.propertyCount; q++) {
+            std::wstring_view name = before.String(oldProperties[q].name);
+            bool kept = false;
+            for (uint32_t p = 0; p < newRule.propertyCount && !kept; p++) {
+                kept = after.String(newProperties[p].name) == name;
+            }
+            if (!kept) changed.cleared.push_back(q);
+        }
+
+        if (!changed.set.empty() || !changed.cleared.empty()) {
+            patch.rules.push_back(std::move(changed));
+        }
+    }
+
+    for (uint32_t j = 0; j < before.RuleCount(); j++) {
+        if (paired[j]) continue;
+
+        StyleRulePatch removed = {StyleChange::Removed, j, kNoStyleRule, {}, {}};
+        for (uint32_t q = 0; q < before.Rule(j).propertyCount; q++) removed.cleared.push_back(q);
+        patch.rules.push_back(std::move(removed));
+    }
+
+    return patch;
+}
+
+enum class StyleWriteResult : uint8_t {
+    Written,
+    Unchanged,    // the element already had the value
+    Unsupported,  // the writer doesn't know the property
+};
+
+struct StylePatchStats {
+    uint64_t elementsMatched = 0;
+    uint64_t writesIssued = 0;
+    uint64_t writesElided = 0;
+    uint64_t clears = 0;
+    uint64_t unsupported = 0;
+};
+
+// Applies a patch below root. A writer provides:
+//
+//   StyleWriteResult Set(const Node& node, std::wstring_view name,
+//                        const StyleBlobProperty& property, std::wstring_view text);
+//   StyleWriteResult Clear(const Node& node, std::wstring_view name);
+//
+// With a nonzero rootStep, root stands for compound rootStep of every
+// selector: the caller knows root's ancestors match the compounds before it,
+// so only the rest is matched. It can still match below root, unless
+// maxDepth stops it reaching its end from anywhere else.
+template <typename Tree, typename Writer>
+void ApplyStylePatch(const typename Tree::Node& root, const StyleBlobView& before, const StyleBlobView& after,
+                     const StylePatch& patch, Writer& writer, StylePatchStats& stats, int maxDepth = 64,
+                     size_t rootStep = 0) {
+    if (patch.Empty()) return;
+
+    // Only the patched rules' selectors are matched; the rule id is the index in the patch
+    SelectorAutomaton<Tree> automaton;
+    std::vector<SelectorStep> steps;
+    for (uint32_t i = 0; i < patch.rules.size(); i++) {
+        const StyleRulePatch& rule = patch.rules[i];
+        bool parsed = rule.change == StyleChange::Removed
+                          ? before.RuleSelector(before.Rule(rule.before), steps)
+                          : after.RuleSelector(after.Rule(rule.after), steps);
+        if (!parsed || steps.size() <= rootStep) continue;
+
+        steps.erase(steps.begin(), steps.begin() + rootStep);
+        automaton.AddRule(steps, i);
+    }
+
+    auto count = [&stats](StyleWriteResult result, uint64_t& done) {
+        if (result == StyleWriteResult::Written) done++;
+        if (result == StyleWriteResult::Unchanged) stats.writesElided++;
+        if (result == StyleWriteResult::Unsupported) stats.unsupported++;
+    };
+
+    automaton.Match(root, [&](const typename Tree::Node& node, uint32_t i) {
+        const StyleRulePatch& rule = patch.rules[i];
+        stats.elementsMatched++;
+
+        if (!rule.cleared.empty()) {
+            const StyleBlobProperty* properties = before.Properties(before.Rule(rule.before));
+            for (uint32_t q : rule.cleared) {
+                count(writer.Clear(node, before.String(properties[q].name)), stats.clears);
+            }
+        }
+
+        if (!rule.set.empty()) {
+            const StyleBlobProperty* properties = after.Properties(after.Rule(rule.after));
+            for (uint32_t p : rule.set) {
+                count(writer.Set(node, after.String(properties[p].name), properties[p],
+                                 after.String(properties[p].text)),
+                      stats.writesIssued);
+            }
+        }
+    }, maxDepth);
+}
+
+// =============================================================
+//  Tree snapshots
+// =============================================================
+
+// A snapshot is the visual tree below some root written out as a blob, so a
+// tree captured on a user's machine can be walked by the same searches and
+// matchers elsewhere. SnapshotTree reads the blob in place (a mapped file
+// works as is) and implements the tree traits. Nodes are stored breadth
+// first with the root at index 0, so each node's children are consecutive
+// and it only needs the index of the first one. Class names and Names are
+// stored as strings, since atoms only mean something inside one process.
+// Version 2 added each node's subtree hash.
+
+constexpr uint32_t kSnapshotMagic = 0x5354424F;  // "OBTS"
+constexpr uint32_t kSnapshotVersion = 2;
+constexpr uint32_t kNoSnapshotNode = 0xFFFFFFFF;
+constexpr uint32_t kNoSnapshotString = 0xFFFFFFFF;
+
+// Which of a node's properties were read
+enum SnapshotPropertyFlags : uint32_t {
+    kSnapshotWidth = 1 << 0,
+    kSnapshotHeight = 1 << 1,
+    kSnapshotMargin = 1 << 2,
+    kSnapshotOrientation = 1 << 3,  // StackPanels only
+};
+
+struct SnapshotProperties {
+    uint32_t flags;       // SnapshotPropertyFlags
+    uint8_t orientation;  // XAML Orientation: 0 vertical, 1 horizontal
+    uint8_t reserved[3];
+    double width;      // NaN for Auto
+    double height;     // NaN for Auto
+    double margin[4];  // left, top, right, bottom
+};
+
+struct SnapshotHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t charSize;   // sizeof(wchar_t) of the writer
+    uint32_t totalSize;  // whole blob, header included
+    uint32_t checksum;   // BlobChecksum
+    uint32_t truncated;  // nonzero if a limit cut the walk short
+    BlobSection strings;  // BlobString
+    BlobSection chars;    // wchar_t, each string null-terminated
+    BlobSection nodes;    // SnapshotNode, breadth first
+};
+
+struct SnapshotNode {
+    uint32_t className;   // string index, kNoSnapshotString if not interned
+    uint32_t name;        // string index, kNoSnapshotString if unnamed or no selector's Name
+    uint32_t parent;      // kNoSnapshotNode for the root
+    uint32_t firstChild;  // node index
+    uint32_t childCount;
+    uint32_t reserved;
+    uint64_t subtreeHash;  // of the class names and Names at and below the node
+    SnapshotProperties properties;
+};
+
+inline uint64_t MixHash(uint64_t hash, uint64_t value) {
+    return hash ^ (value + 0x9E3779B97F4A7C15ull + (hash << 6) + (hash >> 2));
+}
+
+// Walks the tree below root, root included, into a blob; empty if root is
+// null. Nodes maxDepth below root are stored without their children. If
+// nodes isn't null, it receives the tree's nodes in snapshot order.
+// readProperties fills in what it can read of a node:
+//
+//   void operator()(const Node& node, SnapshotProperties& properties);
+template <typename Tree, typename ReadProperties>
+std::vector<uint8_t> CaptureTreeSnapshot(const typename Tree::Node& root, ReadProperties&& readProperties,
+                                         size_t maxNodes = 65536, int maxDepth = INT_MAX,
+                                         std::vector<typename Tree::Node>* nodeList = nullptr) {
+    if (Tree::IsNull(root)) return {};
+
+    SnapshotHeader header = {};
+    header.magic = kSnapshotMagic;
+    header.version = kSnapshotVersion;
+    header.charSize = sizeof(wchar_t);
+
+    // Atoms are small and dense, so their string indexes go in a flat array
+    BlobStringTable strings;
+    std::vector<uint32_t> atomStrings;
+    std::vector<uint64_t> stringHashes;
+    auto stringFor = [&](Atom atom) {
+        if (atom == kNoAtom) return kNoSnapshotString;
+        if (atom >= atomStrings.size()) atomStrings.resize(atom + 1, kNoSnapshotString);
+        if (atomStrings[atom] == kNoSnapshotString) {
+            atomStrings[atom] = strings.Add(AtomText(atom));
+            stringHashes.push_back(HashText(AtomText(atom)));
+        }
+        return atomStrings[atom];
+    };
+
+    std::vector<typename Tree::Node> queue = {root};
+    std::vector<uint32_t> parents = {kNoSnapshotNode};
+    std::vector<int> depths = {0};
+    std::vector<SnapshotNode> nodes;
+    for (size_t i = 0; i < queue.size(); i++) {
+        auto node = queue[i];  // a copy; the queue grows below
+
+        SnapshotNode record = {};
+        record.className = stringFor(Tree::ClassAtom(node));
+        record.name = stringFor(Tree::NameAtom(node));
+        record.parent = parents[i];
+        record.firstChild = static_cast<uint32_t>(queue.size());
+        readProperties(node, record.properties);
+
+        int childCount = Tree::ChildCount(node);
+        if (childCount > 0 && depths[i] >= maxDepth) {
+            header.truncated = 1;
+            childCount = 0;
+        }
+        for (int c = 0; c < childCount; c++) {
+            auto child = Tree::Child(node, c);
+            if (Tree::IsNull(child)) continue;
+
+            if (queue.size() >= maxNodes) {
+                header.truncated = 1;
+                break;
+            }
+            queue.push_back(child);
+            parents.push_back(static_cast<uint32_t>(i));
+            depths.push_back(depths[i] + 1);
+        }
+        record.childCount = static_cast<uint32_t>(queue.size()) - record.firstChild;
+        nodes.push_back(record);
+    }
+
+    // Children come after their parent, so one backward pass hashes every subtree
+    auto stringHash = [&](uint32_t index) { return index == kNoSnapshotString ? 0 : stringHashes[index]; };
+    for (size_t i = nodes.size(); i-- > 0;) {
+        SnapshotNode& record = nodes[i];
+        uint64_t hash = MixHash(stringHash(record.className), stringHash(record.name));
+        hash = MixHash(hash, record.childCount);
+        for (uint32_t c = record.firstChild; c < record.firstChild + record.childCount; c++) {
+            hash = MixHash(hash, nodes[c].subtreeHash);
+        }
+        record.subtreeHash = hash;
+    }
+
+    std::vector<uint8_t> blob(sizeof(header));
+    header.strings = AppendBlobSection(blob, strings.Strings());
+    header.chars = AppendBlobSection(blob, strings.Chars());
+    header.nodes = AppendBlobSection(blob, nodes);
+    header.totalSize = static_cast<uint32_t>(blob.size());
+    std::memcpy(blob.data(), &header, sizeof(header));
+
+    header.checksum = BlobChecksum(blob.data(), blob.size(), offsetof(SnapshotHeader, checksum));
+    std::memcpy(blob.data(), &header, sizeof(header));
+
+    if (nodeList) *nodeList = std::move(queue);
+    return blob;
+}
+
+// Tree traits over a snapshot. The blob must stay alive and unmodified while
+// the tree or any of its nodes are in use; attaching interns the class names
+// and Names its nodes use but copies nothing else.
+class SnapshotTree {
+public:
+    struct Node {
+        const SnapshotTree* tree;
+        uint32_t index;
+    };
+
+    // Validates the whole blob first, so the traits don't check anything
+    bool Attach(const void* data, size_t size) {
+        Detach();
+        const auto* bytes = static_cast<const uint8_t*>(data);
+        if (!Validate(bytes, size)) return false;
+
+        const auto& header = *reinterpret_cast<const SnapshotHeader*>(bytes);
+        const auto* strings = reinterpret_cast<const BlobString*>(bytes + header.strings.offset);
+        const auto* chars = reinterpret_cast<const wchar_t*>(bytes + header.chars.offset);
+        m_header = &header;
+        m_nodes = reinterpret_cast<const SnapshotNode*>(bytes + header.nodes.offset);
+        m_strings = strings;
+        m_chars = chars;
+
+        // A string's table depends on whether nodes use it as a class or a
+        // Name. Names are only looked up, like on the live tree.
+        auto resolve = [&](AtomTable& table, std::vector<Atom>& atoms, uint32_t string, bool intern) {
+            if (string != kNoSnapshotString && atoms[string] == kNoAtom) {
+                std::wstring_view text(chars + strings[string].offset, strings[string].length);
+                atoms[string] = intern ? table.Intern(text) : table.Lookup(text);
+            }
+        };
+        m_classAtoms.assign(header.strings.count, kNoAtom);
+        m_nameAtoms.assign(header.strings.count, kNoAtom);
+        for (uint32_t i = 0; i < header.nodes.count; i++) {
+            resolve(g_classAtoms, m_classAtoms, m_nodes[i].className, true);
+            resolve(g_nameAtoms, m_nameAtoms, m_nodes[i].name, false);
+        }
+        return true;
+    }
+
+    void Detach() {
+        m_header = nullptr;
+        m_nodes = nullptr;
+        m_strings = nullptr;
+        m_chars = nullptr;
+        m_classAtoms.clear();
+        m_nameAtoms.clear();
+    }
+
+    bool Attached() const { return m_header != nullptr; }
+    bool Truncated() const { return m_header && m_header->truncated; }
+    uint32_t NodeCount() const { return m_header ? m_header->nodes.count : 0; }
+    Node Root() const { return {this, NodeCount() ? 0 : kNoSnapshotNode}; }
+
+    static const SnapshotProperties& Properties(const Node& node) { return Record(node).properties; }
+    static uint64_t SubtreeHash(const Node& node) { return Record(node).subtreeHash; }
+
+    // As stored, in the blob; empty if not stored
+    static std::wstring_view ClassName(const Node& node) { return node.tree->String(Record(node).className); }
+    static std::wstring_view Name(const Node& node) { return node.tree->String(Record(node).name); }
+
+    static Node Null() { return {nullptr, kNoSnapshotNode}; }
+    static bool IsNull(const Node& node) { return node.index == kNoSnapshotNode; }
+    static int ChildCount(const Node& node) { return static_cast<int>(Record(node).childCount); }
+    static Node Child(const Node& node, int index) { return {node.tree, Record(node).firstChild + index}; }
+    static Node Parent(const Node& node) { return {node.tree, Record(node).parent}; }
+    static Atom ClassAtom(const Node& node) { return AtomOf(node.tree->m_classAtoms, Record(node).className); }
+    static Atom NameAtom(const Node& node) { return AtomOf(node.tree->m_nameAtoms, Record(node).name); }
+    static const void* Identity(const Node& node) { return &Record(node); }
+
+private:
+    static const SnapshotNode& Record(const Node& node) { return node.tree->m_nodes[node.index]; }
+
+    static Atom AtomOf(const std::vector<Atom>& atoms, uint32_t string) {
+        return string == kNoSnapshotString ? kNoAtom : atoms[string];
+    }
+
+    std::wstring_view String(uint32_t index) const {
+        if (index == kNoSnapshotString) return {};
+        return {m_chars + m_strings[index].offset, m_strings[index].length};
+    }
+
+    static bool Validate(const uint8_t* data, size_t size) {
+        if (!data || size < sizeof(SnapshotHeader) ||
+            reinterpret_cast<uintptr_t>(data) % alignof(SnapshotNode) != 0) {
+            return false;
+        }
+
+        const auto& header = *reinterpret_cast<const SnapshotHeader*>(data);
+        if (header.magic != kSnapshotMagic || header.version != kSnapshotVersion ||
+            header.charSize != sizeof(wchar_t) || header.totalSize != size ||
+            header.checksum != BlobChecksum(data, size, offsetof(SnapshotHeader, checksum))) {
+            return false;
+        }
+
+        if (!BlobSectionFits<BlobString>(header.strings, size, sizeof(SnapshotHeader)) ||
+            !BlobSectionFits<wchar_t>(header.chars, size, sizeof(SnapshotHeader)) ||
+            !BlobSectionFits<SnapshotNode>(header.nodes, size, sizeof(SnapshotHeader)) ||
+            !ValidBlobStrings(data, header.strings, header.chars)) {
+            return false;
+        }
+
+        auto validString = [&](uint32_t index) {
+            return index < header.strings.count || index == kNoSnapshotString;
+        };
+
+        // Children come after their parent and point back at it, so every
+        // walk terminates and reaches each node at most once
+        const auto* nodes = reinterpret_cast<const SnapshotNode*>(data + header.nodes.offset);
+        for (uint32_t i = 0; i < header.nodes.count; i++) {
+            const SnapshotNode& node = nodes[i];
+            if (!validString(node.className) || !validString(node.name) ||
+                (i == 0) != (node.parent == kNoSnapshotNode)) {
+                return false;
+            }
+
+            if (node.childCount == 0) continue;
+            if (node.firstChild <= i || uint64_t{node.firstChild} + node.childCount > header.nodes.count) {
+                return false;
+            }
+            for (uint32_t c = node.firstChild; c < node.firstChild + node.childCount; c++) {
+                if (nodes[c].parent != i) return false;
+            }
+        }
+
+        return true;
+    }
+
+    const SnapshotHeader* m_header = nullptr;
+    const SnapshotNode* m_nodes = nullptr;
+    const BlobString* m_strings = nullptr;
+    const wchar_t* m_chars = nullptr;
+    std::vector<Atom> m_classAtoms;  // by string index
+    std::vector<Atom> m_nameAtoms;
+};
+
+// =============================================================
+//  Tree diffing
+// =============================================================
+
+// Two snapshots of the same tree are compared top down. The children of two
+// paired nodes are paired by class name and Name, the k-th of a kind with
+// the k-th where they can be; a pair whose subtree hashes agree is skipped
+// without reading below it, so the work follows what changed rather than
+// the size of the tree. Of the paired children that changed order, as few
+// as explain the new order are reported as moved. The mod doesn't diff the
+// live tree, where capturing it again costs more than restyling the loaded
+// icons; this compares captured snapshots.
+
+enum class TreeEditKind : uint8_t { Inserted, Removed, Moved };
+
+struct TreeEdit {
+    TreeEditKind kind;
+    SnapshotTree::Node before;  // null if Inserted
+    SnapshotTree::Node after;   // null if Removed
+    SnapshotTree::Node parent;  // in the new tree; null at the root
+};
+
+struct TreeDiffStats {
+    uint64_t pairsCompared = 0;    // paired nodes whose subtrees differed
+    uint64_t subtreesSkipped = 0;  // paired nodes whose subtrees were the same
+    uint64_t inserted = 0;
+    uint64_t removed = 0;
+    uint64_t moved = 0;
+};
+
+// Marks the entries of sequence that make up a longest increasing run
+inline void MarkLongestIncreasingRun(const std::vector<int>& sequence, std::vector<bool>& inRun) {
+    std::vector<int> tails;  // tails[k]: where the lowest-ending run of length k + 1 ends
+    std::vector<int> previous(sequence.size(), -1);
+    for (int i = 0; i < static_cast<int>(sequence.size()); i++) {
+        auto it = std::lower_bound(tails.begin(), tails.end(), sequence[i],
+                                   [&](int tail, int value) { return sequence[tail] < value; });
+        if (it != tails.begin()) previous[i] = *(it - 1);
+        if (it == tails.end()) {
+            tails.push_back(i);
+        } else {
+            *it = i;
+        }
+    }
+
+    inRun.assign(sequence.size(), false);
+    for (int i = tails.empty() ? -1 : tails.back(); i >= 0; i = previous[i]) inRun[i] = true;
+}
+
+inline bool SameNodeKind(const SnapshotTree::Node& a, const SnapshotTree::Node& b) {
+    return SnapshotTree::ClassAtom(a) == SnapshotTree::ClassAtom(b) &&
+           SnapshotTree::NameAtom(a) == SnapshotTree::NameAtom(b);
+}
+
+template <typename OnEdit>
+void DiffSnapshotPair(const SnapshotTree::Node& oldNode, const SnapshotTree::Node& newNode, OnEdit& onEdit,
+                      TreeDiffStats& stats) {
+    using Tree = SnapshotTree;
+
+    if (Tree::SubtreeHash(oldNode) == Tree::SubtreeHash(newNode)) {
+        stats.subtreesSkipped++;
+        return;
+    }
+    stats.pairsCompared++;
+
+    int oldCount = Tree::ChildCount(oldNode);
+    int newCount = Tree::ChildCount(newNode);
+    std::vector<int> pairedWith(newCount, -1);
+    std::vector<bool> used(oldCount, false);
+
+    // Children mostly keep their order, so each search starts just past the
+    // last pairing
+    int cursor = 0;
+    for (int j = 0; j < newCount; j++) {
+        auto child = Tree::Child(newNode, j);
+        for (int n = 0; n < oldCount; n++) {
+            int i = (cursor + n) % oldCount;
+            if (!used[i] && SameNodeKind(Tree::Child(oldNode, i), child)) {
+                pairedWith[j] = i;
+                used[i] = true;
+                cursor = i + 1;
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < oldCount; i++) {
+        if (used[i]) continue;
+        stats.removed++;
+        onEdit(TreeEdit{TreeEditKind::Removed, Tree::Child(oldNode, i), Tree::Null(), newNode});
+    }
+
+    std::vector<int> order;
+    for (int j = 0; j < newCount; j++) {
+        if (pairedWith[j] >= 0) order.push_back(pairedWith[j]);
+    }
+    std::vector<bool> kept;
+    MarkLongestIncreasingRun(order, kept);
+
+    for (int j = 0, k = 0; j < newCount; j++) {
+        auto child = Tree::Child(newNode, j);
+        if (pairedWith[j] < 0) {
+            stats.inserted++;
+            onEdit(TreeEdit{TreeEditKind::Inserted, Tree::Null(), child, newNode});
+            continue;
+        }
+
+        auto oldChild = Tree::Child(oldNode, pairedWith[j]);
+        if (!kept[k++]) {
+            stats.moved++;
+            onEdit(TreeEdit{TreeEditKind::Moved, oldChild, child, newNode});
+        }
+        DiffSnapshotPair(oldChild, child, onEdit, stats);
+    }
+}
+
+// Calls onEdit(const TreeEdit&) for each difference. Inserted and removed
+// subtrees are reported once, at their root.
+template <typename OnEdit>
+void DiffSnapshots(const SnapshotTree& before, const SnapshotTree& after, OnEdit&& onEdit, TreeDiffStats& stats) {
+    using Tree = SnapshotTree;
+
+    auto oldRoot = before.Root();
+    auto newRoot = after.Root();
+    if (!Tree::IsNull(oldRoot) && !Tree::IsNull(newRoot) && SameNodeKind(oldRoot, newRoot)) {
+        DiffSnapshotPair(oldRoot, newRoot, onEdit, stats);
+        return;
+    }
+
+    if (!Tree::IsNull(oldRoot)) {
+        stats.removed++;
+        onEdit(TreeEdit{TreeEditKind::Removed, oldRoot, Tree::Null(), Tree::Null()});
+    }
+    if (!Tree::IsNull(newRoot)) {
+        stats.inserted++;
+        onEdit(TreeEdit{TreeEditKind::Inserted, Tree::Null(), newRoot, Tree::Null()});
+    }
+}
+
+// =============================================================
+//  Frame coalescing
+// =============================================================
+
+// Events that arrive in the same frame are handled as one batch. The first
+// event queued asks its caller to schedule a flush and later ones ride along
+// with it; an item queued again before the flush is only handled once.
+// Single-threaded: queue and flush on the same thread.
+
+struct CoalescingStats {
+    uint64_t queued = 0;       // items added to a batch
+    uint64_t duplicates = 0;   // items already in the pending batch
+    uint64_t batches = 0;
+    uint64_t maxBatch = 0;
+    uint64_t passesSaved = 0;  // events handled by a batch another one started
+};
+
+template <typename Item>
+class FrameCoalescer {
+public:
+    // True if the caller has to schedule a flush; a flush already scheduled
+    // will pick the item up
+    bool Enqueue(const void* identity, Item item) {
+        if (std::find(m_identities.begin(), m_identities.end(), identity) != m_identities.end()) {
+            m_stats.duplicates++;
+            m_stats.passesSaved++;
+            return false;
+        }
+
+        m_identities.push_back(identity);
+        m_items.push_back(std::move(item));
+        m_stats.queued++;
+
+        bool schedule = !m_scheduled;
+        m_scheduled = true;
+        return schedule;
+    }
+
+    // Calls handle(std::vector<Item>&) with the pending batch, if any. Items
+    // queued from inside handle go into the next batch and make Enqueue ask
+    // for another flush.
+    template <typename Handle>
+    size_t Flush(Handle&& handle) {
+        m_scheduled = false;
+        if (m_items.empty()) return 0;
+
+        std::vector<Item> batch;
+        batch.swap(m_items);
+        m_identities.clear();
+
+        m_stats.batches++;
+        m_stats.maxBatch = std::max<uint64_t>(m_stats.maxBatch, batch.size());
+        m_stats.passesSaved += batch.size() - 1;
+
+        handle(batch);
+        return batch.size();
+    }
+
+    // Drops the pending batch without handling it
+    void Clear() {
+        m_items.clear();
+        m_identities.clear();
+        m_scheduled = false;
+    }
+
+    size_t Pending() const { return m_items.size(); }
+    const CoalescingStats& Stats() const { return m_stats; }
+
+private:
+    std::vector<Item> m_items;
+    std::vector<const void*> m_identities;  // batches are small, so searched linearly
+    bool m_scheduled = false;
+    CoalescingStats m_stats;
+};
+
+// =============================================================
+//  Event subscriptions
+// =============================================================
+
+// Revokers for per-element event handlers, held until the handler has done
+// its job, its element is gone, or the mod unloads. Entries live in
+// fixed-size slabs threaded onto a free list and are found by element
+// identity. At most maxLive are held, so memory follows the peak number of
+// elements waiting on a handler rather than how many came and went. A
+// Revoker revokes when a default-constructed one is assigned over it, or
+// when it is destroyed, so a registry is only destroyed on the thread its
+// handlers belong to. Single-threaded.
+
+struct SubscriptionStats {
+    uint64_t added = 0;
+    uint64_t revoked = 0;   // by Revoke, once the handler did its job
+    uint64_t swept = 0;     // their element was gone
+    uint64_t replaced = 0;  // a new element at a dead one's address
+    uint64_t rejected = 0;  // full, even after a sweep
+    size_t live = 0;
+    size_t peakLive = 0;
+    size_t slabs = 0;
+};
+
+template <typename Revoker>
+class SubscriptionRegistry {
+public:
+    static constexpr uint32_t kSlabSize = 64;
+
+    // The index has room for maxLive, so it never fills and clears itself
+    explicit SubscriptionRegistry(size_t maxLive) : m_maxLive(maxLive), m_index(maxLive) {}
+
+    // Holds revoker for identity's element. When full, entries for which
+    // expired(const Revoker&) is true are revoked to make room; if none are,
+    // revoker is dropped, which revokes it, and false is returned.
+    template <typename Expired>
+    bool Add(const void* identity, Revoker revoker, Expired&& expired) {
+        if (uint32_t* slot = m_index.Find(identity)) {
+            SlotAt(*slot).revoker = std::move(revoker);
+            m_stats.replaced++;
+            return true;
+        }
+
+        if (m_stats.live >= m_maxLive && Sweep(expired) == 0) {
+            m_stats.rejected++;
+            return false;
+        }
+
+        uint32_t slot = Allocate();
+        SlotAt(slot).identity = identity;
+        SlotAt(slot).revoker = std::move(revoker);
+        m_index.FindOrInsert(identity) = slot;
+
+        m_stats.added++;
+        m_stats.live++;
+        m_stats.peakLive = std::max(m_stats.peakLive, m_stats.live);
+        return true;
+    }
+
+    bool Revoke(const void* identity) {
+        uint32_t* found = m_index.Find(identity);
+        if (!found) return false;
+
+        uint32_t slot = *found;
+        m_index.Erase(identity);
+        Release(slot);
+        m_stats.revoked++;
+        return true;
+    }
+
+    template <typename Expired>
+    size_t Sweep(Expired&& expired) {
+        std::vector<const void*> dead;
+        m_index.ForEach([&](const void* identity, uint32_t& slot) {
+            if (expired(static_cast<const Revoker&>(SlotAt(slot).revoker))) dead.push_back(identity);
+        });
+
+        for (const void* identity : dead) {
+            uint32_t slot = *m_index.Find(identity);
+            m_index.Erase(identity);
+            Release(slot);
+        }
+        m_stats.swept += dead.size();
+        return dead.size();
+    }
+
+    // Revokes everything and frees the slabs; returns how many were live
+    size_t RevokeAll() {
+        size_t live = m_stats.live;
+        m_index.ForEach([&](const void*, uint32_t& slot) { Release(slot); });
+        m_index.Clear();
+
+        m_slabs.clear();
+        m_used = 0;
+        m_free = kNoSlot;
+        m_stats.slabs = 0;
+        return live;
+    }
+
+    size_t Live() const { return m_stats.live; }
+    const SubscriptionStats& Stats() const { return m_stats; }
+
+private:
+    static constexpr uint32_t kNoSlot = 0xFFFFFFFF;
+
+    struct Slot {
+        const void* identity = nullptr;
+        Revoker revoker{};
+        uint32_t nextFree = kNoSlot;
+    };
+
+    Slot& SlotAt(uint32_t slot) { return m_slabs[slot / kSlabSize][slot % kSlabSize]; }
+
+    uint32_t Allocate() {
+        if (m_free != kNoSlot) {
+            uint32_t slot = m_free;
+            m_free = SlotAt(slot).nextFree;
+            return slot;
+        }
+
+        if (m_used == m_slabs.size() * kSlabSize) {
+            m_slabs.push_back(std::make_unique<Slot[]>(kSlabSize));
+            m_stats.slabs = m_slabs.size();
+        }
+        return m_used++;
+    }
+
+    void Release(uint32_t slot) {
+        Slot& entry = SlotAt(slot);
+        entry.revoker = Revoker{};
+        entry.identity = nullptr;
+        entry.nextFree = m_free;
+        m_free = slot;
+        m_stats.live--;
+    }
+
+    size_t m_maxLive;
+    IdentityMap<uint32_t> m_index;  // identity -> slot
+    std::vector<std::unique_ptr<Slot[]>> m_slabs;
+    uint32_t m_used = 0;  // slots ever handed out; the free list holds the released ones
+    uint32_t m_free = kNoSlot;
+    SubscriptionStats m_stats;
+};
+
+// Y offsets for count items stacked itemHeight apart and centred on the
+// container, computed in one pass
+void ComputeStackOffsets(double* offsets, size_t count, double itemHeight) {
+    double first = -itemHeight * (static_cast<double>(count) - 1.0) / 2.0;
+    for (size_t i = 0; i < count; i++) {
+        offsets[i] = first + itemHeight * static_cast<double>(i);
+    }
+}
+
+// The icons of a stack container in order: IconView children, or IconViews
+// wrapped in a ContentPresenter as in the OmniButton's StackPanel
+template <typename Tree>
+void CollectStackIcons(const typename Tree::Node& container, std::vector<typename Tree::Node>& icons) {
+    icons.clear();
+
+    int childCount = Tree::ChildCount(container);
+    for (int i = 0; i < childCount; i++) {
+        auto child = Tree::Child(container, i);
+        if (Tree::IsNull(child)) continue;
+
+        if (g_classAtoms.Category(Tree::ClassAtom(child)) != ClassCategory::IconView) {
+            if (Tree::ChildCount(child) < 1) continue;
+            child = Tree::Child(child, 0);
+            if (Tree::IsNull(child) ||
+                g_classAtoms.Category(Tree::ClassAtom(child)) != ClassCategory::IconView) {
+                continue;
+            }
+        }
+
+        icons.push_back(child);
+    }
+}
+
+// Traits over the live XAML tree. Children that aren't FrameworkElements come
+// back null and are skipped, like the hand-written walks used to do.
+struct XamlTree {
+    using Node = FrameworkElement;
+
+    static Node Null() { return nullptr; }
+    static bool IsNull(const Node& node) { return !node; }
+
+    static int ChildCount(const Node& node) {
+        return VisualTreeHelper::GetChildrenCount(node);
+    }
+
+    static Node Child(const Node& node, int index) {
+        return VisualTreeHelper::GetChild(node, index).try_as<FrameworkElement>();
+    }
+
+    static Node Parent(const Node& node) {
+        return VisualTreeHelper::GetParent(node).try_as<FrameworkElement>();
+    }
+
+    static Atom ClassAtom(const Node& node) { return g_classAtoms.Intern(winrt::get_class_name(node)); }
+    static Atom NameAtom(const Node& node) { return g_nameAtoms.Lookup(node.Name()); }
+    static const void* Identity(const Node& node) { return winrt::get_abi(node); }
+};
+
+// Formats deferred log records off the UI thread. Wakes every 50 ms rather
+// than being signalled per record, so a log site never makes a syscall.
+HANDLE g_logDrainThread = nullptr;
+HANDLE g_logDrainStop = nullptr;
+
+constexpr ULONGLONG kMetricsDumpIntervalMs = 10000;
+
+// QPC ticks to nanoseconds, set in Wh_ModInit
+double g_nsPerQpcTick = 0;
+
+// Records the enclosing scope's duration under a hook metric. The summary is
+// only logged with debugLogging on, so otherwise the clock isn't read at all.
+class ScopedHookTimer {
+public:
+    explicit ScopedHookTimer(HookMetric hook)
+        : m_hook(hook), m_timed(g_debugLogging.load(std::memory_order_relaxed)) {
+        if (m_timed) QueryPerformanceCounter(&m_start);
+    }
+
+    ~ScopedHookTimer() {
+        if (!m_timed) return;
+        LARGE_INTEGER end;
+        QueryPerformanceCounter(&end);
+        g_metrics.RecordLatency(m_hook, static_cast<uint64_t>((end.QuadPart - m_start.QuadPart) * g_nsPerQpcTick));
+    }
+
+private:
+    HookMetric m_hook;
+    bool m_timed;
+    LARGE_INTEGER m_start;
+};
+
+void LogMetricsSummary() {
+    for (size_t i = 0; i < static_cast<size_t>(HookMetric::Count); i++) {
+        LatencySummary summary = g_metrics.ReadLatency(static_cast<HookMetric>(i));
+        if (summary.count == 0) continue;
+
+        Wh_Log(L"[Metrics] %s: n=%llu mean=%lluns p50=%lluns p90=%lluns p99=%lluns max=%lluns",
+               kHookMetricNames[i], summary.count, summary.meanNs, summary.p50Ns, summary.p90Ns,
+               summary.p99Ns, summary.maxNs);
+    }
+
+    Wh_Log(L"[Metrics] %s=%llu %s=%llu %s=%llu %s=%llu %s=%llu",
+           kCounterMetricNames[0], g_metrics.ReadCounter(CounterMetric::Traversals),
+           kCounterMetricNames[1], g_metrics.ReadCounter(CounterMetric::TransformsApplied),
+           kCounterMetricNames[2], g_metrics.ReadCounter(CounterMetric::CacheHits),
+           kCounterMetricNames[3], g_metrics.ReadCounter(CounterMetric::LoadedBatches),
+           kCounterMetricNames[4], g_metrics.ReadCounter(CounterMetric::LoadedPassesSaved));
+}
+
+// Tree snapshots are captured on a UI thread and handed to the drain thread,
+// which writes the latest one to %TEMP%\omnibutton-tree.snapshot, so the UI
+// thread never waits on the disk
+std::atomic<std::vector<uint8_t>*> g_pendingSnapshot{nullptr};
+
+void WriteSnapshotFile(const std::vector<uint8_t>& blob) {
+    const auto& header = *reinterpret_cast<const SnapshotHeader*>(blob.data());
+
+    WCHAR path[MAX_PATH];
+    DWORD length = GetTempPathW(MAX_PATH, path);
+    if (length == 0 || wcscat_s(path, L"omnibutton-tree.snapshot") != 0) {
+        LOG_ERROR(L"[Snapshot] No usable temp path");
+        return;
+    }
+
+    HANDLE file = CreateFileW(path, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        LOG_ERROR(L"[Snapshot] Can't create %s (error %u)", path, GetLastError());
+        return;
+    }
+
+    DWORD written = 0;
+    BOOL wrote = WriteFile(file, blob.data(), static_cast<DWORD>(blob.size()), &written, nullptr) &&
+                 written == blob.size();
+    CloseHandle(file);
+
+    if (!wrote) {
+        LOG_ERROR(L"[Snapshot] Failed writing %s", path);
+        return;
+    }
+    LOG_INFO(L"[Snapshot] Wrote %u nodes (%zu bytes%s) to %s", header.nodes.count, blob.size(),
+             header.truncated ? L", truncated" : L"", path);
+}
+
+void WritePendingSnapshot() {
+    std::unique_ptr<std::vector<uint8_t>> blob(g_pendingSnapshot.exchange(nullptr, std::memory_order_acquire));
+    if (blob) WriteSnapshotFile(*blob);
+}
+
+DWORD WINAPI LogDrainThreadProc(LPVOID) {
+    auto emit = [](const wchar_t* line) { Wh_Log(L"%s", line); };
+    ULONGLONG lastMetricsDump = GetTickCount64();
+    while (WaitForSingleObject(g_logDrainStop, 50) == WAIT_TIMEOUT) {
+        g_deferredLog.Drain(emit);
+        WritePendingSnapshot();
+
+        // The metrics summary rides along on the drain thread
+        ULONGLONG now = GetTickCount64();
+        if (now - lastMetricsDump >= kMetricsDumpIntervalMs) {
+            lastMetricsDump = now;
+            if (g_debugLogging.load(std::memory_order_relaxed)) LogMetricsSummary();
+        }
+    }
+    g_deferredLog.Drain(emit);
+    WritePendingSnapshot();
+    return 0;
+}
+
+void StartLogDrain() {
+    g_logDrainStop = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!g_logDrainStop) return;
+
+    g_logDrainThread = CreateThread(nullptr, 0, LogDrainThreadProc, nullptr, 0, nullptr);
+    if (!g_logDrainThread) {
+        CloseHandle(g_logDrainStop);
+        g_logDrainStop = nullptr;
+    }
+}
+
+void StopLogDrain() {
+    if (!g_logDrainThread) return;
+
+    SetEvent(g_logDrainStop);
+    WaitForSingleObject(g_logDrainThread, INFINITE);
+    CloseHandle(g_logDrainThread);
+    CloseHandle(g_logDrainStop);
+    g_logDrainThread = nullptr;
+    g_logDrainStop = nullptr;
+
+    // One captured after the drain's last pass isn't written
+    delete g_pendingSnapshot.exchange(nullptr, std::memory_order_acquire);
+}
+
+void LogPathCacheStats(const wchar_t* label, const TreePathCacheStats& stats) {
+    LOG_DEBUG(L"[PathCache] %s: hits=%llu misses=%llu notFound=%llu", LogLiteral{label},
+              stats.hits, stats.misses, stats.notFound);
+}
+
+// The OmniButton targets of style.yaml at the root of the repository, matched
+// together in one walk; the values are the rule ids the matchers report
+enum OmniButtonRule : uint32_t {
+    kRuleOmniButton,
+    kRuleIconStackPanel,
+    kRuleIconPresenter,
+    kRuleIconView,
+};
+
+const wchar_t* const kOmniButtonTargets[] = {
+    L"SystemTray.OmniButton#ControlCenterButton",
+    L"SystemTray.OmniButton#ControlCenterButton > Grid > ContentPresenter > ItemsPresenter > StackPanel",
+    L"SystemTray.OmniButton#ControlCenterButton > Grid > ContentPresenter > ItemsPresenter > StackPanel > ContentPresenter",
+    L"SystemTray.OmniButton#ControlCenterButton > Grid > ContentPresenter > ItemsPresenter > StackPanel > ContentPresenter > SystemTray.IconView",
+};
+
+// The IconView target is the deepest, 6 levels below the OmniButton, and 2
+// below the icon StackPanel
+constexpr int kOmniButtonTargetDepth = 6;
+constexpr int kIconStackPanelDepth = 4;
+constexpr int kIconStackPanelTargetDepth = kOmniButtonTargetDepth - kIconStackPanelDepth;
+
+// Over the live tree, or over a snapshot of it
+template <typename Tree>
+const SelectorAutomaton<Tree>& OmniButtonSelectors() {
+    static SelectorAutomaton<Tree> automaton = [] {
+        SelectorAutomaton<Tree> result;
+
+        for (uint32_t i = 0; i < ARRAYSIZE(kOmniButtonTargets); i++) {
+            if (!result.AddRule(kOmniButtonTargets[i], i)) {
+                LOG_ERROR(L"[Selectors] Failed to parse target: %s", kOmniButtonTargets[i]);
+            }
+        }
+        return result;
+    }();
+    return automaton;
+}
+
+// Interns the Names the targets match on before any tree is walked, so an
+// element's Name can be looked up without inserting it
+void InternSelectorNames() {
+    std::vector<SelectorStep> steps;
+    for (const wchar_t* target : kOmniButtonTargets) {
+        if (!ParseSelector(target, steps)) LOG_ERROR(L"[Selectors] Failed to parse target: %s", target);
+    }
+}
+
+// The icon StackPanel target's compounds, from the OmniButton down
+const std::vector<SelectorStep>& IconStackPanelSteps() {
+    static const std::vector<SelectorStep> steps = [] {
+        std::vector<SelectorStep> result;
+        if (!ParseSelector(kOmniButtonTargets[kRuleIconStackPanel], result)) result.clear();
+        return result;
+    }();
+    return steps;
+}
+
+// =============================================================
+//  Per-UI-thread state
+// =============================================================
+
+// What was last written to an icon, so unchanged properties aren't written
+// again: every write invalidates layout and costs another Measure/Arrange
+struct IconShadowState {
+    TranslateTransform transform{nullptr};  // reused, only its X/Y are updated
+    double x = NAN;
+    double y = NAN;
+};
+
+struct PropertyWriteStats {
+    uint64_t issued = 0;
+    uint64_t elided = 0;
+};
+
+struct CompiledStyles {
+    std::vector<uint8_t> blob;
+    StyleBlobView view;
+};
+
+// The Loaded handler of an IconView that hasn't been classified yet. The
+// handler only holds the element weakly, so neither keeps the other alive.
+struct IconSubscription {
+    winrt::weak_ref<FrameworkElement> element;
+    FrameworkElement::Loaded_revoker loaded;
+};
+
+constexpr size_t kMaxIconSubscriptions = 1024;
+
+// Everything the mod keeps for one taskbar UI thread; a secondary taskbar can
+// run on a thread of its own. Only that thread touches its entry, apart from
+// the fields marked otherwise. An entry is created by the thread's first
+// layout or icon, and deleted by the last task the mod runs on the thread.
+struct UiThread {
+    // Any thread; fixed at registration
+    HANDLE thread = nullptr;  // SYNCHRONIZE, to tell a busy thread from a gone one
+    winrt::Windows::UI::Core::CoreDispatcher dispatcher{nullptr};
+
+    // Any thread. Tasks queued here that the dispatcher still holds; their
+    // code unloads with the mod. Outlives the entry: unloading frees it once
+    // it reads zero.
+    std::atomic<uint32_t>* queuedTasks = new std::atomic<uint32_t>(0);
+
+    // Any thread
+    std::atomic<bool> relayoutPending{false};
+    SettingsReader settingsReader;
+
+    // Classifies IconViews as they load, mostly without walking their parents.
+    // The last verdict, -1 before the first, so only changes are logged.
+    RightToLeftMatcher<XamlTree> omniIconMatcher{kOmniButtonTargets[kRuleIconView]};
+    int lastOmniIconVerdict = -1;
+
+    // Found from the SystemTray root by ApplyVerticalStylingToOmniButton, and
+    // from the XamlRoot content by TraverseAndStyleXamlTree
+    TreePathCache<XamlTree> omniButtonPathCache{L"SystemTray.OmniButton#ControlCenterButton"};
+    TreePathCache<XamlTree> omniStackPanelPathCache{
+        L"SystemTray.OmniButton#ControlCenterButton > Grid > ContentPresenter > ItemsPresenter > StackPanel"};
+
+    IdentityMap<IconShadowState> iconShadows{64};
+    PropertyWriteStats propertyWrites;
+
+    // Containers laid out so far, so a settings change can lay them out again
+    IdentityMap<winrt::weak_ref<FrameworkElement>> styledContainers{16};
+
+    // The layout rules on the icons now; the same rules as a patch over
+    // nothing, for icons that load later; whether they can be matched from
+    // an icon StackPanel; and the pitch the icons were last offset with
+    std::unique_ptr<CompiledStyles> layoutStyles;
+    StylePatch layoutStylesPatch;
+    bool layoutStylesBelowStackPanel = false;
+    StylePatchStats stylePatchStats;
+    double laidOutItemHeight = NAN;
+    bool laidOutEnabled = false;
+
+    // IconViews whose Loaded fired since the last batch
+    FrameCoalescer<FrameworkElement> loadedIcons;
+    SubscriptionRegistry<IconSubscription> iconSubscriptions{kMaxIconSubscriptions};
+
+    ~UiThread() {
+        if (thread) CloseHandle(thread);
+    }
+};
+
+// Under g_uiThreadsLock. Unloading takes the entries out and has each thread
+// delete its own.
+std::vector<UiThread*> g_uiThreads;
+SRWLOCK g_uiThreadsLock = SRWLOCK_INIT;
+thread_local UiThread* t_uiThread = nullptr;
+
+// UI thread: this thread's entry, registered on first use. Null once the mod
+// is unloading.
+UiThread* RegisterUiThread(const FrameworkElement& element) {
+    if (t_uiThread) return t_uiThread;
+    auto dispatcher = element.Dispatcher();
+
+    // Checked under the lock, so unloading either sees the entry or we see it
+    UiThread* ui = nullptr;
+    AcquireSRWLockExclusive(&g_uiThreadsLock);
+    if (!g_unloading) {
+        ui = new UiThread();
+        ui->thread = OpenThread(SYNCHRONIZE, FALSE, GetCurrentThreadId());
+        ui->dispatcher = dispatcher;
+        AddSettingsReader(ui->settingsReader);
+        g_uiThreads.push_back(ui);
+    }
+    ReleaseSRWLockExclusive(&g_uiThreadsLock);
+
+    t_uiThread = ui;
+    return ui;
+}
+
+// Any thread. A taskbar's thread can exit with the taskbar. Its entry is left
+// unreleased, since its XAML objects can't be released on another thread, but
+// it stops holding settings snapshots back.
+void ForgetExitedUiThreads() {
+    AcquireSRWLockExclusive(&g_uiThreadsLock);
+    auto exited = std::remove_if(g_uiThreads.begin(), g_uiThreads.end(), [](UiThread* ui) {
+        if (!ui->thread || WaitForSingleObject(ui->thread, 0) != WAIT_OBJECT_0) return false;
+
+        RemoveSettingsReader(ui->settingsReader);
+        return true;
+    });
+    g_uiThreads.erase(exited, g_uiThreads.end());
+    ReleaseSRWLockExclusive(&g_uiThreadsLock);
+}
+
+// UI thread, from a hook or a task that has checked it's registered
+UiThread& CurrentUiThread() {
+    return *t_uiThread;
+}
+
+// Captured by every queued task. Copies count too, since the delegate keeps
+// its own copy of the lambda; the last one goes when the dispatcher releases it.
+struct QueuedUiTaskToken {
+    std::atomic<uint32_t>* count;
+
+    explicit QueuedUiTaskToken(std::atomic<uint32_t>* count) : count(count) {
+        count->fetch_add(1, std::memory_order_relaxed);
+    }
+    QueuedUiTaskToken(const QueuedUiTaskToken& other) : QueuedUiTaskToken(other.count) {}
+    QueuedUiTaskToken& operator=(const QueuedUiTaskToken&) = delete;
+    ~QueuedUiTaskToken() { count->fetch_sub(1, std::memory_order_release); }
+};
+
+// Any thread that can see the entry. False if the dispatcher refused the task.
+template <typename Task>
+bool QueueUiTask(UiThread& ui, winrt::Windows::UI::Core::CoreDispatcherPriority priority, Task task) {
+    try {
+        ui.dispatcher.RunAsync(priority, [token = QueuedUiTaskToken(ui.queuedTasks), task = std::move(task)] {
+            task();
+        });
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
+// UI thread: the last task the mod runs here. The Loaded handlers still
+// waiting on icons are revoked, and the thread's XAML objects released, on
+// the thread they belong to.
+void ReleaseUiThread() {
+    UiThread* ui = t_uiThread;
+    if (!ui) return;
+
+    const SubscriptionStats& stats = ui->iconSubscriptions.Stats();
+    Wh_Log(L"[Subscriptions] Revoking %zu live handlers (added=%llu revoked=%llu swept=%llu peak=%zu)",
+           stats.live, stats.added, stats.revoked, stats.swept, stats.peakLive);
+    ui->iconSubscriptions.RevokeAll();
+
+    t_uiThread = nullptr;
+    RemoveSettingsReader(ui->settingsReader);
+    delete ui;
+}
+
+// Find child element by class name
+FrameworkElement FindChildByClassName(
+    FrameworkElement element,
+    const wchar_t* className
+) {
+    try {
+        Atom classAtom = g_classAtoms.Intern(className);
+        return FindDescendant<XamlTree>(element, [classAtom](const FrameworkElement& node) {
+            return XamlTree::ClassAtom(node) == classAtom;
+        });
+    } catch (...) {
+    }
 
-## Known Issues
+    return nullptr;
+}
 
-- Experimental - may not work on all Windows 11 versions
-- May conflict with other system tray mods
-- Requires testing and iteration
+// Check if this IconView is part of the OmniButton
+bool IsOmniButtonIcon(FrameworkElement iconView) {
+    UiThread& ui = CurrentUiThread();
+    try {
+        // Matched right to left against the style.yaml IconView target
+        uint64_t filterHitsBefore = ui.omniIconMatcher.Stats().filterHits;
+        bool isOmni = ui.omniIconMatcher.Matches(iconView);
+        g_metrics.Count(CounterMetric::CacheHits, ui.omniIconMatcher.Stats().filterHits - filterHitsBefore);
+        if (ui.lastOmniIconVerdict != (int)isOmni) {
+            ui.lastOmniIconVerdict = isOmni;
+            const auto& stats = ui.omniIconMatcher.Stats();
+            LOG_DEBUG(L"[OmniButton Check] Now %s (typeRejects=%llu bloomRejects=%llu walks=%llu matches=%llu "
+                      L"filterHits=%llu)",
+                      isOmni ? L"OmniButton icons" : L"other icons", stats.typeRejects, stats.bloomRejects,
+                      stats.walks, stats.matches, stats.filterHits);
+        }
+        return isOmni;
 
-## Credits
+    } catch (...) {
+        LOG_ERROR_LIMITED(L"[OmniButton Check] Exception");
+        ui.omniIconMatcher.Clear();
+        return false;
+    }
+}
 
-Based on taskbar-notification-icon-spacing.wh.cpp by m417z.
-*/
-// ==/WindhawkModReadme==
+// The FrameworkElement properties a style rule can set from the mod
+DependencyProperty StyleDependencyProperty(std::wstring_view name) {
+    if (name == L"Width") return FrameworkElement::WidthProperty();
+    if (name == L"Height") return FrameworkElement::HeightProperty();
+    if (name == L"MinWidth") return FrameworkElement::MinWidthProperty();
+    if (name == L"MaxWidth") return FrameworkElement::MaxWidthProperty();
+    if (name == L"MinHeight") return FrameworkElement::MinHeightProperty();
+    if (name == L"MaxHeight") return FrameworkElement::MaxHeightProperty();
+    if (name == L"Margin") return FrameworkElement::MarginProperty();
+    if (name == L"HorizontalAlignment") return FrameworkElement::HorizontalAlignmentProperty();
+    if (name == L"VerticalAlignment") return FrameworkElement::VerticalAlignmentProperty();
+    return nullptr;
+}
 
-// ==WindhawkModSettings==
-/*
-- enableVertical: true
-  $name: Enable vertical arrangement
-  $description: Enable/disable vertical stacking of system tray icons
-- iconSize: 32
-  $name: Icon size (pixels)
-  $description: Size of each icon in pixels (16-48)
-- iconSpacing: 4
-  $name: Icon spacing (pixels)
-  $description: Vertical spacing between icons when arranged vertically (0-32)
-- debugLogging: true
-  $name: Enable debug logging
-  $description: Log detailed information for troubleshooting (use DebugView - enabled by default for testing)
-*/
-// ==/WindhawkModSettings==
+// Reads the local value back first and only writes if it differs
+template <typename T, typename Equals>
+StyleWriteResult WriteLocalValue(const FrameworkElement& element, const DependencyProperty& property,
+                                 const T& value, Equals&& equals) {
+    auto current = element.ReadLocalValue(property).try_as<winrt::Windows::Foundation::IReference<T>>();
+    if (current && equals(current.Value(), value)) return StyleWriteResult::Unchanged;
 
-#include <unknwn.h>               // IUnknown
-#include <winrt/base.h>          // winrt::com_ptr
-#include <windhawk_api.h>
-#include <windhawk_utils.h>
+    element.SetValue(property, winrt::box_value(value));
+    return StyleWriteResult::Written;
+}
 
-#undef GetCurrentTime  // Fix for WinRT conflict
+// Applies style patches to live elements
+struct XamlStyleWriter {
+    StyleWriteResult Set(const FrameworkElement& element, std::wstring_view name,
+                         const StyleBlobProperty& property, std::wstring_view text) {
+        DependencyProperty dp = StyleDependencyProperty(name);
+        if (!dp) return StyleWriteResult::Unsupported;
+
+        auto same = [](const auto& a, const auto& b) { return a == b; };
+
+        if (name == L"Margin") {
+            if (property.kind != StyleValueKind::Thickness) return StyleWriteResult::Unsupported;
+            const double* v = property.values;
+            return WriteLocalValue(element, dp, Thickness{v[0], v[1], v[2], v[3]},
+                                   [](const Thickness& a, const Thickness& b) {
+                                       return a.Left == b.Left && a.Top == b.Top && a.Right == b.Right &&
+                                              a.Bottom == b.Bottom;
+                                   });
+        }
 
-#include <windows.h>
-#include <winrt/Windows.UI.Xaml.h>
-#include <winrt/Windows.UI.Xaml.Controls.h>
-#include <winrt/Windows.UI.Xaml.Media.h>
+        if (name == L"HorizontalAlignment") {
+            if (text == L"Left") return WriteLocalValue(element, dp, HorizontalAlignment::Left, same);
+            if (text == L"Center") return WriteLocalValue(element, dp, HorizontalAlignment::Center, same);
+            if (text == L"Right") return WriteLocalValue(element, dp, HorizontalAlignment::Right, same);
+            if (text == L"Stretch") return WriteLocalValue(element, dp, HorizontalAlignment::Stretch, same);
+            return StyleWriteResult::Unsupported;
+        }
 
-using namespace winrt::Windows::UI::Xaml;
-using namespace winrt::Windows::UI::Xaml::Controls;
-using namespace winrt::Windows::UI::Xaml::Media;
+        if (name == L"VerticalAlignment") {
+            if (text == L"Top") return WriteLocalValue(element, dp, VerticalAlignment::Top, same);
+            if (text == L"Center") return WriteLocalValue(element, dp, VerticalAlignment::Center, same);
+            if (text == L"Bottom") return WriteLocalValue(element, dp, VerticalAlignment::Bottom, same);
+            if (text == L"Stretch") return WriteLocalValue(element, dp, VerticalAlignment::Stretch, same);
+            return StyleWriteResult::Unsupported;
+        }
 
-// Settings
-struct {
-    bool enableVertical;
-    int iconSize;
-    int iconSpacing;
-    bool debugLogging;
-} g_settings;
+        if (property.kind != StyleValueKind::Number) return StyleWriteResult::Unsupported;
+        return WriteLocalValue(element, dp, property.values[0], same);
+    }
 
-bool g_initialized = false;
-bool g_unloading = false;
+    StyleWriteResult Clear(const FrameworkElement& element, std::wstring_view name) {
+        DependencyProperty dp = StyleDependencyProperty(name);
+        if (!dp) return StyleWriteResult::Unsupported;
 
-// Find child element by class name
-FrameworkElement FindChildByClassName(
-    DependencyObject element,
-    const wchar_t* className
-) {
-    try {
-        int childrenCount = Media::VisualTreeHelper::GetChildrenCount(element);
+        element.ClearValue(dp);
+        return StyleWriteResult::Written;
+    }
+};
+
+// The sizes the mod gives OmniButton icons, as style rules, so a settings
+// change reaches the icons as a diff against what they already have
+std::unique_ptr<CompiledStyles> CompileLayoutStyles(const Settings& settings) {
+    StyleSource source;
+    if (settings.enableVertical) {
+        std::wstring size = std::to_wstring(settings.iconSize);
+        source.rules.push_back({kOmniButtonTargets[kRuleIconView], {L"Width=" + size, L"Height=" + size}});
+    }
 
-        for (int i = 0; i < childrenCount; i++) {
-            auto child = Media::VisualTreeHelper::GetChild(element, i);
+    auto styles = std::make_unique<CompiledStyles>();
+    styles->blob = StyleBlobWriter().Compile(source, nullptr);
+    styles->view.Attach(styles->blob.data(), styles->blob.size());
+    return styles;
+}
 
-            auto childElement = child.try_as<FrameworkElement>();
-            if (childElement) {
-                auto childClassName = winrt::get_class_name(childElement);
-                if (childClassName == className) {
-                    return childElement;
-                }
-            }
+const StyleBlobView g_noStyles{};
 
-            auto found = FindChildByClassName(child, className);
-            if (found) {
-                return found;
-            }
+// True if every rule's selector starts with the icon StackPanel target, so
+// the rules can be matched from a StackPanel known to be one
+bool RulesBelowIconStackPanel(const StyleBlobView& styles) {
+    const auto& prefix = IconStackPanelSteps();
+    if (prefix.empty()) return false;
+
+    std::vector<SelectorStep> steps;
+    for (uint32_t i = 0; i < styles.RuleCount(); i++) {
+        if (!styles.RuleSelector(styles.Rule(i), steps) || steps.size() <= prefix.size() ||
+            !std::equal(prefix.begin(), prefix.end(), steps.begin())) {
+            return false;
         }
-    } catch (...) {
     }
+    return true;
+}
 
+void SetLayoutStyles(UiThread& ui, std::unique_ptr<CompiledStyles> styles) {
+    ui.layoutStyles = std::move(styles);
+    ui.layoutStylesPatch = DiffStyleRules(g_noStyles, ui.layoutStyles->view);
+    ui.layoutStylesBelowStackPanel = RulesBelowIconStackPanel(ui.layoutStyles->view);
+}
+
+// The OmniButton a StackPanel belongs to, which the layout rules' targets start from
+FrameworkElement FindOmniButtonAbove(FrameworkElement element) {
+    for (int i = 0; element && i < kOmniButtonTargetDepth; i++) {
+        element = XamlTree::Parent(element);
+        if (element && g_classAtoms.Category(XamlTree::ClassAtom(element)) == ClassCategory::OmniButton) {
+            return element;
+        }
+    }
     return nullptr;
 }
 
-// Check if this IconView is part of the OmniButton
-bool IsOmniButtonIcon(FrameworkElement iconView) {
-    try {
-        // Walk up the tree to find if we're inside an OmniButton
-        DependencyObject current = iconView;
-
-        for (int depth = 0; depth < 10; depth++) {  // Max 10 levels up
-            auto parent = Media::VisualTreeHelper::GetParent(current);
-            if (!parent) break;
-
-            auto parentElement = parent.try_as<FrameworkElement>();
-            if (parentElement) {
-                auto className = winrt::get_class_name(parentElement);
-                auto name = parentElement.Name();
-
-                Wh_Log(L"[OmniButton Check] Parent %d: class=%s, name=%s",
-                       depth, className.c_str(), name.c_str());
-
-                // Check for OmniButton indicators
-                // Convert hstring to wstring for comparison
-                std::wstring classNameStr(className);
-                if (classNameStr.find(L"OmniButton") != std::wstring::npos ||
-                    name == L"ControlCenterButton") {
-                    Wh_Log(L"[OmniButton Check] FOUND! This is an OmniButton icon");
-                    return true;
-                }
-            }
+// At most once per settings generation that has captureTreeSnapshot on, by
+// whichever UI thread gets there first
+std::atomic<uint64_t> g_snapshotCapturedFor{0};
+
+// The OmniButton's subtree, down to the inside of its icons
+constexpr size_t kMaxSnapshotNodes = 4096;
+constexpr int kSnapshotDepth = kOmniButtonTargetDepth + 6;
+
+void ReadSnapshotProperties(const FrameworkElement& element, SnapshotProperties& properties) {
+    properties.flags = kSnapshotWidth | kSnapshotHeight | kSnapshotMargin;
+    properties.width = element.Width();
+    properties.height = element.Height();
+
+    Thickness margin = element.Margin();
+    properties.margin[0] = margin.Left;
+    properties.margin[1] = margin.Top;
+    properties.margin[2] = margin.Right;
+    properties.margin[3] = margin.Bottom;
 
-            current = parent;
+    if (auto stackPanel = element.try_as<StackPanel>()) {
+        properties.flags |= kSnapshotOrientation;
+        properties.orientation = static_cast<uint8_t>(stackPanel.Orientation());
+    }
+}
+
+// Captures the subtree of the OmniButton above icon and hands it to the drain
+// thread to write
+void CaptureTreeSnapshotOnce(const FrameworkElement& icon) {
+    const Settings& settings = CurrentSettings();
+    if (!settings.captureTreeSnapshot) return;
+    if (g_snapshotCapturedFor.exchange(settings.generation, std::memory_order_relaxed) == settings.generation) {
+        return;
+    }
+
+    if (!g_logDrainThread) {
+        LOG_ERROR(L"[Snapshot] No drain thread to write it; not capturing");
+        return;
+    }
+
+    FrameworkElement omniButton = FindOmniButtonAbove(icon);
+    if (!omniButton) {
+        LOG_ERROR(L"[Snapshot] No OmniButton above the icon; not capturing");
+        return;
+    }
+
+    auto blob = std::make_unique<std::vector<uint8_t>>(
+        CaptureTreeSnapshot<XamlTree>(omniButton, ReadSnapshotProperties, kMaxSnapshotNodes, kSnapshotDepth));
+    delete g_pendingSnapshot.exchange(blob.release(), std::memory_order_acq_rel);
+}
+
+// The OmniButton above stackPanel if stackPanel is the icon StackPanel target,
+// checked from stackPanel up
+FrameworkElement IconStackPanelOmniButton(FrameworkElement stackPanel) {
+    const auto& steps = IconStackPanelSteps();
+    FrameworkElement element = stackPanel;
+    for (size_t i = steps.size(); i-- > 0;) {
+        if (!element || !NodeMatchesStep<XamlTree>(element, steps[i])) return nullptr;
+        if (i > 0) element = XamlTree::Parent(element);
+    }
+    return steps.empty() ? nullptr : element;
+}
+
+void ApplyLayoutStylePatch(FrameworkElement omniButton, const StyleBlobView& before, const StyleBlobView& after,
+                           const StylePatch& patch) {
+    StylePatchStats& stats = CurrentUiThread().stylePatchStats;
+    XamlStyleWriter writer;
+    ApplyStylePatch<XamlTree>(omniButton, before, after, patch, writer, stats, kOmniButtonTargetDepth);
+    LOG_DEBUG(L"[Styles] patch rules=%zu matched=%llu written=%llu elided=%llu cleared=%llu",
+              patch.rules.size(), stats.elementsMatched, stats.writesIssued, stats.writesElided, stats.clears);
+}
+
+void ApplyVerticalLayout(FrameworkElement container, bool applyStyles = true);
+
+// Restyles the icons that loaded into one icon StackPanel, then lays it out
+// again. Each icon is matched against the rules' compounds below the
+// StackPanel from the icon up, so the work follows the loaded icons, not the
+// size of the StackPanel. Returns false if the layout rules can't be matched
+// from the StackPanel.
+bool RestyleLoadedIcons(FrameworkElement container, const std::vector<FrameworkElement>& loadedIcons) {
+    UiThread& ui = CurrentUiThread();
+    if (!ui.layoutStyles) SetLayoutStyles(ui, CompileLayoutStyles(CurrentSettings()));
+    if (!ui.layoutStylesBelowStackPanel) return false;
+
+    const StyleBlobView& styles = ui.layoutStyles->view;
+    const StylePatch& patch = ui.layoutStylesPatch;
+    const void* containerIdentity = XamlTree::Identity(container);
+    const size_t prefix = IconStackPanelSteps().size();
+    XamlStyleWriter writer;
+    std::vector<SelectorStep> steps;
+
+    for (const StyleRulePatch& rule : patch.rules) {
+        if (rule.change == StyleChange::Removed || rule.set.empty()) continue;
+        if (!styles.RuleSelector(styles.Rule(rule.after), steps) || steps.size() <= prefix) continue;
+        const StyleBlobProperty* properties = styles.Properties(styles.Rule(rule.after));
+
+        for (const auto& icon : loadedIcons) {
+            // The compounds after the StackPanel's, from the icon up
+            FrameworkElement element = icon;
+            size_t i = steps.size();
+            while (i > prefix && element && NodeMatchesStep<XamlTree>(element, steps[i - 1])) {
+                element = XamlTree::Parent(element);
+                i--;
+            }
+            if (i > prefix || !element || XamlTree::Identity(element) != containerIdentity) continue;
+
+            ui.stylePatchStats.elementsMatched++;
+            for (uint32_t p : rule.set) {
+                StyleWriteResult result = writer.Set(icon, styles.String(properties[p].name), properties[p],
+                                                     styles.String(properties[p].text));
+                if (result == StyleWriteResult::Written) ui.stylePatchStats.writesIssued++;
+                if (result == StyleWriteResult::Unchanged) ui.stylePatchStats.writesElided++;
+                if (result == StyleWriteResult::Unsupported) ui.stylePatchStats.unsupported++;
+            }
         }
+    }
 
-        Wh_Log(L"[OmniButton Check] Not an OmniButton icon");
-        return false;
+    ApplyVerticalLayout(container, false);
 
-    } catch (...) {
-        Wh_Log(L"[OmniButton Check] Exception");
-        return false;
+    LOG_DEBUG(L"[Styles] loaded icons=%zu matched=%llu written=%llu elided=%llu", loadedIcons.size(),
+              ui.stylePatchStats.elementsMatched, ui.stylePatchStats.writesIssued, ui.stylePatchStats.writesElided);
+    return true;
+}
+
+// Write value through setter unless the shadow says it's already set
+template <typename Setter>
+void WriteIfChanged(PropertyWriteStats& writes, double& shadow, double value, Setter&& setter) {
+    if (shadow == value) {
+        writes.elided++;
+        return;
     }
+
+    setter(value);
+    shadow = value;
+    writes.issued++;
 }
 
-// --- Replacement: ApplyVerticalTransform (matches your signature) ---
-void ApplyVerticalTransform(FrameworkElement iconView, int /*iconIndex_unused*/)
-{
+// Apply one icon's vertical offset
+void ApplyVerticalTransform(FrameworkElement iconView, double yOffset, const Settings& settings) {
+    UiThread& ui = CurrentUiThread();
     try {
-        if (!g_settings.enableVertical || g_unloading) {
+        if (!settings.enableVertical || g_unloading) {
             // Properly clear RenderTransform
             iconView.ClearValue(winrt::Windows::UI::Xaml::FrameworkElement::RenderTransformProperty());
+            ui.iconShadows.Erase(XamlTree::Identity(iconView));
             return;
         }
 
-        // Determine index at runtime (ignore passed iconIndex which was unreliable)
-        int iconIndex = GetIndexInParent(iconView);
-        if (iconIndex < 0) iconIndex = 0;
-
-        // Compute sizing/offset
-        double itemHeight = static_cast<double>(g_settings.iconSize) + static_cast<double>(g_settings.iconSpacing);
+        IconShadowState& shadow = ui.iconShadows.FindOrInsert(XamlTree::Identity(iconView));
+        uint64_t writesBefore = ui.propertyWrites.issued;
 
-        // Attempt to get sibling count
-        int siblingCount = 1;
-        auto parent = winrt::Windows::UI::Xaml::Media::VisualTreeHelper::GetParent(iconView);
-        if (parent) {
-            auto parentFE = parent.try_as<FrameworkElement>();
-            if (parentFE) {
-                siblingCount = winrt::Windows::UI::Xaml::Media::VisualTreeHelper::GetChildrenCount(parentFE);
-                if (siblingCount <= 0) siblingCount = 1;
-            }
+        // A new element at a reused address, or something else replaced our
+        // transform: forget what we thought was applied
+        if (shadow.transform && iconView.RenderTransform() != shadow.transform) {
+            shadow = IconShadowState{};
         }
 
-        double totalHeight = itemHeight * static_cast<double>(siblingCount - 1);
-        double yOffset = itemHeight * static_cast<double>(iconIndex) - (totalHeight / 2.0);
-
-        Wh_Log(L"[Transform] index=%d siblings=%d yOffset=%.2f itemH=%.2f", iconIndex, siblingCount, yOffset, itemHeight);
+        if (!shadow.transform) {
+            // Create and apply a real WinRT TranslateTransform
+            TranslateTransform transform;
+            transform.X(0);
+            transform.Y(yOffset);
 
-        // Create and apply a real WinRT TranslateTransform
-        TranslateTransform transform;
-        transform.Y(yOffset);
-        transform.X(0);
+            // Apply transform (Loaded handler will be on UI thread)
+            iconView.RenderTransform(transform);
+            shadow.transform = transform;
+            shadow.x = 0;
+            shadow.y = yOffset;
+            ui.propertyWrites.issued++;
 
-        // Stabilize layout: set explicit icon size
-        iconView.Width(static_cast<double>(g_settings.iconSize));
-        iconView.Height(static_cast<double>(g_settings.iconSize));
+            LOG_DEBUG(L"[Transform] New transform yOffset=%.2f", yOffset);
+        } else {
+            WriteIfChanged(ui.propertyWrites, shadow.x, 0, [&](double value) { shadow.transform.X(value); });
+            WriteIfChanged(ui.propertyWrites, shadow.y, yOffset, [&](double value) { shadow.transform.Y(value); });
+        }
 
-        // Apply transform (Loaded handler will be on UI thread)
-        iconView.RenderTransform(transform);
+        if (ui.propertyWrites.issued != writesBefore) {
+            g_metrics.Count(CounterMetric::TransformsApplied);
+        }
 
     } catch (...) {
-        Wh_Log(L"[Transform] Exception applying transform");
+        LOG_ERROR_LIMITED(L"[Transform] Exception applying transform");
+        ui.iconShadows.Erase(XamlTree::Identity(iconView));
     }
 }
 
-// Style the OmniButton IconView
-void StyleOmniButtonIcon(FrameworkElement iconView) {
+// Lay out every icon in a container as one batch: the children are listed
+// once and all offsets computed before any of them is applied. Unless
+// applyStyles is false, the current layout rules are applied too.
+void ApplyVerticalLayout(FrameworkElement container, bool applyStyles) {
     try {
-        Wh_Log(L"[StyleOmniButton] Starting to style icon");
+        UiThread* ui = RegisterUiThread(container);
+        if (!ui) return;
+
+        // One snapshot for the whole pass, so every icon sees the same values
+        const Settings& settings = CurrentSettings();
+
+        std::vector<FrameworkElement> icons;
+        CollectStackIcons<XamlTree>(container, icons);
+
+        double itemHeight = static_cast<double>(settings.iconSize) + static_cast<double>(settings.iconSpacing);
+        std::vector<double> offsets(icons.size());
+        ComputeStackOffsets(offsets.data(), icons.size(), itemHeight);
 
-        // We need to determine which icon this is (0, 1, or 2)
-        // For now, we'll use a simple counter approach
-        // In a production version, we'd track this more carefully
-        static int iconCounter = 0;
-        int iconIndex = iconCounter % 3;
-        iconCounter++;
+        LOG_DEBUG(L"[Layout] icons=%zu itemH=%.2f", icons.size(), itemHeight);
 
-        Wh_Log(L"[StyleOmniButton] Assigning icon index: %d", iconIndex);
+        for (size_t i = 0; i < icons.size(); i++) {
+            ApplyVerticalTransform(icons[i], offsets[i], settings);
+        }
+        ui->laidOutItemHeight = itemHeight;
+        ui->laidOutEnabled = settings.enableVertical;
+
+        if (applyStyles) {
+            if (!ui->layoutStyles) SetLayoutStyles(*ui, CompileLayoutStyles(settings));
+            if (auto omniButton = FindOmniButtonAbove(container)) {
+                ApplyLayoutStylePatch(omniButton, g_noStyles, ui->layoutStyles->view, ui->layoutStylesPatch);
+            }
+        }
 
-        ApplyVerticalTransform(iconView, iconIndex);
+        ui->styledContainers.FindOrInsert(XamlTree::Identity(container)) = winrt::make_weak(container);
 
-        Wh_Log(L"[StyleOmniButton] Transform applied successfully");
+        LOG_DEBUG(L"[Layout] property writes issued=%llu elided=%llu",
+                  ui->propertyWrites.issued, ui->propertyWrites.elided);
 
     } catch (...) {
-        Wh_Log(L"[StyleOmniButton] Exception");
+        LOG_ERROR_LIMITED(L"[Layout] Exception");
     }
 }
 
-// Find OmniButton in the XAML tree starting from a given element
-FrameworkElement FindOmniButtonFromRoot(FrameworkElement root) {
-    try {
-        if (!root) return nullptr;
+// UI thread: lay out every container that's still alive with the current
+// settings. Also where the thread lets go of older settings snapshots.
+void RelayoutStyledContainers() {
+    UiThread* ui = t_uiThread;
+    if (!ui || g_unloading) return;
+    ui->relayoutPending.store(false, std::memory_order_relaxed);
+    AckSettings(ui->settingsReader);
+
+    std::vector<FrameworkElement> containers;
+    std::vector<const void*> dead;
+    ui->styledContainers.ForEach([&](const void* identity, winrt::weak_ref<FrameworkElement>& weak) {
+        if (auto container = weak.get()) {
+            containers.push_back(container);
+        } else {
+            dead.push_back(identity);
+        }
+    });
+    for (const void* identity : dead) ui->styledContainers.Erase(identity);
+
+    const Settings& settings = CurrentSettings();
+
+    // Only the layout rules that changed are written, and only to the
+    // elements their targets match
+    auto styles = CompileLayoutStyles(settings);
+    const StyleBlobView& laidOutStyles = ui->layoutStyles ? ui->layoutStyles->view : g_noStyles;
+    StylePatch patch = DiffStyleRules(laidOutStyles, styles->view);
+    if (!patch.Empty()) {
+        std::vector<const void*> patched;
+        for (auto& container : containers) {
+            auto omniButton = FindOmniButtonAbove(container);
+            if (!omniButton) continue;
+
+            const void* identity = XamlTree::Identity(omniButton);
+            if (std::find(patched.begin(), patched.end(), identity) != patched.end()) continue;
+            patched.push_back(identity);
+
+            try {
+                ApplyLayoutStylePatch(omniButton, laidOutStyles, styles->view, patch);
+            } catch (...) {
+                LOG_ERROR(L"[Styles] Exception applying patch");
+            }
+        }
+    }
+    SetLayoutStyles(*ui, std::move(styles));
+
+    // The offsets only move if the pitch or the enable switch did
+    double itemHeight = static_cast<double>(settings.iconSize) + static_cast<double>(settings.iconSpacing);
+    if (itemHeight == ui->laidOutItemHeight && settings.enableVertical == ui->laidOutEnabled) {
+        LOG_DEBUG(L"[Settings] %zu style rules patched, offsets unchanged", patch.rules.size());
+        return;
+    }
 
-        // Check if this element is the OmniButton
-        auto className = winrt::get_class_name(root);
-        std::wstring classNameStr(className);
+    LOG_DEBUG(L"[Settings] Re-laying out %zu containers", containers.size());
+    for (auto& container : containers) ApplyVerticalLayout(container, false);
+}
 
-        if (classNameStr.find(L"OmniButton") != std::wstring::npos ||
-            classNameStr.find(L"ControlCenterButton") != std::wstring::npos) {
-            Wh_Log(L"[FindOmniButton] Found: %s", className.c_str());
-            return root;
+// Any thread: queue one re-layout on each UI thread; repeated changes before
+// it runs share the same pass. Threads that haven't laid anything out yet
+// pick up the settings as their icons load.
+void ScheduleRelayout() {
+    AcquireSRWLockShared(&g_uiThreadsLock);
+    for (UiThread* ui : g_uiThreads) {
+        if (ui->relayoutPending.exchange(true, std::memory_order_relaxed)) continue;
+
+        if (!QueueUiTask(*ui, winrt::Windows::UI::Core::CoreDispatcherPriority::Normal,
+                         [] { RelayoutStyledContainers(); })) {
+            ui->relayoutPending.store(false, std::memory_order_relaxed);
+            LOG_ERROR(L"[Settings] Failed to schedule re-layout");
         }
+    }
+    ReleaseSRWLockShared(&g_uiThreadsLock);
+}
 
-        // Check children recursively
-        int childCount = VisualTreeHelper::GetChildrenCount(root);
-        for (int i = 0; i < childCount; i++) {
-            auto child = VisualTreeHelper::GetChild(root, i).try_as<FrameworkElement>();
-            if (child) {
-                auto found = FindOmniButtonFromRoot(child);
-                if (found) return found;
+// The StackPanel an icon is laid out in: IconView > ContentPresenter >
+// StackPanel, or an IconView directly in its container
+FrameworkElement IconContainer(FrameworkElement iconView) {
+    auto container = XamlTree::Parent(iconView);
+    if (container && g_classAtoms.Category(XamlTree::ClassAtom(container)) != ClassCategory::StackPanel) {
+        container = XamlTree::Parent(container);
+    }
+    return container;
+}
+
+// Lay out the containers icons belong to, rather than each icon on its own.
+// In an icon StackPanel only the loaded icons are restyled; otherwise each
+// container is laid out in full, once.
+void ApplyVerticalLayoutForIcons(const std::vector<FrameworkElement>& icons) {
+    std::vector<FrameworkElement> containers;
+    std::vector<std::vector<FrameworkElement>> containerIcons;
+
+    for (const auto& iconView : icons) {
+        try {
+            auto container = IconContainer(iconView);
+            if (!container) continue;
+
+            const void* identity = XamlTree::Identity(container);
+            size_t i = 0;
+            while (i < containers.size() && XamlTree::Identity(containers[i]) != identity) i++;
+            if (i == containers.size()) {
+                containers.push_back(container);
+                containerIcons.emplace_back();
+            }
+            containerIcons[i].push_back(iconView);
+        } catch (...) {
+            LOG_ERROR_LIMITED(L"[Layout] Exception finding icon container");
+        }
+    }
+
+    for (size_t i = 0; i < containers.size(); i++) {
+        try {
+            if (IconStackPanelOmniButton(containers[i]) && RestyleLoadedIcons(containers[i], containerIcons[i])) {
+                continue;
+            }
+            ApplyVerticalLayout(containers[i]);
+        } catch (...) {
+            LOG_ERROR_LIMITED(L"[Layout] Exception laying out icon container");
+        }
+    }
+}
+
+// UI thread: classify and lay out every IconView loaded since the last batch
+void RunLoadedIconBatch() {
+    UiThread* ui = t_uiThread;
+    if (!ui || g_unloading) return;
+    AckSettings(ui->settingsReader);
+
+    ScopedHookTimer timer(HookMetric::LoadedBatch);
+    const CoalescingStats before = ui->loadedIcons.Stats();
+
+    std::vector<FrameworkElement> omniIcons;
+    size_t batchSize = ui->loadedIcons.Flush([&](std::vector<FrameworkElement>& icons) {
+        for (const auto& iconView : icons) {
+            if (IsOmniButtonIcon(iconView)) omniIcons.push_back(iconView);
+
+            // Classified, so its Loaded handler has nothing left to do
+            ui->iconSubscriptions.Revoke(XamlTree::Identity(iconView));
+        }
+
+        // The ancestor filters only hold for the tree as the batch saw it
+        ui->omniIconMatcher.Clear();
+    });
+    if (batchSize == 0) return;
+
+    const CoalescingStats& stats = ui->loadedIcons.Stats();
+    g_metrics.Count(CounterMetric::LoadedBatches);
+    g_metrics.Count(CounterMetric::LoadedPassesSaved, stats.passesSaved - before.passesSaved);
+    LOG_DEBUG(L"[Loaded Batch] icons=%zu omni=%zu batches=%llu maxBatch=%llu passesSaved=%llu",
+              batchSize, omniIcons.size(), stats.batches, stats.maxBatch, stats.passesSaved);
+    LOG_DEBUG(L"[Subscriptions] live=%zu peak=%zu slabs=%zu revoked=%llu swept=%llu rejected=%llu",
+              ui->iconSubscriptions.Live(), ui->iconSubscriptions.Stats().peakLive,
+              ui->iconSubscriptions.Stats().slabs, ui->iconSubscriptions.Stats().revoked,
+              ui->iconSubscriptions.Stats().swept, ui->iconSubscriptions.Stats().rejected);
+
+    if (omniIcons.empty()) return;
+    ApplyVerticalLayoutForIcons(omniIcons);
+    CaptureTreeSnapshotOnce(omniIcons.front());
+}
+
+// The first IconView loaded in a frame schedules the batch at low priority,
+// so it runs after the rest of the frame's Loaded events
+void QueueLoadedIcon(FrameworkElement iconView) {
+    UiThread* ui = t_uiThread;
+    if (!ui || g_unloading) return;
+    if (!ui->loadedIcons.Enqueue(XamlTree::Identity(iconView), iconView)) return;
+
+    if (!QueueUiTask(*ui, winrt::Windows::UI::Core::CoreDispatcherPriority::Low, [] { RunLoadedIconBatch(); })) {
+        LOG_ERROR_LIMITED(L"[IconView Loaded] Failed to schedule batch, running it now");
+        RunLoadedIconBatch();
+    }
+}
+
+// UI thread: handle the icon's Loaded until it has been classified
+void SubscribeIconLoaded(UiThread& ui, FrameworkElement iconView) {
+    IconSubscription subscription;
+    subscription.element = winrt::make_weak(iconView);
+    subscription.loaded = iconView.Loaded(winrt::auto_revoke, [weak = subscription.element](auto&&, auto&&) {
+        ScopedHookTimer timer(HookMetric::IconViewLoaded);
+        try {
+            // Classified and laid out with the rest of the frame's icons
+            LOG_DEBUG(L"[IconView Loaded] Loaded fired - queueing");
+            if (auto iconView = weak.get()) QueueLoadedIcon(iconView);
+
+        } catch (...) {
+            LOG_ERROR_LIMITED(L"[IconView Loaded] Exception in Loaded handler");
+        }
+    });
+
+    bool held = ui.iconSubscriptions.Add(XamlTree::Identity(iconView), std::move(subscription),
+                                         [](const IconSubscription& entry) { return !entry.element.get(); });
+    if (!held) {
+        LOG_ERROR_LIMITED(L"[IconView Hook] %zu icons already awaiting Loaded; not handling this one",
+                  ui.iconSubscriptions.Live());
+    }
+}
+
+// How long unloading waits, in all, for the UI threads to run their final
+// tasks and for the dispatchers to let go of the mod's tasks
+constexpr DWORD kFinishUiWorkTimeoutMs = 2000;
+
+// Hands every UI thread its last task, at normal priority so a thread busy
+// with low priority work still gets to it: the task revokes the thread's
+// handlers and releases what the mod kept for it. Waits for the tasks, then
+// for each dispatcher to let go of every task the mod queued, up to
+// kFinishUiWorkTimeoutMs in all. A thread that is gone, refuses the task or
+// doesn't get to it in time has its entry left unreleased on purpose, rather
+// than have its revokers and XAML objects destroyed off the thread.
+void FinishUiWork() {
+    std::vector<UiThread*> threads;
+    AcquireSRWLockExclusive(&g_uiThreadsLock);
+    threads.swap(g_uiThreads);
+    ReleaseSRWLockExclusive(&g_uiThreadsLock);
+
+    struct Finishing {
+        HANDLE thread;
+        HANDLE done;
+        std::atomic<uint32_t>* queuedTasks;
+    };
+    std::vector<Finishing> finishing;
+
+    for (UiThread* ui : threads) {
+        // The entry is deleted by the task, so take what's needed afterwards
+        Finishing entry = {ui->thread, CreateEventW(nullptr, TRUE, FALSE, nullptr), ui->queuedTasks};
+        ui->thread = nullptr;
+
+        HANDLE done = entry.done;
+        bool queued = done && QueueUiTask(*ui, winrt::Windows::UI::Core::CoreDispatcherPriority::Normal, [done] {
+            ReleaseUiThread();
+            SetEvent(done);
+        });
+        if (!queued) {
+            Wh_Log(L"[Unload] Failed to queue the final UI task; leaving the thread's state in place");
+            if (done) CloseHandle(done);
+            entry.done = nullptr;
+        }
+        finishing.push_back(entry);
+    }
+
+    ULONGLONG deadline = GetTickCount64() + kFinishUiWorkTimeoutMs;
+    auto remaining = [deadline]() -> DWORD {
+        ULONGLONG now = GetTickCount64();
+        return now < deadline ? static_cast<DWORD>(deadline - now) : 0;
+    };
+
+    for (Finishing& entry : finishing) {
+        bool ran = false;
+        if (entry.done) {
+            HANDLE waits[] = {entry.done, entry.thread};
+            DWORD result = WaitForMultipleObjects(entry.thread ? 2 : 1, waits, FALSE, remaining());
+            ran = result == WAIT_OBJECT_0;
+            if (result == WAIT_TIMEOUT) {
+                // The task still holds the event and the entry
+                Wh_Log(L"[Unload] Final UI task didn't run within %u ms; leaving the thread's state in place",
+                       kFinishUiWorkTimeoutMs);
+            } else {
+                if (!ran) Wh_Log(L"[Unload] UI thread exited before the final task ran");
+                CloseHandle(entry.done);
+            }
+        }
+
+        // The dispatcher releases each task just after running it. A count
+        // that doesn't reach zero in time is left allocated for the tasks
+        // still holding it.
+        bool released = ran;
+        while (released && entry.queuedTasks->load(std::memory_order_acquire) != 0) {
+            if (remaining() == 0) {
+                Wh_Log(L"[Unload] %u UI tasks still queued after %u ms", entry.queuedTasks->load(),
+                       kFinishUiWorkTimeoutMs);
+                released = false;
+            } else if (!entry.thread) {
+                Sleep(1);
+            } else if (WaitForSingleObject(entry.thread, 1) != WAIT_TIMEOUT) {
+                Wh_Log(L"[Unload] UI thread exited with %u tasks queued", entry.queuedTasks->load());
+                released = false;
             }
         }
+        if (released) delete entry.queuedTasks;
 
+        if (entry.thread) CloseHandle(entry.thread);
+    }
+}
+
+// Find OmniButton in the XAML tree starting from a given element
+FrameworkElement FindOmniButtonFromRoot(FrameworkElement root) {
+    UiThread* ui = nullptr;
+    try {
+        ui = RegisterUiThread(root);
+        if (!ui) return nullptr;
+
+        TreePathCache<XamlTree>& cache = ui->omniButtonPathCache;
+        uint64_t hitsBefore = cache.Stats().hits;
+        auto omniButton = cache.Find(root);
+        g_metrics.Count(CounterMetric::CacheHits, cache.Stats().hits - hitsBefore);
+        if (omniButton) {
+            LOG_DEBUG(L"[FindOmniButton] Found: %s", LogAtom{XamlTree::ClassAtom(omniButton)});
+        }
+        LogPathCacheStats(L"OmniButton", cache.Stats());
+        return omniButton;
     } catch (...) {
         // Silently ignore
+        if (ui) ui->omniButtonPathCache.Invalidate();
     }
 
     return nullptr;
@@ -274,13 +3816,14 @@ FrameworkElement FindOmniButtonFromRoot(FrameworkElement root) {
 
 // Apply vertical styling to all OmniButton icons
 void ApplyVerticalStylingToOmniButton(FrameworkElement stackViewModel) {
-    Wh_Log(L"[ApplyVertical] Starting to search for OmniButton from StackViewModel");
+    LOG_DEBUG(L"[ApplyVertical] Starting to search for OmniButton from StackViewModel");
 
     try {
         if (!stackViewModel) {
-            Wh_Log(L"[ApplyVertical] StackViewModel is null");
+            LOG_DEBUG(L"[ApplyVertical] StackViewModel is null");
             return;
         }
+        g_metrics.Count(CounterMetric::Traversals);
 
         // Try to find OmniButton by traversing up and down the tree
         // First try going up to find a common parent
@@ -288,27 +3831,20 @@ void ApplyVerticalStylingToOmniButton(FrameworkElement stackViewModel) {
         FrameworkElement systemTrayRoot = nullptr;
 
         for (int i = 0; i < 10; i++) {
-            auto parent = VisualTreeHelper::GetParent(current);
-            if (!parent) break;
-
-            auto parentElement = parent.try_as<FrameworkElement>();
-            if (parentElement) {
-                auto className = winrt::get_class_name(parentElement);
-                std::wstring classNameStr(className);
+            auto parentElement = XamlTree::Parent(current);
+            if (!parentElement) break;
 
-                Wh_Log(L"[ApplyVertical] Parent %d: %s", i, className.c_str());
+            Atom classAtom = XamlTree::ClassAtom(parentElement);
 
-                if (classNameStr.find(L"SystemTray") != std::wstring::npos &&
-                    classNameStr.find(L"implementation") != std::wstring::npos) {
-                    systemTrayRoot = parentElement;
-                    Wh_Log(L"[ApplyVertical] Found SystemTray root: %s", className.c_str());
-                    break;
-                }
+            LOG_DEBUG(L"[ApplyVertical] Parent %d: %s", i, LogAtom{classAtom});
 
-                current = parentElement;
-            } else {
+            if (g_classAtoms.Category(classAtom) == ClassCategory::SystemTrayRoot) {
+                systemTrayRoot = parentElement;
+                LOG_DEBUG(L"[ApplyVertical] Found SystemTray root: %s", LogAtom{classAtom});
                 break;
             }
+
+            current = parentElement;
         }
 
         // Now search down from the root for OmniButton
@@ -316,54 +3852,25 @@ void ApplyVerticalStylingToOmniButton(FrameworkElement stackViewModel) {
             auto omniButton = FindOmniButtonFromRoot(systemTrayRoot);
 
             if (omniButton) {
-                Wh_Log(L"[ApplyVertical] Found OmniButton! Styling children...");
-
-                // Find the StackPanel inside OmniButton
-                int childCount = VisualTreeHelper::GetChildrenCount(omniButton);
-                Wh_Log(L"[ApplyVertical] OmniButton has %d children", childCount);
-
-                for (int i = 0; i < childCount; i++) {
-                    auto child = VisualTreeHelper::GetChild(omniButton, i).try_as<FrameworkElement>();
-                    if (child) {
-                        auto childClassName = winrt::get_class_name(child);
-                        std::wstring childClassNameStr(childClassName);
-
-                        Wh_Log(L"[ApplyVertical] Child %d: %s", i, childClassName.c_str());
-
-                        // Look for IconView children
-                        if (childClassNameStr.find(L"IconView") != std::wstring::npos) {
-                            Wh_Log(L"[ApplyVertical] Styling IconView at index %d", i);
-                            ApplyVerticalTransform(child, i);
-                        } else if (childClassNameStr.find(L"StackPanel") != std::wstring::npos ||
-                                   childClassNameStr.find(L"Grid") != std::wstring::npos) {
-                            // Look inside containers
-                            int containerChildCount = VisualTreeHelper::GetChildrenCount(child);
-                            Wh_Log(L"[ApplyVertical] Container has %d children", containerChildCount);
-
-                            for (int j = 0; j < containerChildCount; j++) {
-                                auto iconView = VisualTreeHelper::GetChild(child, j).try_as<FrameworkElement>();
-                                if (iconView) {
-                                    auto iconClassName = winrt::get_class_name(iconView);
-                                    std::wstring iconClassNameStr(iconClassName);
-
-                                    if (iconClassNameStr.find(L"IconView") != std::wstring::npos) {
-                                        Wh_Log(L"[ApplyVertical] Styling IconView at container index %d", j);
-                                        ApplyVerticalTransform(iconView, j);
-                                    }
-                                }
-                            }
-                        }
+                LOG_DEBUG(L"[ApplyVertical] Found OmniButton! Styling children...");
+
+                // One walk matches every style.yaml target below the OmniButton;
+                // the icons are laid out as a batch per StackPanel
+                OmniButtonSelectors<XamlTree>().Match(omniButton, [&](const FrameworkElement& element, uint32_t rule) {
+                    if (rule == kRuleIconStackPanel) {
+                        LOG_DEBUG(L"[ApplyVertical] Laying out StackPanel icons");
+                        ApplyVerticalLayout(element);
                     }
-                }
+                }, kOmniButtonTargetDepth);
             } else {
-                Wh_Log(L"[ApplyVertical] Could not find OmniButton");
+                LOG_DEBUG(L"[ApplyVertical] Could not find OmniButton");
             }
         } else {
-            Wh_Log(L"[ApplyVertical] Could not find SystemTray root");
+            LOG_DEBUG(L"[ApplyVertical] Could not find SystemTray root");
         }
 
     } catch (...) {
-        Wh_Log(L"[ApplyVertical] Exception");
+        LOG_ERROR(L"[ApplyVertical] Exception");
     }
 }
 
@@ -412,113 +3919,74 @@ static winrt::com_ptr<winrt::Windows::UI::Xaml::FrameworkElement> GetFrameworkEl
     return fe_ptr;
 }
 
-// --- Helper: get child's index in its parent (returns -1 if unknown) ---
-static int GetIndexInParent(winrt::Windows::UI::Xaml::FrameworkElement const& child)
-{
-    try {
-        auto parent = winrt::Windows::UI::Xaml::Media::VisualTreeHelper::GetParent(child);
-        if (!parent) return -1;
-        auto parentFE = parent.try_as<winrt::Windows::UI::Xaml::FrameworkElement>();
-        if (!parentFE) return -1;
-
-        int count = winrt::Windows::UI::Xaml::Media::VisualTreeHelper::GetChildrenCount(parentFE);
-        for (int i = 0; i < count; ++i) {
-            auto c = winrt::Windows::UI::Xaml::Media::VisualTreeHelper::GetChild(parentFE, i).try_as<winrt::Windows::UI::Xaml::FrameworkElement>();
-            if (c && c == child) return i;
-        }
-    } catch (...) {}
-    return -1;
-}
-
 // --- Replacement: IconView constructor hook (matches your file) ---
 void IconView_IconView_Hook(void* pThis) {
-    Wh_Log(L"=== IconView::IconView constructor called (HOOK) ===");
+    LOG_DEBUG(L"=== IconView::IconView constructor called (HOOK) ===");
 
     // Call original constructor
     IconView_IconView_Original(pThis);
 
-    if (g_unloading || !g_settings.enableVertical) return;
+    if (g_unloading) return;
+
+    // Only our own work is timed, not the original constructor
+    ScopedHookTimer timer(HookMetric::IconViewHook);
 
     // Safely obtain FrameworkElement
     auto fe_ptr = GetFrameworkElementFromThis(pThis);
     if (!fe_ptr) {
-        Wh_Log(L"[IconView Hook] Failed to obtain FrameworkElement from pThis");
+        LOG_DEBUG(L"[IconView Hook] Failed to obtain FrameworkElement from pThis");
         return;
     }
 
     // Convert com_ptr to FrameworkElement object
     FrameworkElement iconView = *reinterpret_cast<FrameworkElement*>(fe_ptr.get());
 
-    Wh_Log(L"[IconView Hook] created class=%s name=%s",
-           winrt::to_hstring(winrt::get_class_name(iconView)).c_str(),
-           iconView.Name().c_str());
-
-    // Register Loaded handler (runs on UI thread)
-    iconView.Loaded([iconView](auto&&, auto&&) {
-        try {
-            Wh_Log(L"[IconView Loaded] Loaded fired - checking parents");
-
-            // Walk up parents to detect OmniButton/ControlCenterButton
-            auto current = iconView;
-            bool isOmni = false;
-            for (int depth = 0; depth < 10; ++depth) {
-                auto parent = winrt::Windows::UI::Xaml::Media::VisualTreeHelper::GetParent(current);
-                if (!parent) break;
-                auto parentFE = parent.try_as<FrameworkElement>();
-                if (!parentFE) break;
-                auto cls = winrt::get_class_name(parentFE);
-                auto nm = parentFE.Name();
-                std::wstring clsStr(cls);
-                Wh_Log(L"[IconView Loaded] Parent %d class=%s name=%s", depth, cls.c_str(), nm.c_str());
-                if (clsStr.find(L"OmniButton") != std::wstring::npos || nm == L"ControlCenterButton") {
-                    isOmni = true;
-                    break;
-                }
-                current = parentFE;
-            }
-
-            if (!isOmni) {
-                Wh_Log(L"[IconView Loaded] Not an OmniButton icon - skipping");
-                return;
-            }
+    // The thread registers as a settings reader before it reads them
+    UiThread* ui = nullptr;
+    try {
+        ui = RegisterUiThread(iconView);
+    } catch (...) {
+        LOG_ERROR_LIMITED(L"[IconView Hook] Exception registering the UI thread");
+    }
+    if (!ui || !CurrentSettings().enableVertical) return;
 
-            Wh_Log(L"[IconView Loaded] OmniButton icon detected - applying vertical transform");
-            // Use runtime index detection; pass 0 for the second param (ignored now)
-            ApplyVerticalTransform(iconView, 0);
+    LOG_DEBUG(L"[IconView Hook] created class=%s name=%s",
+              LogAtom{XamlTree::ClassAtom(iconView)}, LogAtom{XamlTree::NameAtom(iconView)});
 
-        } catch (...) {
-            Wh_Log(L"[IconView Loaded] Exception in Loaded handler");
-        }
-    });
+    // Register Loaded handler (runs on UI thread); revoked once the icon
+    // has been classified, or when the mod unloads
+    SubscribeIconLoaded(*ui, iconView);
 }
 
+void TraverseAndStyleXamlTree(FrameworkElement root);
+
 // Apply styling to existing OmniButton icons in the XAML tree
 void ApplyStyleToExistingIcons(XamlRoot xamlRoot) {
-    Wh_Log(L"[ApplyStyle] Searching existing XAML tree for OmniButton icons");
+    LOG_DEBUG(L"[ApplyStyle] Searching existing XAML tree for OmniButton icons");
 
     if (!xamlRoot) {
-        Wh_Log(L"[ApplyStyle] XamlRoot is null");
+        LOG_DEBUG(L"[ApplyStyle] XamlRoot is null");
         return;
     }
 
     try {
         auto rootContent = xamlRoot.Content();
         if (!rootContent) {
-            Wh_Log(L"[ApplyStyle] No content in XamlRoot");
+            LOG_DEBUG(L"[ApplyStyle] No content in XamlRoot");
             return;
         }
 
         auto rootElement = rootContent.try_as<FrameworkElement>();
         if (!rootElement) {
-            Wh_Log(L"[ApplyStyle] Root content is not a FrameworkElement");
+            LOG_DEBUG(L"[ApplyStyle] Root content is not a FrameworkElement");
             return;
         }
 
-        Wh_Log(L"[ApplyStyle] Starting tree traversal from root");
-        TraverseAndStyleXamlTree(rootElement, 0);
+        LOG_DEBUG(L"[ApplyStyle] Starting tree traversal from root");
+        TraverseAndStyleXamlTree(rootElement);
 
     } catch (...) {
-        Wh_Log(L"[ApplyStyle] Exception");
+        LOG_ERROR(L"[ApplyStyle] Exception");
     }
 }
 
@@ -545,20 +4013,24 @@ void ApplySettings() {
 
 // Load settings
 void LoadSettings() {
-    g_settings.enableVertical = Wh_GetIntSetting(L"enableVertical");
-    g_settings.iconSize = Wh_GetIntSetting(L"iconSize");
-    g_settings.iconSpacing = Wh_GetIntSetting(L"iconSpacing");
-    g_settings.debugLogging = Wh_GetIntSetting(L"debugLogging");
+    Settings settings;
+    settings.enableVertical = Wh_GetIntSetting(L"enableVertical");
+    settings.iconSize = Wh_GetIntSetting(L"iconSize");
+    settings.iconSpacing = Wh_GetIntSetting(L"iconSpacing");
+    settings.debugLogging = Wh_GetIntSetting(L"debugLogging");
+    settings.captureTreeSnapshot = Wh_GetIntSetting(L"captureTreeSnapshot");
 
     // Validate
-    if (g_settings.iconSize < 16) g_settings.iconSize = 16;
-    if (g_settings.iconSize > 48) g_settings.iconSize = 48;
-    if (g_settings.iconSpacing < 0) g_settings.iconSpacing = 0;
-    if (g_settings.iconSpacing > 32) g_settings.iconSpacing = 32;
+    if (settings.iconSize < 16) settings.iconSize = 16;
+    if (settings.iconSize > 48) settings.iconSize = 48;
+    if (settings.iconSpacing < 0) settings.iconSpacing = 0;
+    if (settings.iconSpacing > 32) settings.iconSpacing = 32;
 
-    Wh_Log(L"Settings: enable=%d, size=%d, spacing=%d, debug=%d",
-           g_settings.enableVertical, g_settings.iconSize,
-           g_settings.iconSpacing, g_settings.debugLogging);
+    PublishSettings(settings);
+
+    Wh_Log(L"Settings: enable=%d, size=%d, spacing=%d, debug=%d, snapshot=%d",
+           settings.enableVertical, settings.iconSize,
+           settings.iconSpacing, settings.debugLogging, settings.captureTreeSnapshot);
 }
 
 // Hook symbols
@@ -600,6 +4072,13 @@ BOOL Wh_ModInit() {
 
     LoadSettings();
 
+    LARGE_INTEGER qpcFrequency;
+    QueryPerformanceFrequency(&qpcFrequency);
+    g_nsPerQpcTick = 1e9 / static_cast<double>(qpcFrequency.QuadPart);
+
+    StartLogDrain();
+    InternSelectorNames();
+
     if (!HookTaskbarViewSymbols()) {
         Wh_Log(L"WARNING: Failed to hook Taskbar.View.dll symbols");
         Wh_Log(L"This may be normal if the module isn't loaded yet");
@@ -612,56 +4091,34 @@ BOOL Wh_ModInit() {
     return TRUE;
 }
 
-// Recursively traverse XAML tree to find OmniButton
-void TraverseAndStyleXamlTree(FrameworkElement element, int depth = 0) {
-    if (!element || depth > 20) return;  // Prevent infinite recursion
+// Find the OmniButton's StackPanel under the XAML root and style its icons.
+// The StackPanel's path is cached, so repeated passes don't walk the whole tree.
+void TraverseAndStyleXamlTree(FrameworkElement root) {
+    if (!root) return;
 
+    UiThread* ui = nullptr;
     try {
-        auto className = winrt::get_class_name(element);
-        std::wstring classNameStr(className);
-
-        // Log if debugging
-        if (g_settings.debugLogging && depth < 5) {
-            std::wstring indent(depth * 2, L' ');
-            Wh_Log(L"%s[Traverse] %s", indent.c_str(), className.c_str());
-        }
-
-        // Check if this is OmniButton or ControlCenterButton
-        if (classNameStr.find(L"OmniButton") != std::wstring::npos ||
-            classNameStr.find(L"ControlCenterButton") != std::wstring::npos) {
-            Wh_Log(L"[Traverse] FOUND OmniButton at depth %d: %s", depth, className.c_str());
-
-            // Find IconView children and style them
-            int childCount = VisualTreeHelper::GetChildrenCount(element);
-            Wh_Log(L"[Traverse] OmniButton has %d children", childCount);
-
-            for (int i = 0; i < childCount; i++) {
-                auto child = VisualTreeHelper::GetChild(element, i).try_as<FrameworkElement>();
-                if (child) {
-                    auto childClassName = winrt::get_class_name(child);
-                    std::wstring childClassNameStr(childClassName);
-
-                    if (childClassNameStr.find(L"IconView") != std::wstring::npos) {
-                        Wh_Log(L"[Traverse] Found IconView child at index %d", i);
-                        StyleOmniButtonIcon(child);
-                    }
-                }
-            }
-
-            return;  // Found it, no need to traverse deeper
+        ui = RegisterUiThread(root);
+        if (!ui) return;
+
+        TreePathCache<XamlTree>& cache = ui->omniStackPanelPathCache;
+        g_metrics.Count(CounterMetric::Traversals);
+        uint64_t hitsBefore = cache.Stats().hits;
+        auto stackPanel = cache.Find(root);
+        g_metrics.Count(CounterMetric::CacheHits, cache.Stats().hits - hitsBefore);
+        LogPathCacheStats(L"StackPanel", cache.Stats());
+        if (!stackPanel) {
+            LOG_DEBUG(L"[Traverse] OmniButton StackPanel not found");
+            return;
         }
 
-        // Traverse children
-        int childCount = VisualTreeHelper::GetChildrenCount(element);
-        for (int i = 0; i < childCount; i++) {
-            auto child = VisualTreeHelper::GetChild(element, i).try_as<FrameworkElement>();
-            if (child) {
-                TraverseAndStyleXamlTree(child, depth + 1);
-            }
-        }
+        // StackPanel > ContentPresenter > SystemTray.IconView
+        LOG_DEBUG(L"[Traverse] Laying out OmniButton StackPanel icons");
+        ApplyVerticalLayout(stackPanel);
 
     } catch (...) {
         // Silently ignore - some elements might not be accessible
+        if (ui) ui->omniStackPanelPathCache.Invalidate();
     }
 }
 
@@ -708,10 +4165,15 @@ void Wh_ModAfterInit() {
 void Wh_ModUninit() {
     Wh_Log(L"=== Uninit ===");
     g_unloading = true;
+    FinishUiWork();
+    StopLogDrain();
 }
 
 void Wh_ModSettingsChanged() {
     Wh_Log(L"=== Settings Changed ===");
+    ForgetExitedUiThreads();
     LoadSettings();
-    Wh_Log(L"Note: Restart explorer.exe for changes to take full effect");
+
+    // Styled icons pick up the new snapshot without an explorer restart
+    ScheduleRelayout();
 }
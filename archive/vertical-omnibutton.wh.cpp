@@ -83,6 +83,8 @@ Uses TranslateTransform technique from taskbar-notification-icon-spacing.wh.cpp.
 #include <winrt/Windows.UI.Xaml.Controls.h>
 #include <winrt/Windows.UI.Xaml.Media.h>
 
+#include <vector>
+
 using namespace winrt::Windows::UI::Xaml;
 using namespace winrt::Windows::UI::Xaml::Controls;
 using namespace winrt::Windows::UI::Xaml::Media;
@@ -98,10 +100,37 @@ struct {
 bool g_initialized = false;
 bool g_unloading = false;
 
-// Logging helper
-void Log(const wchar_t* format, ...) {
-    if (!g_settings.debugLogging) return;
+// Log levels. Debug sites only log with debugLogging on. The exception sites
+// on the per-icon paths are debug sites too, since a failure there repeats for
+// every icon at once. Sites below OMNIBUTTON_MIN_LOG_LEVEL are compiled out
+// (e.g. add -DOMNIBUTTON_MIN_LOG_LEVEL=2 to @compilerOptions to keep errors only).
+#ifndef OMNIBUTTON_MIN_LOG_LEVEL
+#define OMNIBUTTON_MIN_LOG_LEVEL 0
+#endif
+
+enum class LogLevel : int { Debug = 0, Info = 1, Error = 2 };
+
+constexpr LogLevel kMinLogLevel = static_cast<LogLevel>(OMNIBUTTON_MIN_LOG_LEVEL);
 
+inline bool LogLevelEnabled(LogLevel level) {
+    return level != LogLevel::Debug || g_settings.debugLogging;
+}
+
+// The arguments are only evaluated once the level check passes, so a disabled
+// site costs one branch and builds no strings
+#define LOG_AT(level, ...)                                     \
+    do {                                                       \
+        if constexpr ((level) >= kMinLogLevel) {               \
+            if (LogLevelEnabled(level)) LogWrite(__VA_ARGS__); \
+        }                                                      \
+    } while (0)
+
+#define LOG_DEBUG(...) LOG_AT(LogLevel::Debug, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LogLevel::Info, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LogLevel::Error, __VA_ARGS__)
+
+// Formats and emits unconditionally; use the LOG_* macros instead
+void LogWrite(const wchar_t* format, ...) {
     wchar_t buffer[512];
     va_list args;
     va_start(args, format);
@@ -111,32 +140,95 @@ void Log(const wchar_t* format, ...) {
     Wh_Log(L"[VerticalOmniButton] %s", buffer);
 }
 
+// Tree searches are written against a small traits type instead of calling
+// VisualTreeHelper directly, so the same code can run over an in-memory tree
+// outside explorer (MemoryTree in tests/). A traits type provides:
+//
+//   using Node = ...;  // cheap, copyable handle
+//   static Node Null();
+//   static bool IsNull(const Node& node);
+//   static int ChildCount(const Node& node);
+//   static Node Child(const Node& node, int index);
+//   static bool HasClass(const Node& node, const wchar_t* className);
+//   static bool HasName(const Node& node, const wchar_t* name);
+//   static bool IsContentPresenter(const Node& node);  // the type or one derived from it
+
+// First node below root, depth first, that matches
+template <typename Tree, typename Predicate>
+typename Tree::Node FindDescendant(const typename Tree::Node& root, Predicate&& matches) {
+    int childrenCount = Tree::ChildCount(root);
+    for (int i = 0; i < childrenCount; i++) {
+        auto child = Tree::Child(root, i);
+        if (Tree::IsNull(child)) continue;
+
+        if (matches(child)) return child;
+
+        auto found = FindDescendant<Tree>(child, matches);
+        if (!Tree::IsNull(found)) return found;
+    }
+
+    return Tree::Null();
+}
+
+// The IconViews in a StackPanel's ContentPresenters, in order
+template <typename Tree>
+void CollectIconViews(const typename Tree::Node& stackPanel, std::vector<typename Tree::Node>& iconViews) {
+    iconViews.clear();
+
+    int childrenCount = Tree::ChildCount(stackPanel);
+    for (int i = 0; i < childrenCount; i++) {
+        auto child = Tree::Child(stackPanel, i);
+        if (Tree::IsNull(child) || !Tree::IsContentPresenter(child)) {
+            continue;
+        }
+
+        auto iconView = FindDescendant<Tree>(child, [](const typename Tree::Node& node) {
+            return Tree::HasClass(node, L"SystemTray.IconView");
+        });
+        if (!Tree::IsNull(iconView)) iconViews.push_back(iconView);
+    }
+}
+
+// Traits over the live XAML tree. Children that aren't FrameworkElements come
+// back null and are skipped.
+struct XamlTree {
+    using Node = FrameworkElement;
+
+    static Node Null() { return nullptr; }
+    static bool IsNull(const Node& node) { return !node; }
+
+    static int ChildCount(const Node& node) {
+        return Media::VisualTreeHelper::GetChildrenCount(node);
+    }
+
+    static Node Child(const Node& node, int index) {
+        return Media::VisualTreeHelper::GetChild(node, index).try_as<FrameworkElement>();
+    }
+
+    static bool HasClass(const Node& node, const wchar_t* className) {
+        return winrt::get_class_name(node) == className;
+    }
+
+    static bool HasName(const Node& node, const wchar_t* name) {
+        return node.Name() == name;
+    }
+
+    static bool IsContentPresenter(const Node& node) {
+        return static_cast<bool>(node.try_as<ContentPresenter>());
+    }
+};
+
 // Find child element by class name
 FrameworkElement FindChildByClassName(
-    DependencyObject element,
+    FrameworkElement element,
     const wchar_t* className
 ) {
     try {
-        int childrenCount = Media::VisualTreeHelper::GetChildrenCount(element);
-
-        for (int i = 0; i < childrenCount; i++) {
-            auto child = Media::VisualTreeHelper::GetChild(element, i);
-
-            auto childElement = child.try_as<FrameworkElement>();
-            if (childElement) {
-                auto childClassName = winrt::get_class_name(childElement);
-                if (childClassName == className) {
-                    return childElement;
-                }
-            }
-
-            auto found = FindChildByClassName(child, className);
-            if (found) {
-                return found;
-            }
-        }
+        return FindDescendant<XamlTree>(element, [className](const FrameworkElement& node) {
+            return XamlTree::HasClass(node, className);
+        });
     } catch (...) {
-        Log(L"Exception in FindChildByClassName");
+        LOG_DEBUG(L"Exception in FindChildByClassName");
     }
 
     return nullptr;
@@ -144,27 +236,15 @@ FrameworkElement FindChildByClassName(
 
 // Find child element by name
 FrameworkElement FindChildByName(
-    DependencyObject element,
+    FrameworkElement element,
     const wchar_t* name
 ) {
     try {
-        int childrenCount = Media::VisualTreeHelper::GetChildrenCount(element);
-
-        for (int i = 0; i < childrenCount; i++) {
-            auto child = Media::VisualTreeHelper::GetChild(element, i);
-
-            auto childElement = child.try_as<FrameworkElement>();
-            if (childElement && childElement.Name() == name) {
-                return childElement;
-            }
-
-            auto found = FindChildByName(child, name);
-            if (found) {
-                return found;
-            }
-        }
+        return FindDescendant<XamlTree>(element, [name](const FrameworkElement& node) {
+            return XamlTree::HasName(node, name);
+        });
     } catch (...) {
-        Log(L"Exception in FindChildByName");
+        LOG_DEBUG(L"Exception in FindChildByName");
     }
 
     return nullptr;
@@ -189,7 +269,7 @@ void ApplyVerticalTransform(FrameworkElement iconView, int index) {
         double totalHeight = itemHeight * (iconCount - 1);
         yOffset -= totalHeight / 2;
 
-        Log(L"Applying transform to icon %d: Y offset = %.2f", index, yOffset);
+        LOG_DEBUG(L"Applying transform to icon %d: Y offset = %.2f", index, yOffset);
 
         // Create and apply transform
         Media::TranslateTransform transform;
@@ -199,16 +279,16 @@ void ApplyVerticalTransform(FrameworkElement iconView, int index) {
         iconView.RenderTransform(transform);
 
     } catch (const winrt::hresult_error& ex) {
-        Log(L"HRESULT exception in ApplyVerticalTransform: 0x%08X", ex.code());
+        LOG_DEBUG(L"HRESULT exception in ApplyVerticalTransform: 0x%08X", static_cast<int32_t>(ex.code()));
     } catch (...) {
-        Log(L"Unknown exception in ApplyVerticalTransform");
+        LOG_DEBUG(L"Unknown exception in ApplyVerticalTransform");
     }
 }
 
 // Process OmniButton and apply transformations
 void ProcessOmniButton(FrameworkElement omniButton) {
     try {
-        Log(L"Processing OmniButton");
+        LOG_DEBUG(L"Processing OmniButton");
 
         // Find the StackPanel containing the icons
         auto stackPanel = FindChildByClassName(
@@ -217,35 +297,20 @@ void ProcessOmniButton(FrameworkElement omniButton) {
         );
 
         if (!stackPanel) {
-            Log(L"StackPanel not found");
+            LOG_DEBUG(L"StackPanel not found");
             return;
         }
 
-        Log(L"StackPanel found");
-
-        // Get children count
-        int childrenCount = Media::VisualTreeHelper::GetChildrenCount(stackPanel);
-        Log(L"StackPanel has %d children", childrenCount);
+        LOG_DEBUG(L"StackPanel found");
 
         // Process each ContentPresenter (which contain IconViews)
-        int iconIndex = 0;
-        for (int i = 0; i < childrenCount; i++) {
-            auto child = Media::VisualTreeHelper::GetChild(stackPanel, i);
-            auto contentPresenter = child.try_as<ContentPresenter>();
-
-            if (!contentPresenter) continue;
-
-            // Find IconView within ContentPresenter
-            auto iconView = FindChildByClassName(
-                contentPresenter,
-                L"SystemTray.IconView"
-            );
-
-            if (iconView) {
-                Log(L"Found IconView at index %d", iconIndex);
-                ApplyVerticalTransform(iconView, iconIndex);
-                iconIndex++;
-            }
+        std::vector<FrameworkElement> iconViews;
+        CollectIconViews<XamlTree>(stackPanel, iconViews);
+        LOG_DEBUG(L"StackPanel has %zu icons", iconViews.size());
+
+        for (size_t i = 0; i < iconViews.size(); i++) {
+            LOG_DEBUG(L"Found IconView at index %zu", i);
+            ApplyVerticalTransform(iconViews[i], static_cast<int>(i));
         }
 
         // Optionally change StackPanel orientation
@@ -255,18 +320,18 @@ void ProcessOmniButton(FrameworkElement omniButton) {
             if (g_settings.enableVertical) {
                 sp.Orientation(Controls::Orientation::Vertical);
                 sp.Spacing(g_settings.iconSpacing);
-                Log(L"Set StackPanel orientation to Vertical");
+                LOG_DEBUG(L"Set StackPanel orientation to Vertical");
             } else {
                 sp.Orientation(Controls::Orientation::Horizontal);
                 sp.Spacing(0);
-                Log(L"Reset StackPanel orientation to Horizontal");
+                LOG_DEBUG(L"Reset StackPanel orientation to Horizontal");
             }
         }
 
     } catch (const winrt::hresult_error& ex) {
-        Log(L"HRESULT exception in ProcessOmniButton: 0x%08X", ex.code());
+        LOG_DEBUG(L"HRESULT exception in ProcessOmniButton: 0x%08X", static_cast<int32_t>(ex.code()));
     } catch (...) {
-        Log(L"Unknown exception in ProcessOmniButton");
+        LOG_DEBUG(L"Unknown exception in ProcessOmniButton");
     }
 }
 
@@ -277,7 +342,7 @@ void ProcessOmniButton(FrameworkElement omniButton) {
 // SystemTrayController_GetFrameworkElement_t SystemTrayController_GetFrameworkElement_Original;
 //
 // void* WINAPI SystemTrayController_GetFrameworkElement_Hook(void* pThis) {
-//     Log(L"SystemTrayController_GetFrameworkElement called");
+//     LOG_DEBUG(L"SystemTrayController_GetFrameworkElement called");
 //
 //     void* result = SystemTrayController_GetFrameworkElement_Original(pThis);
 //
@@ -289,18 +354,18 @@ void ProcessOmniButton(FrameworkElement omniButton) {
 
 // Fallback: Manually find and process OmniButton
 void ProcessSystemTray() {
-    Log(L"Attempting to find and process system tray");
+    LOG_DEBUG(L"Attempting to find and process system tray");
 
     try {
         // This is a simplified approach. In a real implementation, we would hook into
         // the taskbar's XAML island and navigate the element tree properly.
         // For now, we'll document that this needs proper hooking implementation.
 
-        Log(L"Manual processing not yet implemented - needs proper XAML island access");
-        Log(L"See taskbar-notification-icon-spacing.wh.cpp for reference implementation");
+        LOG_DEBUG(L"Manual processing not yet implemented - needs proper XAML island access");
+        LOG_DEBUG(L"See taskbar-notification-icon-spacing.wh.cpp for reference implementation");
 
     } catch (...) {
-        Log(L"Exception in ProcessSystemTray");
+        LOG_ERROR(L"Exception in ProcessSystemTray");
     }
 }
 
@@ -317,9 +382,9 @@ void LoadSettings() {
     if (g_settings.iconSpacing < 0) g_settings.iconSpacing = 0;
     if (g_settings.iconSpacing > 32) g_settings.iconSpacing = 32;
 
-    Log(L"Settings loaded - Enable: %d, Size: %d, Spacing: %d, Debug: %d",
-        g_settings.enableVertical, g_settings.iconSize,
-        g_settings.iconSpacing, g_settings.debugLogging);
+    LOG_DEBUG(L"Settings loaded - Enable: %d, Size: %d, Spacing: %d, Debug: %d",
+              g_settings.enableVertical, g_settings.iconSize,
+              g_settings.iconSpacing, g_settings.debugLogging);
 }
 
 // Windhawk mod initialization
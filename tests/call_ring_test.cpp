@@ -0,0 +1,82 @@
+// tray-system-stack's CallRing: a full ring refuses records, and records
+// pushed from several threads at once all reach the single consumer once.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "check.h"
+#include "tray_call_ring.inc"
+
+namespace {
+
+void FullRingRefuses() {
+    CallRing<int, 8> ring;
+    for (int i = 0; i < 8; i++) CHECK(ring.TryPush(i));
+    CHECK(!ring.TryPush(8));
+
+    int value = -1;
+    for (int i = 0; i < 8; i++) CHECK(ring.TryPop(value) && value == i);
+    CHECK(!ring.TryPop(value));
+
+    // Wraps around once drained
+    for (int round = 0; round < 100; round++) {
+        CHECK(ring.TryPush(round));
+        CHECK(ring.TryPop(value) && value == round);
+    }
+}
+
+void ProducersAndOneConsumer() {
+    constexpr int kProducers = 4;
+    constexpr uint32_t kPerProducer = 50000;
+    static CallRing<uint64_t, 256> ring;
+    std::atomic<int> producing{kProducers};
+
+    std::vector<std::thread> producers;
+    for (int p = 0; p < kProducers; p++) {
+        producers.emplace_back([&, p] {
+            for (uint32_t i = 0; i < kPerProducer; i++) {
+                uint64_t record = (uint64_t{static_cast<uint32_t>(p)} << 32) | i;
+                while (!ring.TryPush(record)) std::this_thread::yield();
+            }
+            producing--;
+        });
+    }
+
+    // Each producer's records arrive in the order it pushed them
+    std::vector<uint32_t> next(kProducers, 0);
+    bool ordered = true;
+    uint64_t received = 0;
+    auto take = [&](uint64_t record) {
+        uint32_t producer = static_cast<uint32_t>(record >> 32);
+        if (producer >= kProducers || static_cast<uint32_t>(record) != next[producer]++) ordered = false;
+        received++;
+    };
+
+    uint64_t record;
+    for (;;) {
+        if (ring.TryPop(record)) {
+            take(record);
+        } else if (producing == 0) {
+            // Everything pushed before the last producer finished
+            while (ring.TryPop(record)) take(record);
+            break;
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    for (auto& producer : producers) producer.join();
+
+    CHECK(ordered);
+    CHECK(received == uint64_t{kProducers} * kPerProducer);
+}
+
+}  // namespace
+
+int main() {
+    FullRingRefuses();
+    ProducersAndOneConsumer();
+    return CheckResult();
+}
@@ -0,0 +1,20 @@
+// Minimal checks for the host tests: a failed CHECK is reported and counted,
+// and main returns CheckResult().
+#pragma once
+
+#include <cstdio>
+
+inline int g_checkFailures = 0;
+
+#define CHECK(condition)                                                                     \
+    do {                                                                                     \
+        if (!(condition)) {                                                                  \
+            std::fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #condition); \
+            g_checkFailures++;                                                               \
+        }                                                                                    \
+    } while (0)
+
+inline int CheckResult() {
+    if (g_checkFailures) std::fprintf(stderr, "%d check(s) failed\n", g_checkFailures);
+    return g_checkFailures ? 1 : 0;
+}
@@ -0,0 +1,58 @@
+// An in-memory visual tree with the traits the mods' tree searches are
+// written against, so they run outside explorer. Short class names ("Grid")
+// are Windows.UI.Xaml.Controls types, as in selectors. It lives in a
+// namespace of its own so argument-dependent lookup doesn't find v2's
+// FindDescendant from inside v1's.
+#pragma once
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace host {
+
+class MemoryTree {
+public:
+    struct NodeData {
+        std::wstring className;
+        std::wstring name;
+        NodeData* parent;
+        std::vector<NodeData*> children;
+    };
+
+    using Node = NodeData*;
+
+    // A null parent adds a root
+    Node Add(Node parent, std::wstring_view className, std::wstring_view name = {}) {
+        std::wstring fullName(className);
+        if (className.find(L'.') == std::wstring_view::npos) fullName = L"Windows.UI.Xaml.Controls." + fullName;
+
+        m_nodes.push_back(std::make_unique<NodeData>(NodeData{fullName, std::wstring(name), parent, {}}));
+        Node node = m_nodes.back().get();
+        if (parent) parent->children.push_back(node);
+        return node;
+    }
+
+    Node Root() const { return m_nodes.empty() ? nullptr : m_nodes.front().get(); }
+    size_t Size() const { return m_nodes.size(); }
+
+    static Node Null() { return nullptr; }
+    static bool IsNull(const Node& node) { return !node; }
+    static int ChildCount(const Node& node) { return static_cast<int>(node->children.size()); }
+    static Node Child(const Node& node, int index) { return node->children[index]; }
+    static Node Parent(const Node& node) { return node->parent; }
+    static const void* Identity(const Node& node) { return node; }
+
+    // vertical-omnibutton.wh.cpp's traits
+    static bool HasClass(const Node& node, const wchar_t* className) { return node->className == className; }
+    static bool HasName(const Node& node, const wchar_t* name) { return node->name == name; }
+    static bool IsContentPresenter(const Node& node) {
+        return node->className == L"Windows.UI.Xaml.Controls.ContentPresenter";
+    }
+
+private:
+    std::vector<std::unique_ptr<NodeData>> m_nodes;
+};
+
+}  // namespace host
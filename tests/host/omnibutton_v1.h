@@ -0,0 +1,9 @@
+// vertical-omnibutton.wh.cpp's tree searches. They're only templates, so
+// they're kept in a namespace of their own next to v2's.
+#pragma once
+
+#include <vector>
+
+namespace omnibutton_v1 {
+#include "omnibutton_v1.inc"
+}  // namespace omnibutton_v1
@@ -0,0 +1,33 @@
+// vertical-omnibutton v2's portable code, with the globals it expects from
+// the rest of the mod
+#pragma once
+
+#include "windhawk_host.h"
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cwchar>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+inline std::atomic<bool> g_debugLogging{false};
+inline std::atomic<bool> g_unloading{false};
+
+#include "omnibutton_v2.inc"
+
+#include "memory_tree.h"
+
+// MemoryTree with v2's traits. Atoms are resolved on every call, as XamlTree
+// does, so the cost of the atom tables is measured too.
+struct AtomMemoryTree : host::MemoryTree {
+    static Atom ClassAtom(const Node& node) { return g_classAtoms.Intern(node->className); }
+    static Atom NameAtom(const Node& node) { return g_nameAtoms.Lookup(node->name); }
+};
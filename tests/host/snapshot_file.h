@@ -0,0 +1,34 @@
+// Reads and writes snapshot files on the host. A snapshot is read in place,
+// so the buffer is 8-byte aligned, as a mapped file would be.
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+namespace host {
+
+struct SnapshotFile {
+    std::vector<uint64_t> words;
+    size_t size = 0;
+
+    const void* Data() const { return words.data(); }
+};
+
+inline bool ReadSnapshotFile(const char* path, SnapshotFile& file) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in) return false;
+
+    file.size = static_cast<size_t>(in.tellg());
+    file.words.assign((file.size + 7) / 8, 0);
+    in.seekg(0);
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(file.words.data()), file.size));
+}
+
+inline bool WriteSnapshotFile(const char* path, const std::vector<uint8_t>& blob) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    return out && out.write(reinterpret_cast<const char*>(blob.data()), blob.size());
+}
+
+}  // namespace host
@@ -0,0 +1,90 @@
+// Synthetic taskbar visual trees in the shapes the searches meet: a deep
+// tree (wrappers above the tray), a wide one (many taskbar buttons and
+// notification icons) and one taskbar per monitor under a shared root.
+#pragma once
+
+#include "memory_tree.h"
+
+namespace host {
+
+struct TaskbarShape {
+    int monitors = 1;     // taskbars; only the first has the OmniButton
+    int depth = 0;        // extra wrappers above each taskbar's tray
+    int appButtons = 10;  // task list buttons per taskbar
+    int notifyIcons = 6;  // notification area icons per taskbar
+    int omniIcons = 3;    // wifi, volume, battery
+};
+
+// A minimal version of a button or icon template: four elements under it
+inline void AddButtonContent(MemoryTree& tree, MemoryTree::Node button) {
+    auto grid = tree.Add(button, L"Grid");
+    tree.Add(tree.Add(grid, L"ContentPresenter"), L"Image");
+    tree.Add(grid, L"TextBlock");
+}
+
+inline MemoryTree::Node AddTaskbar(MemoryTree& tree, MemoryTree::Node root, const TaskbarShape& shape,
+                                   bool withOmniButton) {
+    auto frame = tree.Add(root, L"Taskbar.TaskbarFrame", L"TaskbarFrame");
+    auto frameGrid = tree.Add(frame, L"Grid", L"RootGrid");
+
+    auto repeater = tree.Add(frameGrid, L"Microsoft.UI.Xaml.Controls.ItemsRepeater", L"TaskbarFrameRepeater");
+    for (int i = 0; i < shape.appButtons; i++) {
+        AddButtonContent(tree, tree.Add(repeater, L"Taskbar.TaskListButton"));
+    }
+
+    auto parent = frameGrid;
+    for (int i = 0; i < shape.depth; i++) parent = tree.Add(parent, i % 2 ? L"Grid" : L"Border");
+
+    auto tray = tree.Add(tree.Add(parent, L"SystemTray.SystemTrayFrame"), L"Grid", L"SystemTrayFrameGrid");
+
+    auto notifyPanel = tree.Add(
+        tree.Add(tree.Add(tray, L"SystemTray.NotificationAreaIcons", L"NotificationAreaIcons"), L"ItemsPresenter"),
+        L"StackPanel");
+    for (int i = 0; i < shape.notifyIcons; i++) {
+        AddButtonContent(tree, tree.Add(tree.Add(notifyPanel, L"ContentPresenter"), L"SystemTray.NotifyIconView"));
+    }
+
+    if (withOmniButton) {
+        auto omniButton = tree.Add(tray, L"SystemTray.OmniButton", L"ControlCenterButton");
+        auto stackPanel = tree.Add(
+            tree.Add(tree.Add(tree.Add(omniButton, L"Grid"), L"ContentPresenter"), L"ItemsPresenter"), L"StackPanel");
+        for (int i = 0; i < shape.omniIcons; i++) {
+            AddButtonContent(tree, tree.Add(tree.Add(stackPanel, L"ContentPresenter"), L"SystemTray.IconView"));
+        }
+    }
+
+    tree.Add(tray, L"SystemTray.OmniButton", L"NotificationCenterButton");
+    return frame;
+}
+
+// Returns the root
+inline MemoryTree::Node BuildTaskbarTree(MemoryTree& tree, const TaskbarShape& shape) {
+    auto root = tree.Add(nullptr, L"Grid");
+    for (int i = 0; i < shape.monitors; i++) AddTaskbar(tree, root, shape, i == 0);
+    return root;
+}
+
+// The three shapes, scaled to about nodes elements. The searches recurse, so
+// the deep shape's wrappers are capped and the rest of it is task buttons.
+inline TaskbarShape DeepShape(size_t nodes) {
+    TaskbarShape shape;
+    shape.depth = static_cast<int>(nodes < 4000 ? nodes / 2 : 2000);
+    shape.appButtons = static_cast<int>((nodes - shape.depth) / 5);
+    return shape;
+}
+
+inline TaskbarShape WideShape(size_t nodes) {
+    TaskbarShape shape;
+    shape.appButtons = static_cast<int>(nodes / 10);
+    shape.notifyIcons = static_cast<int>(nodes / 12);
+    return shape;
+}
+
+inline TaskbarShape MultiMonitorShape(size_t nodes) {
+    TaskbarShape shape;
+    shape.monitors = static_cast<int>(nodes / 110);
+    shape.depth = 4;
+    return shape;
+}
+
+}  // namespace host
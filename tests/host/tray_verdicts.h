@@ -0,0 +1,27 @@
+// tray-system-stack's taskbar verdict cache, with the Win32 names its window
+// system uses. The Win32 one is compiled but not run; tests pass their own.
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cwchar>
+#include <iterator>
+
+#include "windhawk_host.h"
+
+struct HWND__;
+using HWND = HWND__*;
+using ULONG_PTR = uintptr_t;
+using std::min;
+
+#define _countof(array) std::size(array)
+
+inline int GetClassNameW(HWND, wchar_t* className, int) {
+    className[0] = L'\0';
+    return 0;
+}
+inline HWND GetParent(HWND) { return nullptr; }
+inline int _wcsicmp(const wchar_t* a, const wchar_t* b) { return wcscasecmp(a, b); }
+
+#include "tray_verdicts.inc"
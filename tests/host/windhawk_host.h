@@ -0,0 +1,38 @@
+// Just enough of windows.h and the Windhawk API for the mods' portable code
+// to build and run on the host.
+#pragma once
+
+#include <atomic>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cwchar>
+#include <shared_mutex>
+
+struct SRWLOCK {
+    std::shared_mutex mutex;
+};
+#define SRWLOCK_INIT \
+    {}
+
+inline void AcquireSRWLockShared(SRWLOCK* lock) { lock->mutex.lock_shared(); }
+inline void ReleaseSRWLockShared(SRWLOCK* lock) { lock->mutex.unlock_shared(); }
+inline void AcquireSRWLockExclusive(SRWLOCK* lock) { lock->mutex.lock(); }
+inline void ReleaseSRWLockExclusive(SRWLOCK* lock) { lock->mutex.unlock(); }
+
+// The tests set the clock; it doesn't advance on its own
+inline std::atomic<unsigned long long> g_hostTickCount{0};
+
+inline unsigned long long GetTickCount64() { return g_hostTickCount.load(); }
+
+// Lines logged so far, and the last one, for tests that check a log site ran
+inline std::atomic<int> g_hostLogLines{0};
+inline wchar_t g_hostLastLog[512];
+
+inline void Wh_Log(const wchar_t* format, ...) {
+    va_list args;
+    va_start(args, format);
+    std::vswprintf(g_hostLastLog, std::size(g_hostLastLog), format, args);
+    va_end(args);
+    g_hostLogLines++;
+}
@@ -0,0 +1,93 @@
+// IdentityMap::Erase shifts the rest of a probe chain back, so every key
+// still in the map stays reachable, including chains that wrap around.
+
+#include "check.h"
+#include "omnibutton_v2.h"
+
+namespace {
+
+// Distinct identities, 16-byte aligned like real objects
+const void* Identity(size_t i) {
+    return reinterpret_cast<const void*>(uintptr_t{0x10000} + i * 16);
+}
+
+void FindsWhatWasInserted() {
+    IdentityMap<int> map(8);
+    for (int i = 0; i < 8; i++) map.FindOrInsert(Identity(i)) = i;
+
+    CHECK(map.Size() == 8);
+    for (int i = 0; i < 8; i++) {
+        int* value = map.Find(Identity(i));
+        CHECK(value && *value == i);
+    }
+    CHECK(!map.Find(Identity(100)));
+}
+
+// Every subset of erasures from a full map, in a small table where probe
+// chains collide and wrap
+void EraseKeepsChainsIntact() {
+    constexpr int kKeys = 8;
+    for (unsigned erased = 0; erased < (1u << kKeys); erased++) {
+        IdentityMap<int> map(kKeys);
+        for (int i = 0; i < kKeys; i++) map.FindOrInsert(Identity(i)) = i;
+
+        for (int i = 0; i < kKeys; i++) {
+            if (erased & (1u << i)) map.Erase(Identity(i));
+        }
+
+        size_t expected = 0;
+        for (int i = 0; i < kKeys; i++) {
+            int* value = map.Find(Identity(i));
+            if (erased & (1u << i)) {
+                CHECK(!value);
+            } else {
+                CHECK(value && *value == i);
+                expected++;
+            }
+        }
+        CHECK(map.Size() == expected);
+    }
+}
+
+void EraseOfMissingKeyIsNoOp() {
+    IdentityMap<int> map(4);
+    map.FindOrInsert(Identity(1)) = 1;
+    map.Erase(Identity(2));
+    CHECK(map.Size() == 1);
+    CHECK(map.Find(Identity(1)));
+}
+
+// Erasing and inserting over and over never loses a live key
+void ChurnKeepsLiveKeys() {
+    IdentityMap<size_t> map(16);
+    for (size_t round = 0; round < 2000; round++) {
+        map.FindOrInsert(Identity(round)) = round;
+        if (round >= 8) map.Erase(Identity(round - 8));
+
+        for (size_t live = round >= 7 ? round - 7 : 0; live <= round; live++) {
+            size_t* value = map.Find(Identity(live));
+            CHECK(value && *value == live);
+        }
+    }
+    CHECK(map.Size() == 8);
+}
+
+void FullMapStartsOver() {
+    IdentityMap<int> map(2);
+    map.FindOrInsert(Identity(0)) = 0;
+    map.FindOrInsert(Identity(1)) = 1;
+    map.FindOrInsert(Identity(2)) = 2;  // would fill the table past half
+    CHECK(map.Size() == 1);
+    CHECK(map.Find(Identity(2)));
+}
+
+}  // namespace
+
+int main() {
+    FindsWhatWasInserted();
+    EraseKeepsChainsIntact();
+    EraseOfMissingKeyIsNoOp();
+    ChurnKeepsLiveKeys();
+    FullMapStartsOver();
+    return CheckResult();
+}
@@ -0,0 +1,86 @@
+// A disabled log site evaluates none of its arguments, so it allocates
+// nothing, and a rate-limited error site stops logging after its burst.
+
+#include <cstdlib>
+#include <new>
+
+#include "check.h"
+#include "omnibutton_v2.h"
+
+namespace {
+
+std::atomic<uint64_t> g_allocations{0};
+
+}  // namespace
+
+void* operator new(size_t size) {
+    g_allocations++;
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+namespace {
+
+// Stands in for a tree-walk site: the arguments build strings
+void DebugSite(const wchar_t* className) {
+    LOG_DEBUG(L"[Test] %s has %zu characters", LogAtom{g_classAtoms.Intern(std::wstring(className))},
+              std::wstring(className).size());
+}
+
+void HotErrorSite(int i) {
+    LOG_ERROR_LIMITED(L"[Test] failure %d", i);
+}
+
+void DisabledSitesAllocateNothing() {
+    g_debugLogging = false;
+    uint64_t before = g_allocations;
+    for (int i = 0; i < 1000; i++) DebugSite(L"Windows.UI.Xaml.Controls.Grid with a long enough name");
+    CHECK(g_allocations == before);
+
+    // The same site does allocate once enabled, so the count above means something
+    g_debugLogging = true;
+    before = g_allocations;
+    DebugSite(L"Windows.UI.Xaml.Controls.Grid with a long enough name");
+    CHECK(g_allocations > before);
+    g_debugLogging = false;
+}
+
+void HotErrorsAreLimited() {
+    g_hostTickCount = 1000000;
+    int before = g_hostLogLines;
+    for (int i = 0; i < 100; i++) HotErrorSite(i);
+    CHECK(g_hostLogLines - before == static_cast<int>(kHotErrorBurst));
+
+    // A second later one more gets through, after a line counting the dropped ones
+    g_hostTickCount += 1000;
+    before = g_hostLogLines;
+    HotErrorSite(100);
+    CHECK(g_hostLogLines - before == 2);
+    CHECK(std::wstring(g_hostLastLog) == L"[Test] failure 100");
+}
+
+void LimiterSamplesAndRefills() {
+    LogRateLimiter limiter(10, 2, 2);  // every 2nd call, 10 a second, bursts of 2
+    unsigned long long dropped = 0;
+    int allowed = 0;
+    for (int i = 0; i < 10; i++) allowed += limiter.Allow(5000, &dropped);
+    CHECK(allowed == 2);
+
+    // 100 ms refills one token
+    allowed = 0;
+    for (int i = 0; i < 4; i++) allowed += limiter.Allow(5100, &dropped);
+    CHECK(allowed == 1);
+    CHECK(dropped == 7);  // since the last one allowed: 4 not sampled, 3 over the burst
+}
+
+}  // namespace
+
+int main() {
+    DisabledSitesAllocateNothing();
+    HotErrorsAreLimited();
+    LimiterSamplesAndRefills();
+    return CheckResult();
+}
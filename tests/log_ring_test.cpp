@@ -0,0 +1,94 @@
+// LogRing keeps records in order, drops and counts them once full, and hands
+// records across threads intact. DeferredLog formats them on drain.
+
+#include <thread>
+
+#include "check.h"
+#include "omnibutton_v2.h"
+
+namespace {
+
+LogRecord Record(uint64_t value) {
+    LogRecord record;
+    record.format = L"%llu";
+    record.argCount = 0;
+    EncodeLogArg(record, value);
+    return record;
+}
+
+void FullRingDropsAndCounts() {
+    auto ring = std::make_unique<LogRing>();
+    for (uint64_t i = 0; i < LogRing::kCapacity + 10; i++) ring->Push(Record(i));
+    CHECK(ring->TakeDropped() == 10);
+    CHECK(ring->TakeDropped() == 0);
+
+    uint64_t expected = 0;
+    ring->Drain([&](const LogRecord& record) { CHECK(record.args[0].u == expected++); });
+    CHECK(expected == LogRing::kCapacity);
+
+    // Drained slots are free again
+    ring->Push(Record(7));
+    CHECK(ring->TakeDropped() == 0);
+    size_t drained = 0;
+    ring->Drain([&](const LogRecord& record) {
+        CHECK(record.args[0].u == 7);
+        drained++;
+    });
+    CHECK(drained == 1);
+}
+
+// One producer, one consumer: every record arrives once and in order, or
+// is counted as dropped
+void ProducerAndConsumerThreads() {
+    constexpr uint64_t kRecords = 200000;
+    auto ring = std::make_unique<LogRing>();
+    std::atomic<bool> done{false};
+
+    std::thread producer([&] {
+        for (uint64_t i = 0; i < kRecords; i++) ring->Push(Record(i));
+        done = true;
+    });
+
+    uint64_t received = 0;
+    uint64_t last = 0;
+    bool ordered = true;
+    auto visit = [&](const LogRecord& record) {
+        if (received && record.args[0].u <= last) ordered = false;
+        last = record.args[0].u;
+        received++;
+    };
+    while (!done) ring->Drain(visit);
+    producer.join();
+    ring->Drain(visit);
+
+    CHECK(ordered);
+    CHECK(received + ring->TakeDropped() == kRecords);
+}
+
+void DeferredLogFormatsOnDrain() {
+    DeferredLog log;
+    Atom atom = g_classAtoms.Intern(L"SystemTray.IconView");
+    log.Write(L"[Test] %d %s %.1f", -3, LogAtom{atom}, 2.5);
+    log.Write(L"[Test] %zu%%", size_t{42});
+
+    std::vector<std::wstring> lines;
+    log.Drain([&](const wchar_t* line) { lines.emplace_back(line); });
+    CHECK(lines.size() == 2);
+    CHECK(lines.size() == 2 && lines[0] == L"[Test] -3 SystemTray.IconView 2.5");
+    CHECK(lines.size() == 2 && lines[1] == L"[Test] 42%");
+
+    for (uint32_t i = 0; i < LogRing::kCapacity + 5; i++) log.Write(L"%u", i);
+    lines.clear();
+    log.Drain([&](const wchar_t* line) { lines.emplace_back(line); });
+    CHECK(lines.size() == LogRing::kCapacity + 1);
+    CHECK(!lines.empty() && lines.back() == L"[Log] 5 records dropped");
+}
+
+}  // namespace
+
+int main() {
+    FullRingDropsAndCounts();
+    ProducerAndConsumerThreads();
+    DeferredLogFormatsOnDrain();
+    return CheckResult();
+}
@@ -0,0 +1,171 @@
+// A captured snapshot survives a trip through a file and reads back as the
+// same tree, the searches find the same nodes in it as in the tree it was
+// captured from, and DiffSnapshots reports what changed between two captures.
+// With a path argument, the OmniButton sample is also left there for
+// snapshot_tool's tests.
+
+#include <cmath>
+
+#include "check.h"
+#include "omnibutton_v2.h"
+#include "snapshot_file.h"
+#include "taskbar_trees.h"
+
+using namespace host;
+
+namespace {
+
+const wchar_t* const kTargets[] = {
+    L"SystemTray.OmniButton#ControlCenterButton",
+    L"SystemTray.OmniButton#ControlCenterButton > Grid > ContentPresenter > ItemsPresenter > StackPanel",
+    L"SystemTray.OmniButton#ControlCenterButton > Grid > ContentPresenter > ItemsPresenter > StackPanel > ContentPresenter",
+    L"SystemTray.OmniButton#ControlCenterButton > Grid > ContentPresenter > ItemsPresenter > StackPanel > ContentPresenter > SystemTray.IconView",
+};
+
+// StackPanels get an orientation, everything else a size and a margin
+void ReadProperties(const MemoryTree::Node& node, SnapshotProperties& properties) {
+    properties.flags = kSnapshotWidth | kSnapshotHeight | kSnapshotMargin;
+    properties.width = node->children.empty() ? 32.0 : NAN;
+    properties.height = 28.0;
+    properties.margin[0] = 6.0;
+    if (node->className == L"Windows.UI.Xaml.Controls.StackPanel") {
+        properties.flags |= kSnapshotOrientation;
+        properties.orientation = 0;
+    }
+}
+
+MemoryTree::Node FindOmniButton(MemoryTree::Node node) {
+    if (node->name == L"ControlCenterButton") return node;
+    for (auto child : node->children) {
+        if (auto found = FindOmniButton(child)) return found;
+    }
+    return nullptr;
+}
+
+// Which nodes each target matches, in match order
+template <typename Tree>
+std::vector<std::vector<const void*>> MatchTargets(const typename Tree::Node& root) {
+    SelectorAutomaton<Tree> automaton;
+    for (uint32_t i = 0; i < std::size(kTargets); i++) automaton.AddRule(kTargets[i], i);
+
+    std::vector<std::vector<const void*>> matched(std::size(kTargets));
+    automaton.Match(root, [&](const typename Tree::Node& node, uint32_t rule) {
+        matched[rule].push_back(Tree::Identity(node));
+    });
+    return matched;
+}
+
+void RoundTripsThroughFile(const char* path) {
+    MemoryTree tree;
+    auto omniButton = FindOmniButton(BuildTaskbarTree(tree, WideShape(1000)));
+
+    std::vector<MemoryTree::Node> captured;
+    auto blob = CaptureTreeSnapshot<AtomMemoryTree>(omniButton, ReadProperties, 4096, INT_MAX, &captured);
+    CHECK(WriteSnapshotFile(path, blob));
+
+    SnapshotFile file;
+    CHECK(ReadSnapshotFile(path, file));
+    CHECK(file.size == blob.size());
+
+    SnapshotTree snapshot;
+    CHECK(snapshot.Attach(file.Data(), file.size));
+    CHECK(!snapshot.Truncated());
+    CHECK(snapshot.NodeCount() == captured.size());
+    if (snapshot.NodeCount() != captured.size()) return;
+
+    for (uint32_t i = 0; i < snapshot.NodeCount(); i++) {
+        SnapshotTree::Node node = {&snapshot, i};
+        const MemoryTree::Node& original = captured[i];
+        CHECK(SnapshotTree::ClassName(node) == original->className);
+        CHECK(SnapshotTree::ChildCount(node) == MemoryTree::ChildCount(original));
+        CHECK(i == 0 ? SnapshotTree::IsNull(SnapshotTree::Parent(node))
+                     : captured[SnapshotTree::Parent(node).index] == original->parent);
+
+        const SnapshotProperties& properties = SnapshotTree::Properties(node);
+        CHECK(properties.height == 28.0 && properties.margin[0] == 6.0);
+        CHECK(std::isnan(properties.width) == !original->children.empty());
+        CHECK(((properties.flags & kSnapshotOrientation) != 0) ==
+              (original->className == L"Windows.UI.Xaml.Controls.StackPanel"));
+    }
+
+    // Only Names some selector uses are stored
+    CHECK(SnapshotTree::Name(snapshot.Root()) == L"ControlCenterButton");
+    CHECK(SnapshotTree::Name({&snapshot, 1}).empty());
+
+    // Matched in the snapshot where they were matched in the tree
+    auto inTree = MatchTargets<AtomMemoryTree>(omniButton);
+    auto inSnapshot = MatchTargets<SnapshotTree>(snapshot.Root());
+    for (size_t rule = 0; rule < inTree.size(); rule++) {
+        CHECK(inTree[rule].size() == inSnapshot[rule].size());
+        CHECK(!inTree[rule].empty());
+        for (size_t m = 0; m < inTree[rule].size() && m < inSnapshot[rule].size(); m++) {
+            auto index = static_cast<const SnapshotNode*>(inSnapshot[rule][m]) -
+                         static_cast<const SnapshotNode*>(SnapshotTree::Identity(snapshot.Root()));
+            CHECK(captured[index] == inTree[rule][m]);
+        }
+    }
+}
+
+void LimitsTruncate() {
+    MemoryTree tree;
+    auto root = BuildTaskbarTree(tree, TaskbarShape{});
+
+    auto blob = CaptureTreeSnapshot<AtomMemoryTree>(root, ReadProperties, 50);
+    std::vector<uint64_t> words((blob.size() + 7) / 8);
+    std::memcpy(words.data(), blob.data(), blob.size());
+    SnapshotTree snapshot;
+    CHECK(snapshot.Attach(words.data(), blob.size()));
+    CHECK(snapshot.Truncated() && snapshot.NodeCount() == 50);
+
+    blob = CaptureTreeSnapshot<AtomMemoryTree>(root, ReadProperties, 65536, 2);
+    words.assign((blob.size() + 7) / 8, 0);
+    std::memcpy(words.data(), blob.data(), blob.size());
+    CHECK(snapshot.Attach(words.data(), blob.size()));
+    CHECK(snapshot.Truncated());
+    for (uint32_t i = 0; i < snapshot.NodeCount(); i++) {
+        int depth = 0;
+        for (SnapshotTree::Node node = {&snapshot, i}; node.index != 0; node = SnapshotTree::Parent(node)) depth++;
+        CHECK(depth <= 2);
+    }
+
+    // A damaged file doesn't attach
+    words[words.size() / 2] ^= 1;
+    CHECK(!snapshot.Attach(words.data(), blob.size()));
+}
+
+void DiffFindsInsertedIcon() {
+    MemoryTree tree;
+    auto omniButton = FindOmniButton(BuildTaskbarTree(tree, TaskbarShape{}));
+    auto before = CaptureTreeSnapshot<AtomMemoryTree>(omniButton, ReadProperties);
+
+    auto stackPanel = omniButton->children[0]->children[0]->children[0]->children[0];
+    auto presenter = tree.Add(stackPanel, L"ContentPresenter");
+    AddButtonContent(tree, tree.Add(presenter, L"SystemTray.IconView"));
+    auto after = CaptureTreeSnapshot<AtomMemoryTree>(omniButton, ReadProperties);
+
+    std::vector<uint64_t> beforeWords((before.size() + 7) / 8), afterWords((after.size() + 7) / 8);
+    std::memcpy(beforeWords.data(), before.data(), before.size());
+    std::memcpy(afterWords.data(), after.data(), after.size());
+    SnapshotTree beforeTree, afterTree;
+    CHECK(beforeTree.Attach(beforeWords.data(), before.size()));
+    CHECK(afterTree.Attach(afterWords.data(), after.size()));
+
+    std::vector<TreeEdit> edits;
+    TreeDiffStats stats;
+    DiffSnapshots(beforeTree, afterTree, [&](const TreeEdit& edit) { edits.push_back(edit); }, stats);
+    CHECK(edits.size() == 1);
+    CHECK(!edits.empty() && edits[0].kind == TreeEditKind::Inserted &&
+          SnapshotTree::ClassName(edits[0].after) == L"Windows.UI.Xaml.Controls.ContentPresenter");
+    CHECK(stats.subtreesSkipped > 0);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    g_nameAtoms.Intern(L"ControlCenterButton");  // as InternSelectorNames does
+
+    RoundTripsThroughFile(argc > 1 ? argv[1] : "snapshot_test.snapshot");
+    LimitsTruncate();
+    DiffFindsInsertedIcon();
+    return CheckResult();
+}
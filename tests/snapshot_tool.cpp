@@ -0,0 +1,200 @@
+// Reads the tree snapshots the v2 mod writes with "Capture a tree snapshot"
+// (omnibutton-tree.snapshot in %TEMP%). The snapshot must come from a build
+// with the same wchar_t size; Windows' is 2 bytes, so on other hosts only
+// snapshots written by the tests themselves read back.
+//
+//   snapshot_tool dump <file>              the tree, with the properties read
+//   snapshot_tool diff <before> <after>    what changed between two captures
+//   snapshot_tool replay <file> [selector...]
+//                                          runs the selectors, by default the
+//                                          mod's targets, over the snapshot
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <string>
+
+#include "omnibutton_v2.h"
+#include "snapshot_file.h"
+
+using namespace host;
+
+namespace {
+
+const wchar_t* const kTargets[] = {
+    L"SystemTray.OmniButton#ControlCenterButton",
+    L"SystemTray.OmniButton#ControlCenterButton > Grid > ContentPresenter > ItemsPresenter > StackPanel",
+    L"SystemTray.OmniButton#ControlCenterButton > Grid > ContentPresenter > ItemsPresenter > StackPanel > ContentPresenter",
+    L"SystemTray.OmniButton#ControlCenterButton > Grid > ContentPresenter > ItemsPresenter > StackPanel > ContentPresenter > SystemTray.IconView",
+};
+
+bool Load(const char* path, SnapshotFile& file, SnapshotTree& tree) {
+    if (!ReadSnapshotFile(path, file)) {
+        std::fprintf(stderr, "%s: can't read the file\n", path);
+        return false;
+    }
+    if (!tree.Attach(file.Data(), file.size)) {
+        std::fprintf(stderr, "%s: not a snapshot, a damaged one, or from another version\n", path);
+        return false;
+    }
+    return true;
+}
+
+std::wstring Describe(const SnapshotTree::Node& node) {
+    std::wstring text(SnapshotTree::ClassName(node));
+    if (text.empty()) text = L"?";
+    if (!SnapshotTree::Name(node).empty()) {
+        text += L'#';
+        text += SnapshotTree::Name(node);
+    }
+    return text;
+}
+
+std::wstring PathOf(SnapshotTree::Node node) {
+    std::wstring path = Describe(node);
+    for (node = SnapshotTree::Parent(node); !SnapshotTree::IsNull(node); node = SnapshotTree::Parent(node)) {
+        path = Describe(node) + L" > " + path;
+    }
+    return path;
+}
+
+void PrintLength(const char* label, double value) {
+    if (std::isnan(value)) {
+        std::printf(" %s=Auto", label);
+    } else {
+        std::printf(" %s=%g", label, value);
+    }
+}
+
+void Dump(const SnapshotTree::Node& node, int depth) {
+    std::printf("%*s%ls", depth * 2, "", Describe(node).c_str());
+
+    const SnapshotProperties& properties = SnapshotTree::Properties(node);
+    if (properties.flags & kSnapshotWidth) PrintLength("Width", properties.width);
+    if (properties.flags & kSnapshotHeight) PrintLength("Height", properties.height);
+    if (properties.flags & kSnapshotMargin) {
+        std::printf(" Margin=%g,%g,%g,%g", properties.margin[0], properties.margin[1], properties.margin[2],
+                    properties.margin[3]);
+    }
+    if (properties.flags & kSnapshotOrientation) {
+        std::printf(" Orientation=%s", properties.orientation ? "Horizontal" : "Vertical");
+    }
+    std::printf("\n");
+
+    for (int i = 0; i < SnapshotTree::ChildCount(node); i++) Dump(SnapshotTree::Child(node, i), depth + 1);
+}
+
+int DumpCommand(const char* path) {
+    SnapshotFile file;
+    SnapshotTree tree;
+    if (!Load(path, file, tree)) return 1;
+
+    std::printf("%u nodes%s\n", tree.NodeCount(), tree.Truncated() ? ", truncated by the capture limits" : "");
+    Dump(tree.Root(), 0);
+    return 0;
+}
+
+int DiffCommand(const char* beforePath, const char* afterPath) {
+    SnapshotFile beforeFile, afterFile;
+    SnapshotTree before, after;
+    if (!Load(beforePath, beforeFile, before) || !Load(afterPath, afterFile, after)) return 1;
+
+    TreeDiffStats stats;
+    DiffSnapshots(before, after, [](const TreeEdit& edit) {
+        switch (edit.kind) {
+            case TreeEditKind::Inserted:
+                std::printf("+ %ls\n", PathOf(edit.after).c_str());
+                break;
+            case TreeEditKind::Removed:
+                std::printf("- %ls\n", PathOf(edit.before).c_str());
+                break;
+            case TreeEditKind::Moved:
+                std::printf("~ %ls\n", PathOf(edit.after).c_str());
+                break;
+        }
+    }, stats);
+
+    std::printf("%llu inserted, %llu removed, %llu moved; %llu pairs compared, %llu subtrees skipped\n",
+                static_cast<unsigned long long>(stats.inserted), static_cast<unsigned long long>(stats.removed),
+                static_cast<unsigned long long>(stats.moved), static_cast<unsigned long long>(stats.pairsCompared),
+                static_cast<unsigned long long>(stats.subtreesSkipped));
+    return 0;
+}
+
+// Both matchers must find the same nodes; the exit code says whether they did
+int ReplayCommand(const char* path, const std::vector<std::wstring>& selectors) {
+    using Clock = std::chrono::steady_clock;
+    auto micros = [](Clock::duration d) { return std::chrono::duration<double, std::micro>(d).count(); };
+
+    // Parsing interns the selectors' Names, which attaching only looks up,
+    // so the selectors go first
+    SelectorAutomaton<SnapshotTree> automaton;
+    std::vector<std::unique_ptr<RightToLeftMatcher<SnapshotTree>>> matchers;
+    for (uint32_t i = 0; i < selectors.size(); i++) {
+        if (!automaton.AddRule(selectors[i], i)) {
+            std::fprintf(stderr, "selector %u doesn't parse: %ls\n", i, selectors[i].c_str());
+            return 1;
+        }
+        matchers.push_back(std::make_unique<RightToLeftMatcher<SnapshotTree>>(selectors[i]));
+    }
+
+    SnapshotFile file;
+    SnapshotTree tree;
+    if (!Load(path, file, tree)) return 1;
+
+    std::vector<std::vector<uint32_t>> matched(selectors.size());
+    auto start = Clock::now();
+    automaton.Match(tree.Root(), [&](const SnapshotTree::Node& node, uint32_t rule) {
+        matched[rule].push_back(node.index);
+    }, INT_MAX);
+    double automatonMicros = micros(Clock::now() - start);
+
+    int result = 0;
+    for (uint32_t rule = 0; rule < selectors.size(); rule++) {
+        // Snapshot nodes are numbered, so every node is one loop away
+        std::vector<uint32_t> confirmed;
+        start = Clock::now();
+        for (uint32_t i = 0; i < tree.NodeCount(); i++) {
+            if (matchers[rule]->Matches({&tree, i})) confirmed.push_back(i);
+        }
+        double matcherMicros = micros(Clock::now() - start);
+
+        std::sort(matched[rule].begin(), matched[rule].end());
+        bool agree = matched[rule] == confirmed;
+        if (!agree) result = 1;
+
+        std::printf("rule %u: %zu matches%s; right to left %.1f us\n  %ls\n", rule, confirmed.size(),
+                    agree ? "" : " (the automaton disagrees)", matcherMicros, selectors[rule].c_str());
+        for (uint32_t index : confirmed) std::printf("    %ls\n", PathOf({&tree, index}).c_str());
+    }
+    std::printf("automaton, all rules: %.1f us over %u nodes\n", automatonMicros, tree.NodeCount());
+    return result;
+}
+
+int Usage() {
+    std::fprintf(stderr,
+                 "usage: snapshot_tool dump <file>\n"
+                 "       snapshot_tool diff <before> <after>\n"
+                 "       snapshot_tool replay <file> [selector...]\n");
+    return 2;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 3) return Usage();
+    std::string command = argv[1];
+
+    if (command == "dump" && argc == 3) return DumpCommand(argv[2]);
+    if (command == "diff" && argc == 4) return DiffCommand(argv[2], argv[3]);
+    if (command == "replay") {
+        std::vector<std::wstring> selectors;
+        for (int i = 3; i < argc; i++) {
+            std::string arg = argv[i];
+            selectors.emplace_back(arg.begin(), arg.end());
+        }
+        if (selectors.empty()) selectors.assign(std::begin(kTargets), std::end(kTargets));
+        return ReplayCommand(argv[2], selectors);
+    }
+    return Usage();
+}
@@ -0,0 +1,178 @@
+// StyleBlobView::Attach accepts what StyleBlobWriter compiles and rejects a
+// blob with anything out of place, even with a checksum that matches.
+
+#include "check.h"
+#include "omnibutton_v2.h"
+
+namespace {
+
+std::vector<uint8_t> CompileSample() {
+    StyleSource source;
+    source.rules.push_back({L"SystemTray.OmniButton#ControlCenterButton > Grid > StackPanel",
+                            {L"Orientation=Vertical", L"Margin=6,0"}});
+    source.rules.push_back({L"SystemTray.IconView", {L"Width=32", L"Height=28"}});
+    return StyleBlobWriter().Compile(source, nullptr);
+}
+
+StyleBlobHeader Header(const std::vector<uint8_t>& blob) {
+    StyleBlobHeader header;
+    std::memcpy(&header, blob.data(), sizeof(header));
+    return header;
+}
+
+// Writes header back and fixes up the checksum, so only the change is wrong
+void Rewrite(std::vector<uint8_t>& blob, StyleBlobHeader header) {
+    std::memcpy(blob.data(), &header, sizeof(header));
+    uint32_t checksum = BlobChecksum(blob.data(), blob.size(), offsetof(StyleBlobHeader, checksum));
+    std::memcpy(blob.data() + offsetof(StyleBlobHeader, checksum), &checksum, sizeof(checksum));
+}
+
+template <typename T>
+void RewriteAt(std::vector<uint8_t>& blob, size_t offset, T value) {
+    std::memcpy(blob.data() + offset, &value, sizeof(value));
+    Rewrite(blob, Header(blob));
+}
+
+bool Attaches(const std::vector<uint8_t>& blob) {
+    StyleBlobView view;
+    return view.Attach(blob.data(), blob.size());
+}
+
+void CompiledBlobReadsBack() {
+    std::vector<uint8_t> blob = CompileSample();
+    StyleBlobView view;
+    CHECK(view.Attach(blob.data(), blob.size()));
+    CHECK(view.RuleCount() == 2);
+
+    const StyleBlobRule& rule = view.Rule(0);
+    CHECK(rule.stepCount == 3);
+    CHECK(rule.propertyCount == 2);
+    CHECK(view.String(view.Steps(rule)[0].className) == L"SystemTray.OmniButton");
+    CHECK(view.String(view.Steps(rule)[0].name) == L"ControlCenterButton");
+    CHECK(view.String(view.Steps(rule)[1].className) == L"Windows.UI.Xaml.Controls.Grid");
+
+    const StyleBlobProperty* properties = view.Properties(rule);
+    CHECK(properties[0].kind == StyleValueKind::Text);
+    CHECK(properties[1].kind == StyleValueKind::Thickness);
+    CHECK(properties[1].values[2] == 6.0 && properties[1].values[3] == 0.0);
+
+    std::vector<SelectorStep> steps;
+    CHECK(view.RuleSelector(view.Rule(1), steps));
+    CHECK(steps.size() == 1);
+    CHECK(view.Properties(view.Rule(1))[0].kind == StyleValueKind::Number);
+}
+
+void RejectsDamagedHeader() {
+    const std::vector<uint8_t> good = CompileSample();
+    CHECK(Attaches(good));
+
+    std::vector<uint8_t> blob = good;
+    blob[blob.size() - 1] ^= 1;  // checksum no longer matches
+    CHECK(!Attaches(blob));
+
+    CHECK(!Attaches(std::vector<uint8_t>(good.begin(), good.begin() + sizeof(StyleBlobHeader) - 1)));
+
+    blob = good;
+    blob.resize(blob.size() + 8);  // totalSize no longer matches
+    CHECK(!Attaches(blob));
+
+    StyleBlobHeader header = Header(good);
+    header.magic = kSnapshotMagic;
+    blob = good;
+    Rewrite(blob, header);
+    CHECK(!Attaches(blob));
+
+    header = Header(good);
+    header.version = kStyleBlobVersion + 1;
+    blob = good;
+    Rewrite(blob, header);
+    CHECK(!Attaches(blob));
+
+    header = Header(good);
+    header.charSize = 1;
+    blob = good;
+    Rewrite(blob, header);
+    CHECK(!Attaches(blob));
+}
+
+void RejectsSectionsOutOfBounds() {
+    const std::vector<uint8_t> good = CompileSample();
+
+    StyleBlobHeader header = Header(good);
+    header.rules.count += 1000;
+    std::vector<uint8_t> blob = good;
+    Rewrite(blob, header);
+    CHECK(!Attaches(blob));
+
+    header = Header(good);
+    header.steps.offset += 2;  // misaligned
+    blob = good;
+    Rewrite(blob, header);
+    CHECK(!Attaches(blob));
+
+    header = Header(good);
+    header.properties.offset = 0;  // overlaps the header
+    blob = good;
+    Rewrite(blob, header);
+    CHECK(!Attaches(blob));
+}
+
+void RejectsBadIndices() {
+    const std::vector<uint8_t> good = CompileSample();
+    const StyleBlobHeader header = Header(good);
+
+    // A string running past the chars section
+    std::vector<uint8_t> blob = good;
+    RewriteAt(blob, header.strings.offset + offsetof(BlobString, length), header.chars.count);
+    CHECK(!Attaches(blob));
+
+    // A string that isn't null-terminated where its length says
+    blob = good;
+    BlobString first;
+    std::memcpy(&first, good.data() + header.strings.offset, sizeof(first));
+    RewriteAt(blob, header.strings.offset + offsetof(BlobString, length), first.length - 1);
+    CHECK(!Attaches(blob));
+
+    // A rule whose steps run past the steps section
+    blob = good;
+    RewriteAt(blob, header.rules.offset + offsetof(StyleBlobRule, stepCount), header.steps.count + 1);
+    CHECK(!Attaches(blob));
+
+    // A rule with no steps
+    blob = good;
+    RewriteAt(blob, header.rules.offset + offsetof(StyleBlobRule, stepCount), uint32_t{0});
+    CHECK(!Attaches(blob));
+
+    // A step naming a string that doesn't exist
+    blob = good;
+    RewriteAt(blob, header.steps.offset + offsetof(StyleBlobStep, className), header.strings.count);
+    CHECK(!Attaches(blob));
+
+    // ...unless it's the "any" marker
+    blob = good;
+    RewriteAt(blob, header.steps.offset + offsetof(StyleBlobStep, name), kNoStyleString);
+    CHECK(Attaches(blob));
+
+    // A property of an unknown kind
+    blob = good;
+    RewriteAt(blob, header.properties.offset + offsetof(StyleBlobProperty, kind), uint8_t{0xFF});
+    CHECK(!Attaches(blob));
+}
+
+void UnattachedViewIsEmpty() {
+    StyleBlobView view;
+    CHECK(!view.Attach(nullptr, 0));
+    CHECK(!view.Attached());
+    CHECK(view.RuleCount() == 0);
+}
+
+}  // namespace
+
+int main() {
+    CompiledBlobReadsBack();
+    RejectsDamagedHeader();
+    RejectsSectionsOutOfBounds();
+    RejectsBadIndices();
+    UnattachedViewIsEmpty();
+    return CheckResult();
+}
@@ -0,0 +1,152 @@
+// tray-system-stack's TaskbarVerdictCache over a fake window hierarchy: the
+// verdicts are right, a hit makes no window calls and counts the ones it
+// saved, a walk stops at a cached ancestor, and verdicts expire with their
+// lifetime or on Invalidate().
+
+#include <map>
+#include <string>
+
+#include "check.h"
+#include "tray_verdicts.h"
+
+namespace {
+
+// Windows are numbered handles with a parent and a class name; counts the
+// calls the cache makes
+class FakeWindowSystem : public WindowSystem {
+public:
+    HWND Add(HWND parent, const wchar_t* className) {
+        HWND hwnd = reinterpret_cast<HWND>(static_cast<uintptr_t>(m_windows.size() + 1) * 4);
+        m_windows[hwnd] = {parent, className};
+        return hwnd;
+    }
+
+    bool ClassNameEquals(HWND hwnd, const wchar_t* className) override {
+        classNameCalls++;
+        return m_windows.at(hwnd).className == className;
+    }
+    HWND Parent(HWND hwnd) override {
+        parentCalls++;
+        return m_windows.at(hwnd).parent;
+    }
+    unsigned long long NowMs() override { return nowMs; }
+
+    int Calls() const { return classNameCalls + parentCalls; }
+
+    int classNameCalls = 0;
+    int parentCalls = 0;
+    unsigned long long nowMs = 1000;
+
+private:
+    struct Window {
+        HWND parent;
+        std::wstring className;
+    };
+    std::map<HWND, Window> m_windows;
+};
+
+// desktop > Shell_TrayWnd > TrayNotifyWnd > SysPager > ToolbarWindow32, and
+// desktop > an app window > its button
+struct Windows {
+    FakeWindowSystem system;
+    HWND desktop = system.Add(nullptr, L"#32769");
+    HWND taskbar = system.Add(desktop, L"Shell_TrayWnd");
+    HWND notify = system.Add(taskbar, L"TrayNotifyWnd");
+    HWND pager = system.Add(notify, L"SysPager");
+    HWND toolbar = system.Add(pager, L"ToolbarWindow32");
+    HWND app = system.Add(desktop, L"Notepad");
+    HWND button = system.Add(app, L"Button");
+};
+
+void Verdicts() {
+    Windows w;
+    TaskbarVerdictCache cache(w.system);
+    CHECK(cache.IsTaskbarWindow(w.toolbar));
+    CHECK(cache.IsTaskbarWindow(w.taskbar));
+    CHECK(!cache.IsTaskbarWindow(w.button));
+    CHECK(!cache.IsTaskbarWindow(w.desktop));
+    CHECK(!cache.IsTaskbarWindow(nullptr));
+}
+
+void HitsSkipTheWalk() {
+    Windows w;
+    TaskbarVerdictCache cache(w.system);
+
+    // toolbar, pager and notify each cost a class check and a parent; the
+    // taskbar ends the walk on its class check
+    CHECK(cache.IsTaskbarWindow(w.toolbar));
+    CHECK(w.system.classNameCalls == 4 && w.system.parentCalls == 3);
+    TaskbarVerdictCache::Stats stats = cache.GetStats();
+    CHECK(stats.lookups == 1 && stats.hits == 0 && stats.savedCalls == 0);
+
+    int calls = w.system.Calls();
+    CHECK(cache.IsTaskbarWindow(w.toolbar));
+    CHECK(w.system.Calls() == calls);
+    stats = cache.GetStats();
+    CHECK(stats.lookups == 2 && stats.hits == 1 && stats.savedCalls == 7);
+
+    // Every window on the walk was cached with the calls below it
+    CHECK(cache.IsTaskbarWindow(w.notify) && cache.IsTaskbarWindow(w.taskbar));
+    CHECK(w.system.Calls() == calls);
+    stats = cache.GetStats();
+    CHECK(stats.hits == 3 && stats.savedCalls == 7 + 3 + 1);
+}
+
+void WalkStopsAtCachedAncestor() {
+    Windows w;
+    TaskbarVerdictCache cache(w.system);
+    CHECK(cache.IsTaskbarWindow(w.pager));
+
+    // A new child of the pager costs its own class check and parent only
+    HWND icon = w.system.Add(w.pager, L"Static");
+    int calls = w.system.Calls();
+    CHECK(cache.IsTaskbarWindow(icon));
+    CHECK(w.system.Calls() == calls + 2);
+
+    // and is cached with the pager's calls added
+    CHECK(cache.IsTaskbarWindow(icon));
+    CHECK(w.system.Calls() == calls + 2);
+    CHECK(cache.GetStats().savedCalls == 2 + 5);
+
+    // The same for a window outside the taskbar
+    CHECK(!cache.IsTaskbarWindow(w.app));
+    calls = w.system.Calls();
+    CHECK(!cache.IsTaskbarWindow(w.button));
+    CHECK(w.system.Calls() == calls + 2);
+}
+
+void VerdictsExpire() {
+    Windows w;
+    TaskbarVerdictCache cache(w.system);
+    CHECK(cache.IsTaskbarWindow(w.toolbar));
+    int walk = w.system.Calls();
+
+    // Still trusted within the lifetime
+    w.system.nowMs += TaskbarVerdictCache::kVerdictLifetimeMs - 1000 - 1;
+    CHECK(cache.IsTaskbarWindow(w.toolbar));
+    CHECK(w.system.Calls() == walk);
+
+    // Walked again once it's over
+    w.system.nowMs += 1;
+    CHECK(cache.IsTaskbarWindow(w.toolbar));
+    CHECK(w.system.Calls() == 2 * walk);
+    CHECK(cache.GetStats().hits == 1);
+
+    // and after Invalidate()
+    cache.Invalidate();
+    CHECK(cache.IsTaskbarWindow(w.toolbar));
+    CHECK(w.system.Calls() == 3 * walk);
+    CHECK(cache.IsTaskbarWindow(w.toolbar));
+    CHECK(w.system.Calls() == 3 * walk);
+    CHECK(cache.GetStats().hits == 2);
+}
+
+}  // namespace
+
+int main() {
+    Verdicts();
+    HitsSkipTheWalk();
+    WalkStopsAtCachedAncestor();
+    VerdictsExpire();
+    return CheckResult();
+}
@@ -0,0 +1,133 @@
+// Times the mods' tree searches over synthetic taskbar trees of 1k to 100k
+// nodes in the deep, wide and multi-monitor shapes. The numbers leave out the
+// COM calls of the live tree, so they show the searches' own cost and how it
+// grows with the tree. --quick runs each search once on the 1k trees.
+
+#include <chrono>
+#include <cstring>
+
+#include "check.h"
+#include "omnibutton_v1.h"
+#include "omnibutton_v2.h"
+#include "taskbar_trees.h"
+
+using namespace host;
+
+namespace {
+
+const wchar_t kOmniButton[] = L"SystemTray.OmniButton#ControlCenterButton";
+const wchar_t* const kTargets[] = {
+    L"SystemTray.OmniButton#ControlCenterButton",
+    L"SystemTray.OmniButton#ControlCenterButton > Grid > ContentPresenter > ItemsPresenter > StackPanel",
+    L"SystemTray.OmniButton#ControlCenterButton > Grid > ContentPresenter > ItemsPresenter > StackPanel > ContentPresenter",
+    L"SystemTray.OmniButton#ControlCenterButton > Grid > ContentPresenter > ItemsPresenter > StackPanel > ContentPresenter > SystemTray.IconView",
+};
+
+bool g_quick = false;
+
+// Runs op until 50 ms have passed, or once with --quick; returns ns per run.
+// op returns something that depends on its work, so it isn't optimized away.
+template <typename Op>
+double TimeOp(Op&& op) {
+    using Clock = std::chrono::steady_clock;
+    auto start = Clock::now();
+    auto elapsed = Clock::duration::zero();
+    uint64_t runs = 0;
+    uintptr_t sink = 0;
+    do {
+        sink += reinterpret_cast<uintptr_t>(op());
+        runs++;
+        elapsed = Clock::now() - start;
+    } while (!g_quick && elapsed < std::chrono::milliseconds(50));
+
+    CHECK(sink != 0);  // every search found something
+    return std::chrono::duration<double, std::nano>(elapsed).count() / static_cast<double>(runs);
+}
+
+void Report(const char* shape, size_t nodes, const char* search, double ns) {
+    std::printf("%-14s %8zu  %-30s %12.0f ns  %7.2f ns/node\n", shape, nodes, search, ns,
+                ns / static_cast<double>(nodes));
+}
+
+void Run(const char* shapeName, const TaskbarShape& shape) {
+    MemoryTree tree;
+    auto root = BuildTaskbarTree(tree, shape);
+    const size_t nodes = tree.Size();
+    const int maxDepth = shape.depth + 16;
+
+    auto isOmniButton = [](const MemoryTree::Node& node) {
+        return MemoryTree::HasClass(node, L"SystemTray.OmniButton") &&
+               MemoryTree::HasName(node, L"ControlCenterButton");
+    };
+
+    Report(shapeName, nodes, "v1 FindDescendant OmniButton", TimeOp([&] {
+               return omnibutton_v1::FindDescendant<MemoryTree>(root, isOmniButton);
+           }));
+
+    Report(shapeName, nodes, "v1 OmniButton + icons", TimeOp([&] {
+               auto omniButton = omnibutton_v1::FindDescendant<MemoryTree>(root, isOmniButton);
+               auto stackPanel = omnibutton_v1::FindDescendant<MemoryTree>(omniButton, [](const auto& node) {
+                   return MemoryTree::HasClass(node, L"Windows.UI.Xaml.Controls.StackPanel");
+               });
+               std::vector<MemoryTree::Node> icons;
+               omnibutton_v1::CollectIconViews<MemoryTree>(stackPanel, icons);
+               return icons.empty() ? nullptr : icons.back();
+           }));
+
+    Report(shapeName, nodes, "v2 TreePathCache miss", TimeOp([&] {
+               TreePathCache<AtomMemoryTree> cache(kOmniButton, maxDepth);
+               return cache.Find(root);
+           }));
+
+    TreePathCache<AtomMemoryTree> cache(kOmniButton, maxDepth);
+    cache.Find(root);
+    Report(shapeName, nodes, "v2 TreePathCache hit", TimeOp([&] { return cache.Find(root); }));
+
+    SelectorAutomaton<AtomMemoryTree> automaton;
+    for (uint32_t i = 0; i < std::size(kTargets); i++) automaton.AddRule(kTargets[i], i);
+    Report(shapeName, nodes, "v2 SelectorAutomaton, 4 rules", TimeOp([&] {
+               MemoryTree::Node last = nullptr;
+               automaton.Match(root, [&](const MemoryTree::Node& node, uint32_t) { last = node; }, maxDepth);
+               return last;
+           }));
+
+    RightToLeftMatcher<AtomMemoryTree> matcher(kTargets[3], 4096);
+    std::vector<MemoryTree::Node> all;
+    all.reserve(nodes);
+    std::vector<MemoryTree::Node> pending = {root};
+    while (!pending.empty()) {
+        auto node = pending.back();
+        pending.pop_back();
+        all.push_back(node);
+        for (auto child : node->children) pending.push_back(child);
+    }
+    Report(shapeName, nodes, "v2 RightToLeftMatcher, all", TimeOp([&] {
+               MemoryTree::Node last = nullptr;
+               for (auto node : all) {
+                   if (matcher.Matches(node)) last = node;
+               }
+               matcher.Clear();
+               return last;
+           }));
+
+    Report(shapeName, nodes, "v2 CaptureTreeSnapshot", TimeOp([&] {
+               auto blob = CaptureTreeSnapshot<AtomMemoryTree>(
+                   root, [](const MemoryTree::Node&, SnapshotProperties&) {}, nodes + 1);
+               return reinterpret_cast<void*>(blob.size());
+           }));
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    g_quick = argc > 1 && std::strcmp(argv[1], "--quick") == 0;
+    g_nameAtoms.Intern(L"ControlCenterButton");  // as InternSelectorNames does
+
+    for (size_t nodes : {size_t{1000}, size_t{10000}, size_t{100000}}) {
+        Run("deep", DeepShape(nodes));
+        Run("wide", WideShape(nodes));
+        Run("multi-monitor", MultiMonitorShape(nodes));
+        if (g_quick) break;
+    }
+    return CheckResult();
+}
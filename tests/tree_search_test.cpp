@@ -0,0 +1,126 @@
+// The mods' tree searches find the OmniButton, its icon StackPanel and its
+// icons in each synthetic taskbar shape, through the same code explorer runs.
+
+#include <functional>
+
+#include "check.h"
+#include "omnibutton_v1.h"
+#include "omnibutton_v2.h"
+#include "taskbar_trees.h"
+
+using namespace host;
+
+namespace {
+
+const wchar_t kOmniButton[] = L"SystemTray.OmniButton#ControlCenterButton";
+const wchar_t* const kTargets[] = {
+    L"SystemTray.OmniButton#ControlCenterButton",
+    L"SystemTray.OmniButton#ControlCenterButton > Grid > ContentPresenter > ItemsPresenter > StackPanel",
+    L"SystemTray.OmniButton#ControlCenterButton > Grid > ContentPresenter > ItemsPresenter > StackPanel > ContentPresenter",
+    L"SystemTray.OmniButton#ControlCenterButton > Grid > ContentPresenter > ItemsPresenter > StackPanel > ContentPresenter > SystemTray.IconView",
+};
+
+// Every node, depth first; the expected answers are found this way
+void ForEachNode(MemoryTree::Node node, const std::function<void(MemoryTree::Node)>& visit) {
+    visit(node);
+    for (auto child : node->children) ForEachNode(child, visit);
+}
+
+struct Expected {
+    MemoryTree::Node omniButton = nullptr;
+    MemoryTree::Node stackPanel = nullptr;
+    std::vector<MemoryTree::Node> icons;
+    int depth = 0;  // of the deepest icon below the root
+};
+
+Expected FindExpected(MemoryTree::Node root) {
+    Expected expected;
+    ForEachNode(root, [&](MemoryTree::Node node) {
+        if (node->name == L"ControlCenterButton" && !expected.omniButton) expected.omniButton = node;
+    });
+    expected.stackPanel = expected.omniButton->children[0]->children[0]->children[0]->children[0];
+    for (auto presenter : expected.stackPanel->children) expected.icons.push_back(presenter->children[0]);
+    for (auto node = expected.icons.back(); node != root; node = node->parent) expected.depth++;
+    return expected;
+}
+
+void V1Searches(MemoryTree::Node root, const Expected& expected) {
+    auto omniButton = omnibutton_v1::FindDescendant<MemoryTree>(root, [](const MemoryTree::Node& node) {
+        return MemoryTree::HasClass(node, L"SystemTray.OmniButton") &&
+               MemoryTree::HasName(node, L"ControlCenterButton");
+    });
+    CHECK(omniButton == expected.omniButton);
+
+    auto stackPanel = omnibutton_v1::FindDescendant<MemoryTree>(omniButton, [](const MemoryTree::Node& node) {
+        return MemoryTree::HasClass(node, L"Windows.UI.Xaml.Controls.StackPanel");
+    });
+    CHECK(stackPanel == expected.stackPanel);
+
+    std::vector<MemoryTree::Node> icons;
+    omnibutton_v1::CollectIconViews<MemoryTree>(stackPanel, icons);
+    CHECK(icons == expected.icons);
+}
+
+void V2Searches(MemoryTree::Node root, const Expected& expected) {
+    TreePathCache<AtomMemoryTree> cache(kOmniButton, expected.depth);
+    CHECK(cache.Find(root) == expected.omniButton);
+    CHECK(cache.Find(root) == expected.omniButton);
+    CHECK(cache.Stats().hits == 1 && cache.Stats().misses == 1);
+
+    SelectorAutomaton<AtomMemoryTree> automaton;
+    for (uint32_t i = 0; i < std::size(kTargets); i++) CHECK(automaton.AddRule(kTargets[i], i));
+    std::vector<std::vector<MemoryTree::Node>> matched(std::size(kTargets));
+    automaton.Match(root, [&](const MemoryTree::Node& node, uint32_t rule) { matched[rule].push_back(node); },
+                    expected.depth);
+    CHECK(matched[0] == std::vector<MemoryTree::Node>{expected.omniButton});
+    CHECK(matched[1] == std::vector<MemoryTree::Node>{expected.stackPanel});
+    CHECK(matched[2].size() == expected.icons.size());
+    CHECK(matched[3] == expected.icons);
+
+    RightToLeftMatcher<AtomMemoryTree> matcher(kTargets[3]);
+    std::vector<MemoryTree::Node> icons;
+    ForEachNode(root, [&](MemoryTree::Node node) {
+        if (matcher.Matches(node)) icons.push_back(node);
+    });
+    CHECK(icons == expected.icons);
+
+    CollectStackIcons<AtomMemoryTree>(expected.stackPanel, icons);
+    CHECK(icons == expected.icons);
+}
+
+// A child inserted above the OmniButton moves it to another index: the
+// cached path goes stale and the next lookup searches again
+void StalePathIsRebuilt() {
+    MemoryTree tree;
+    auto root = BuildTaskbarTree(tree, TaskbarShape{});
+    Expected expected = FindExpected(root);
+
+    TreePathCache<AtomMemoryTree> cache(kOmniButton, expected.depth);
+    CHECK(cache.Find(root) == expected.omniButton);
+
+    auto tray = expected.omniButton->parent;
+    tree.Add(tray, L"Grid");
+    std::rotate(tray->children.rbegin(), tray->children.rbegin() + 1, tray->children.rend());
+
+    CHECK(cache.Find(root) == expected.omniButton);
+    CHECK(cache.Stats().misses == 2);
+}
+
+}  // namespace
+
+int main() {
+    g_nameAtoms.Intern(L"ControlCenterButton");  // as InternSelectorNames does
+
+    for (const TaskbarShape& shape : {TaskbarShape{}, DeepShape(1000), WideShape(1000), MultiMonitorShape(1000)}) {
+        MemoryTree tree;
+        auto root = BuildTaskbarTree(tree, shape);
+        Expected expected = FindExpected(root);
+        CHECK(expected.icons.size() == static_cast<size_t>(shape.omniIcons));
+
+        V1Searches(root, expected);
+        V2Searches(root, expected);
+    }
+
+    StalePathIsRebuilt();
+    return CheckResult();
+}